@@ -0,0 +1,812 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: End-to-end benchmark of txer sending synthetic file sets to
+ *  rxer over loopback, reported as JSON to compare builds with
+ */
+
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define HUGE_BYTES (256ULL << 20)
+#define TINY_FILES 2000
+#define TINY_BYTES 1024
+#define MIXED_FILES 200
+#define MIXED_MIN_BYTES (1 << 10)
+#define MIXED_DOUBLINGS 13 // Mixed sizes range up to 8 MiB
+
+#define KEY_BYTES 32
+#define WRITE_BYTES (1 << 20) // Generated data written at a time
+#define LISTEN_WAIT_MS 5000   // Longest wait for rxer to listen
+#define STOP_WAIT_MS 2000     // Longest wait for rxer to exit on SIGINT
+#define POLL_MS 10	    // Interval commits and CPU time are sampled at
+#define MAX_ARGS 64
+#define LOOPBACK "127.0.0.1"
+
+/*
+ * Files of one benchmark, generated under the working directory
+ */
+typedef struct {
+	char *name;
+	uint32_t files;
+	uint64_t bytes;
+	char *paths; // Comma separated and relative, as txer takes them
+} file_set;
+
+/*
+ * CPU time last seen of a process rxer started for a client. rxer
+ * doesn't wait for them, so their time is never added to its own.
+ */
+typedef struct {
+	pid_t pid;
+	double user;
+	double sys;
+} proc_cpu;
+
+/*
+ * What was measured transferring one set
+ */
+typedef struct {
+	int status; // txer's exit status
+	bool watched; // Whether stored files could be watched for
+	uint32_t committed;
+	double seconds;
+	double *latencies; // Seconds from one stored file to the next
+	uint32_t slots;	   // Latencies there is room for
+	double tx_user, tx_sys;
+	double rx_user, rx_sys;
+	proc_cpu *children;
+	uint32_t n_children;
+} set_result;
+
+/*
+ * Options shared by every set's run
+ */
+typedef struct {
+	char work[PATH_MAX];
+	char txer[PATH_MAX];
+	char rxer[PATH_MAX];
+	char *tx_args;
+	char *rx_args;
+	double scale;
+	uint8_t key[KEY_BYTES];
+} bench;
+
+static __attribute__((noreturn)) void usage(char *bin_path,
+					     int exit_status)
+{
+	char *bin = basename(bin_path);
+
+	fprintf(stderr,
+		"Usage: %s [-b dir] [-a args] [-A args] [-s scale] "
+		"[-w dir] [-o file] [-h]\n\n"
+		"Sends one huge file, %d tiny files and %d files of mixed "
+		"sizes from txer to a fresh rxer over loopback, reporting "
+		"MB/s, files/s, per file latency and CPU time as JSON\n\n"
+		"Options:\n"
+		"-b Directory holding txer and rxer (default .)\n"
+		"-a Extra arguments for txer, space separated\n"
+		"-A Extra arguments for rxer, space separated\n"
+		"-s Scale the huge file's size and the other sets' file counts "
+		"by this factor (default 1)\n"
+		"-w Directory to generate the sets in, kept afterwards "
+		"(default a temporary directory, removed)\n"
+		"-o File to write the report to (default stdout)\n"
+		"-h Help\n\n",
+		bin, TINY_FILES, MIXED_FILES);
+	exit(exit_status);
+}
+
+static void mem_error(void)
+{
+	fprintf(stderr, "Memory allocation failed\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Format a path into the PATH_MAX sized buffer, exiting if it doesn't fit
+ */
+static void make_path(char *path, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(path, PATH_MAX, format, args);
+	va_end(args);
+
+	if (len < 0 || len >= PATH_MAX) {
+		fprintf(stderr, "Path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Return the next number of a xorshift64* generator. The data only has
+ * to be incompressible, not secret.
+ */
+static uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Write size bytes of generated data to the path
+ */
+static void write_file(char *path, uint64_t size, uint64_t *state)
+{
+	static uint64_t buf[WRITE_BYTES / sizeof(uint64_t)];
+	FILE *f = fopen(path, "w");
+	if (NULL == f) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	while (size > 0) {
+		for (size_t i = 0; i < WRITE_BYTES / sizeof(uint64_t); i++)
+			buf[i] = next_random(state);
+
+		size_t len = size < WRITE_BYTES ? size : WRITE_BYTES;
+		if (fwrite(buf, 1, len, f) != len) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		size -= len;
+	}
+
+	fclose(f);
+}
+
+/*
+ * Generate a set of files of the given sizes in a directory named after
+ * the set, under the working directory
+ */
+static file_set *make_set(bench *b, char *name, uint32_t files,
+			  uint64_t *sizes)
+{
+	char dir[PATH_MAX];
+	make_path(dir, "%s/%s", b->work, name);
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+
+	file_set *set = calloc(1, sizeof(file_set));
+	size_t path_len = strlen(name) + 16;
+	char *paths = malloc(files * path_len + 1);
+	if (NULL == set || NULL == paths)
+		mem_error();
+
+	// Seeded by name so no two sets share contents
+	uint64_t state = 0x9E3779B97F4A7C15ULL;
+	for (char *c = name; *c != '\0'; c++)
+		state = state * 31 + *c;
+
+	char *pos = paths;
+	for (uint32_t i = 0; i < files; i++) {
+		pos += sprintf(pos, "%s%s/%c%06u", i > 0 ? "," : "", name,
+			       name[0], i);
+
+		char path[PATH_MAX];
+		make_path(path, "%s/%s/%c%06u", b->work, name, name[0], i);
+		write_file(path, sizes[i], &state);
+		set->bytes += sizes[i];
+	}
+
+	set->name = name;
+	set->files = files;
+	set->paths = paths;
+	return set;
+}
+
+/*
+ * Generate the huge, tiny and mixed sets, scaled. Mixed sizes are spread
+ * evenly over each doubling from MIXED_MIN_BYTES up.
+ */
+static file_set **make_sets(bench *b, int *n_sets)
+{
+	uint32_t tiny = TINY_FILES * b->scale;
+	uint32_t mixed = MIXED_FILES * b->scale;
+	tiny = tiny < 1 ? 1 : tiny;
+	mixed = mixed < 1 ? 1 : mixed;
+
+	file_set **sets = malloc(3 * sizeof(file_set *));
+	uint64_t *sizes =
+	    malloc((tiny > mixed ? tiny : mixed) * sizeof(uint64_t));
+	if (NULL == sets || NULL == sizes)
+		mem_error();
+
+	sizes[0] = HUGE_BYTES * b->scale;
+	sets[0] = make_set(b, "huge", 1, sizes);
+
+	for (uint32_t i = 0; i < tiny; i++)
+		sizes[i] = TINY_BYTES;
+	sets[1] = make_set(b, "tiny", tiny, sizes);
+
+	uint64_t state = MIXED_FILES;
+	for (uint32_t i = 0; i < mixed; i++) {
+		uint64_t low = (uint64_t)MIXED_MIN_BYTES
+			       << next_random(&state) % MIXED_DOUBLINGS;
+		sizes[i] = low + next_random(&state) % low;
+	}
+	sets[2] = make_set(b, "mixed", mixed, sizes);
+
+	free(sizes);
+	*n_sets = 3;
+	return sets;
+}
+
+/*
+ * Return a loopback port free at the time of asking
+ */
+static uint16_t free_port(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&addr, len) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+		perror("port");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	return ntohs(addr.sin_port);
+}
+
+/*
+ * Returns true once something listens on the loopback port. Binding is
+ * tried rather than connecting, which rxer would take for a client.
+ */
+static bool port_taken(uint16_t port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	bool taken = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+		     errno == EADDRINUSE;
+	close(fd);
+	return taken;
+}
+
+/*
+ * Split the space separated arguments onto the end of argv, which holds
+ * n of them already. Returns the new count.
+ */
+static int add_args(char **argv, int n, char *args)
+{
+	if (NULL == args)
+		return n;
+
+	char *copy = strdup(args);
+	if (NULL == copy)
+		mem_error();
+
+	for (char *a = strtok(copy, " "); NULL != a && n < MAX_ARGS;
+	     a = strtok(NULL, " "))
+		argv[n++] = a;
+
+	return n;
+}
+
+/*
+ * Start the program of argv in the directory, its output going to the
+ * log file
+ */
+static pid_t spawn(char *dir, char **argv, char *log)
+{
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid > 0)
+		return pid;
+
+	int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (chdir(dir) == -1 || fd == -1) {
+		perror(dir);
+		_exit(127);
+	}
+
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+	execv(argv[0], argv);
+	perror(argv[0]);
+	_exit(127);
+}
+
+/*
+ * Wait for the process, returning its exit status and adding the CPU
+ * time it and the children it waited for used
+ */
+static int reap(pid_t pid, double *user, double *sys)
+{
+	struct rusage before, after;
+	int status;
+
+	getrusage(RUSAGE_CHILDREN, &before);
+	waitpid(pid, &status, 0);
+	getrusage(RUSAGE_CHILDREN, &after);
+
+	*user += tv_seconds(after.ru_utime) - tv_seconds(before.ru_utime);
+	*sys += tv_seconds(after.ru_stime) - tv_seconds(before.ru_stime);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * Record the CPU time of each process the parent started, the last
+ * sample of each counting once it is gone
+ */
+static void sample_children(pid_t parent, set_result *res)
+{
+#ifdef __linux__
+	DIR *proc = opendir("/proc");
+	if (NULL == proc)
+		return;
+
+	double tick = sysconf(_SC_CLK_TCK);
+	struct dirent *e;
+	while ((e = readdir(proc)) != NULL) {
+		pid_t pid = atoi(e->d_name);
+		if (pid <= 0)
+			continue;
+
+		char path[64], line[512];
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		FILE *f = fopen(path, "r");
+		if (NULL == f)
+			continue;
+		bool read = fgets(line, sizeof(line), f) != NULL;
+		fclose(f);
+
+		// The command name may hold anything, fields follow its ')'
+		char *fields = read ? strrchr(line, ')') : NULL;
+		int ppid;
+		unsigned long utime, stime;
+		if (NULL == fields ||
+		    sscanf(fields + 1,
+			   " %*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   &ppid, &utime, &stime) != 3 ||
+		    ppid != parent)
+			continue;
+
+		uint32_t i = 0;
+		while (i < res->n_children && res->children[i].pid != pid)
+			i++;
+		if (i == res->n_children) {
+			res->children =
+			    realloc(res->children, (i + 1) * sizeof(proc_cpu));
+			if (NULL == res->children)
+				mem_error();
+			res->children[i].pid = pid;
+			res->n_children++;
+		}
+
+		res->children[i].user = utime / tick;
+		res->children[i].sys = stime / tick;
+	}
+
+	closedir(proc);
+#else
+	(void)parent;
+	(void)res;
+#endif
+}
+
+/*
+ * Open a watch for files stored in the directory, or return -1 where
+ * that isn't supported
+ */
+static int watch_stored(char *dir)
+{
+#ifdef __linux__
+	int fd = inotify_init1(IN_NONBLOCK);
+	if (fd != -1 && inotify_add_watch(fd, dir, IN_MOVED_TO) == -1) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+#else
+	(void)dir;
+	return -1;
+#endif
+}
+
+/*
+ * Record the files stored since the last call, each timed from the one
+ * stored before it. rxer renames a file into place once it checks out,
+ * under its hash; names starting with a dot are its own bookkeeping.
+ */
+static void read_stored(int fd, set_result *res, double *last)
+{
+#ifdef __linux__
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		double t = now();
+		for (char *p = buf; p < buf + len;) {
+			struct inotify_event *e = (struct inotify_event *)p;
+			// Files stored beyond the set's aren't timed
+			if (e->len > 0 && e->name[0] != '.' &&
+			    res->committed < res->slots) {
+				res->latencies[res->committed++] = t - *last;
+				*last = t;
+			}
+			p += sizeof(struct inotify_event) + e->len;
+		}
+	}
+#else
+	(void)fd;
+	(void)res;
+	(void)last;
+#endif
+}
+
+/*
+ * Send the set from a fresh txer to a fresh rxer, each in its own
+ * directory under the working one, and measure the transfer
+ */
+static void run_set(bench *b, file_set *set, set_result *res)
+{
+	uint16_t port = free_port();
+	uint16_t l_port = free_port();
+	char srv[PATH_MAX], path[PATH_MAX], log[PATH_MAX];
+
+	make_path(srv, "%s/%s.rxer", b->work, set->name);
+	make_path(path, "%s/keys", srv);
+	mkdir(srv, 0755);
+	mkdir(path, 0755);
+
+	make_path(path, "%s/keys/%s:%u", srv, LOOPBACK, l_port);
+	FILE *f = fopen(path, "w");
+	if (NULL == f || fwrite(b->key, 1, KEY_BYTES, f) != KEY_BYTES) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+
+	// The client's directory is made up front to watch it from the
+	// start
+	make_path(path, "%s/received", srv);
+	mkdir(path, 0755);
+	make_path(path, "%s/received/%s:%u", srv, LOOPBACK, l_port);
+	mkdir(path, 0755);
+	int watch = watch_stored(path);
+	res->watched = watch != -1;
+	res->slots = set->files + 1;
+	res->latencies = calloc(res->slots, sizeof(double));
+	if (NULL == res->latencies)
+		mem_error();
+
+	char port_arg[16], local[32], remote[32];
+	snprintf(port_arg, sizeof(port_arg), "%u", port);
+	snprintf(local, sizeof(local), "%s:%u", LOOPBACK, l_port);
+	snprintf(remote, sizeof(remote), "%s:%u", LOOPBACK, port);
+
+	char *rx_argv[MAX_ARGS + 1] = {b->rxer, "-p", port_arg};
+	rx_argv[add_args(rx_argv, 3, b->rx_args)] = NULL;
+	make_path(log, "%s/%s.rxer.log", b->work, set->name);
+	pid_t rx = spawn(srv, rx_argv, log);
+
+	double deadline = now() + LISTEN_WAIT_MS / 1e3;
+	while (!port_taken(port) && waitpid(rx, NULL, WNOHANG) == 0) {
+		if (now() > deadline) {
+			fprintf(stderr, "rxer didn't listen, see %s\n", log);
+			exit(EXIT_FAILURE);
+		}
+		usleep(POLL_MS * 1000);
+	}
+
+	char *tx_argv[MAX_ARGS + 1] = {b->txer, "-f", set->paths, "-l",
+				       local,   "-r", remote,     "-k",
+				       ".key"};
+	tx_argv[add_args(tx_argv, 9, b->tx_args)] = NULL;
+	make_path(log, "%s/%s.txer.log", b->work, set->name);
+
+	double start = now(), last = start;
+	pid_t tx = spawn(b->work, tx_argv, log);
+
+	// Stored files and the CPU time of rxer's children are sampled
+	// until txer is done
+	struct pollfd pfd = {.fd = watch, .events = POLLIN};
+	siginfo_t info;
+	do {
+		poll(&pfd, watch != -1, POLL_MS);
+		if (watch != -1)
+			read_stored(watch, res, &last);
+		sample_children(rx, res);
+
+		memset(&info, 0, sizeof(info));
+		waitid(P_PID, tx, &info, WEXITED | WNOHANG | WNOWAIT);
+	} while (info.si_pid == 0);
+
+	res->seconds = now() - start;
+	res->status = reap(tx, &res->tx_user, &res->tx_sys);
+	if (watch != -1) {
+		read_stored(watch, res, &last);
+		close(watch);
+	}
+
+	kill(rx, SIGINT);
+	deadline = now() + STOP_WAIT_MS / 1e3;
+	while (waitid(P_PID, rx, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+	       info.si_pid == 0 && now() < deadline)
+		usleep(POLL_MS * 1000);
+	if (info.si_pid == 0)
+		kill(rx, SIGKILL);
+	reap(rx, &res->rx_user, &res->rx_sys);
+
+	for (uint32_t i = 0; i < res->n_children; i++) {
+		res->rx_user += res->children[i].user;
+		res->rx_sys += res->children[i].sys;
+	}
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Return the nearest-rank percentile of n sorted values
+ */
+static double percentile(double *sorted, uint32_t n, double p)
+{
+	uint32_t rank = (p / 100 * n) + 0.999999;
+	if (rank < 1)
+		rank = 1;
+	return sorted[rank - 1];
+}
+
+/*
+ * Write the string as a JSON string
+ */
+static void json_string(FILE *out, char *s)
+{
+	fputc('"', out);
+	for (; NULL != s && *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void report(FILE *out, bench *b, file_set **sets,
+		   set_result *results, int n_sets)
+{
+	fprintf(out, "{\n  \"txer_args\": ");
+	json_string(out, b->tx_args);
+	fprintf(out, ",\n  \"rxer_args\": ");
+	json_string(out, b->rx_args);
+	fprintf(out, ",\n  \"scale\": %g,\n  \"sets\": [\n", b->scale);
+
+	for (int i = 0; i < n_sets; i++) {
+		file_set *set = sets[i];
+		set_result *r = &results[i];
+		double secs = r->seconds > 0 ? r->seconds : 1e-9;
+
+		fprintf(out,
+			"    {\n"
+			"      \"name\": \"%s\",\n"
+			"      \"files\": %u,\n"
+			"      \"bytes\": %llu,\n"
+			"      \"txer_status\": %d,\n"
+			"      \"seconds\": %.6f,\n"
+			"      \"mb_per_s\": %.3f,\n"
+			"      \"files_per_s\": %.3f,\n",
+			set->name, set->files, (unsigned long long)set->bytes,
+			r->status, r->seconds, set->bytes / 1e6 / secs,
+			set->files / secs);
+
+		if (r->watched && r->committed > 0) {
+			qsort(r->latencies, r->committed, sizeof(double),
+			      compare_doubles);
+			fprintf(out,
+				"      \"committed\": %u,\n"
+				"      \"latency_ms\": {\"p50\": %.3f, "
+				"\"p99\": %.3f},\n",
+				r->committed,
+				percentile(r->latencies, r->committed, 50) * 1e3,
+				percentile(r->latencies, r->committed, 99) * 1e3);
+		} else {
+			fprintf(out, "      \"committed\": %s,\n"
+				     "      \"latency_ms\": null,\n",
+				r->watched ? "0" : "null");
+		}
+
+		fprintf(out,
+			"      \"cpu_s\": {\n"
+			"        \"txer\": {\"user\": %.3f, \"sys\": %.3f},\n"
+			"        \"rxer\": {\"user\": %.3f, \"sys\": %.3f}\n"
+			"      }\n"
+			"    }%s\n",
+			r->tx_user, r->tx_sys, r->rx_user, r->rx_sys,
+			i < n_sets - 1 ? "," : "");
+	}
+
+	fprintf(out, "  ]\n}\n");
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+			struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	bench b;
+	char *bin_dir = ".", *work = NULL, *out_path = NULL;
+	memset(&b, 0, sizeof(b));
+	b.scale = 1;
+
+	while ((opt = getopt(argc, argv, "b:a:A:s:w:o:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			bin_dir = optarg;
+			break;
+		case 'a':
+			b.tx_args = optarg;
+			break;
+		case 'A':
+			b.rx_args = optarg;
+			break;
+		case 's':
+			b.scale = atof(optarg);
+			if (b.scale <= 0)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'w':
+			work = optarg;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	char resolved[PATH_MAX];
+	if (NULL == realpath(bin_dir, resolved)) {
+		perror(bin_dir);
+		exit(EXIT_FAILURE);
+	}
+	make_path(b.txer, "%s/txer", resolved);
+	make_path(b.rxer, "%s/rxer", resolved);
+
+	if (NULL == work) {
+		char tmp[] = "/tmp/eftbench.XXXXXX";
+		if (NULL == mkdtemp(tmp)) {
+			perror("mkdtemp");
+			exit(EXIT_FAILURE);
+		}
+		snprintf(b.work, sizeof(b.work), "%s", tmp);
+	} else if ((mkdir(work, 0755) == -1 && errno != EEXIST) ||
+		   NULL == realpath(work, b.work)) {
+		perror(work);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *out = stdout;
+	if (NULL != out_path && NULL == (out = fopen(out_path, "w"))) {
+		perror(out_path);
+		exit(EXIT_FAILURE);
+	}
+
+	// One key serves every set, txer reads it from the working directory
+	FILE *rnd = fopen("/dev/urandom", "r");
+	char key_path[PATH_MAX];
+	make_path(key_path, "%s/.key", b.work);
+	FILE *key = fopen(key_path, "w");
+	if (NULL == rnd || NULL == key ||
+	    fread(b.key, 1, KEY_BYTES, rnd) != KEY_BYTES ||
+	    fwrite(b.key, 1, KEY_BYTES, key) != KEY_BYTES) {
+		perror("key");
+		exit(EXIT_FAILURE);
+	}
+	fclose(rnd);
+	fclose(key);
+
+	int n_sets;
+	fprintf(stderr, "Generating file sets in %s...\n", b.work);
+	file_set **sets = make_sets(&b, &n_sets);
+
+	set_result *results = calloc(n_sets, sizeof(set_result));
+	if (NULL == results)
+		mem_error();
+
+	int status = EXIT_SUCCESS;
+	for (int i = 0; i < n_sets; i++) {
+		fprintf(stderr, "Sending %s set (%u files, %llu bytes)...\n",
+			sets[i]->name, sets[i]->files,
+			(unsigned long long)sets[i]->bytes);
+		run_set(&b, sets[i], &results[i]);
+		if (results[i].status != 0)
+			status = EXIT_FAILURE;
+	}
+
+	report(out, &b, sets, results, n_sets);
+	if (out != stdout)
+		fclose(out);
+
+	if (NULL == work)
+		nftw(b.work, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	for (int i = 0; i < n_sets; i++) {
+		free(sets[i]->paths);
+		free(sets[i]);
+		free(results[i].latencies);
+		free(results[i].children);
+	}
+	free(sets);
+	free(results);
+	return status;
+}
@@ -6,22 +6,52 @@
  *  Purpose: Client (txer) entry point.
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <gcrypt.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "compress.h"
 #include "datalist.h"
+#include "dedupe.h"
+#include "digest.h"
 #include "filesys.h"
+#include "hashcache.h"
 #include "net.h"
 #include "parser.h"
+#include "ring.h"
+#include "stats.h"
+#include "tune.h"
 #include "ui.h"
+#include "uring.h"
+
+// Files are only striped when each connection gets at least this many chunks
+#define STRIPE_MIN_CHUNKS 32
+
+// Stages of the threaded send pipeline
+#define STAGE_READ 0
+#define STAGE_ENCRYPT 1
+#define STAGE_SEND 2
+#define TX_STAGES 3
+#define DEFAULT_RING_DEPTH 8
+#define MAX_RING_DEPTH 4096
+#define PIPELINE_MIN_CHUNKS 16 // Smaller ranges are sent serially
+#define MAX_ENCRYPT_THREADS 4
+
+#define MAX_HASH_THREADS 64
+#define DEFAULT_HASH_THREADS 8
 
 /*
  * Encapsulate client-specific fields for a file transfer
@@ -30,13 +60,139 @@ typedef struct {
 	uint8_t *key;
 	uint8_t *vector;
 	data_head *transferring;
+	data_head *striped; // Large files sent over many connections
 
 	char *l_port;
 	char *l_ip;
 	char *r_port;
 	char *r_ip;
+
+	int stripes;
+	char **stripe_ips; // Local ips stripes are spread over, may be NULL
+	uint16_t n_stripe_ips;
+
+	int depth; // Chunks buffered between send stages, 0 sends serially
+	bool batched; // Pipelined I/O goes through io_uring when available
+	chunk_tuner *tuner;
+	transfer_stats *st; // Whole files then striped ones, NULL if not timed
 } client;
 
+/*
+ * Everything needed to send files on one connection
+ */
+typedef struct {
+	int sfd;
+	gcry_cipher_hd_t hd;
+	uint8_t *key;
+	data_head *list; // Transfer the files belong to
+	prg_bar *pb;     // May be NULL
+	int depth;
+	bool batched;
+	compressor *z; // NULL unless chunks are compressed
+	int *results;  // Results read while sending a packed stream, or NULL
+	uint64_t sent;    // Bytes of files sent, to measure the link with
+	uint64_t started; // When the first of them was sent
+	transfer_stats *st; // NULL unless stages are timed
+	uint32_t file;	    // Index in st of the file being sent
+} sender;
+
+/*
+ * A range of bytes of a file
+ */
+typedef struct {
+	uint64_t offset;
+	uint64_t len;
+} extent;
+
+/*
+ * Where the bytes sent for a file come from: ranges of the open file
+ * read back to back. A packed stream reads each range from its own
+ * file, opened in turn.
+ */
+typedef struct {
+	FILE *f;
+	char **paths; // File of each range, NULL when all are of f
+	extent *extents;
+	uint32_t n_extents;
+	uint32_t cur;	   // Extent being read
+	uint64_t cur_read; // Bytes read of it so far
+} source;
+
+/*
+ * A thread running the read or encrypt stage of the send pipeline
+ */
+typedef struct {
+	sender *s;
+	ring *r;
+	gcry_cipher_hd_t hd; // Encryption stages only
+	uint32_t idx;	// Index of the file in the transfer
+	source *src;	     // Read stage only
+	uint64_t offset;
+	uint64_t len;
+	pthread_t thread;
+} tx_worker;
+
+/*
+ * A piece of hashing work: a whole file, or one node of a file's tree
+ * hash
+ */
+typedef struct {
+	uint32_t file;
+	uint32_t node;
+} hash_unit;
+
+/*
+ * Units waiting to be hashed by one thread, a run of the pool's units
+ */
+typedef struct {
+	uint32_t head; // Taken by the owning thread
+	uint32_t tail; // Stolen by other threads
+	pthread_mutex_t lock;
+} hash_queue;
+
+/*
+ * Files being hashed by a pool of threads. Hashes are stored at the
+ * file's index, so they stay in the order the files were given. Tree
+ * hashes are split into a unit per node, the nodes are combined into
+ * each file's hash once the pool is done.
+ */
+typedef struct {
+	char **paths;
+	uint8_t **hashes;
+	uint8_t **nodes; // Tree hashes only, node digests of each file
+	uint8_t algo;
+	hash_unit *units;
+	hash_queue *queues;
+	int n_queues;
+
+	pthread_mutex_t lock; // Guards the progress below
+	uint32_t *units_left; // Units of each file not hashed yet
+	uint32_t files_done;
+	uint64_t bytes_done;
+} hash_pool;
+
+/*
+ * A thread hashing files from the pool
+ */
+typedef struct {
+	hash_pool *pool;
+	int id; // Index of the thread's own queue
+	pthread_t thread;
+} hash_worker;
+
+/*
+ * A single stripe of a file sent on its own connection
+ */
+typedef struct {
+	client *c;
+	data_node *file;
+	uint8_t stripe;
+	uint8_t *nonce;	     // The same for every stripe of an attempt
+	uint32_t file_idx;   // Index of the file in the client's stats
+	uint32_t chunk_size; // The same for every stripe of the file
+	int transfer;	     // Result of the stripe
+} stripe_job;
+
 /*
  * Display a usage message and exit with the given status
  */
@@ -46,7 +202,10 @@ static void usage(char *bin_path, int exit_status)
 
 	fprintf(
 	    stderr,
-	    "Usage: %s -f files -l [ip]:port [-r [ip]:port] [-k key] [-h]\n\n"
+	    "Usage: %s -f files -l [ip]:port [-r [ip]:port] [-k key] [-p] "
+	    "[-s stripes] [-L ips] [-c cipher] [-d depth] [-C cache] [-R] "
+	    "[-j threads] [-H hash] [-D] [-u] [-z] [-P] [-S size] [-U] "
+	    "[-T] [-h]\n\n"
 	    "Options:\n"
 	    "-f Comma separated path(s) to file(s) to transfer (eg: "
 	    "file1,file2)\n"
@@ -55,15 +214,47 @@ static void usage(char *bin_path, int exit_status)
 	    "-l Local address ip:port (default ip is localhost, default port "
 	    "is random)\n"
 	    "-k Path to 256 bit AES encryption key (default %s)\n"
+	    "-p Pipeline files back-to-back without waiting for the server "
+	    "between them\n"
+	    "-s Number of connections to stripe large files over (default "
+	    "1)\n"
+	    "-L Comma separated local ips to spread striped connections over "
+	    "(requires the ip in -l)\n"
+	    "-c Cipher mode, cbc, ctr or gcm (default cbc)\n"
+	    "-d Chunks buffered between the read, encrypt and send stages, 0 "
+	    "to send serially (default %d)\n"
+	    "-C Path to the cache of file hashes, reused while a file's "
+	    "size and modification time are unchanged (default %s)\n"
+	    "-R Rehash every file, replacing the cached hashes\n"
+	    "-j Threads hashing files (default one per core, up to %d)\n"
+	    "-H Hash algorithm, sha1, sha256, blake2b or tree, a SHA-256 "
+	    "tree over the file's chunks hashed in parallel (default sha1)\n"
+	    "-D Deduplicate chunks, only sending the parts of each file the "
+	    "server doesn't already hold (not with -p or -s)\n"
+	    "-u Resume files an earlier attempt left part of on the server, "
+	    "where the server supports it (not with -D)\n"
+	    "-z Compress chunks before encrypting them, at a level adapting "
+	    "to the link's speed\n"
+	    "-P Pack files into one stream, only padding its end, for many "
+	    "small files (implies -p)\n"
+	    "-S Chunk size in bytes, a power of two from %d to %d, or auto "
+	    "to tune it to the link's throughput, remembered in %s "
+	    "(default %d)\n"
+	    "-U Batch the reads and sends of pipelined files through "
+	    "io_uring, where the kernel supports it\n"
+	    "-T Time the read, randomize, compress, encrypt and send stages, "
+	    "reporting them per file and for the session\n"
 	    "-h Help\n\n",
-	    bin, DEFAULT_SERVER_PORT, DEFAULT_KEY_PATH);
+	    bin, DEFAULT_SERVER_PORT, DEFAULT_KEY_PATH, DEFAULT_RING_DEPTH,
+	    DEFAULT_HASH_CACHE, DEFAULT_HASH_THREADS, MIN_CHUNK_SIZE,
+	    MAX_CHUNK_SIZE, DEFAULT_TUNE_PATH, DEFAULT_CHUNK_SIZE);
 	exit(exit_status);
 }
 
 /*
  * Parse comma separated file paths into an array of strings.
  */
-static char **parse_filepaths(char *file_paths, uint16_t file_cnt)
+static char **parse_filepaths(char *file_paths, uint32_t file_cnt)
 {
 	char **paths = malloc(file_cnt * sizeof(char *));
 
@@ -94,69 +285,292 @@ static char **parse_filepaths(char *file_paths, uint16_t file_cnt)
 }
 
 /*
- * Generate hashes for each file are transferring. Returns
- * an array of pointers to hashes in the same order as the argument.
- * Will return NULL if one of the file paths is invalid.
+ * Return the next unit for the given hashing thread: the front of its
+ * own queue, or the back of another thread's when its own is empty.
+ * Returns NULL once every queue is empty.
  */
-static uint8_t **generate_hashes(char **to_transfer, uint16_t num_files)
+static hash_unit *next_hash_unit(hash_pool *pool, int id)
 {
-	uint8_t **hashes = malloc(num_files * sizeof(uint8_t *));
-	if (NULL == hashes)
-		mem_error();
+	hash_queue *own = &pool->queues[id];
+	hash_unit *unit = NULL;
+
+	pthread_mutex_lock(&own->lock);
+	if (own->head < own->tail)
+		unit = &pool->units[own->head++];
+	pthread_mutex_unlock(&own->lock);
+
+	for (int k = 1; NULL == unit && k < pool->n_queues; k++) {
+		hash_queue *q = &pool->queues[(id + k) % pool->n_queues];
+
+		pthread_mutex_lock(&q->lock);
+		if (q->head < q->tail)
+			unit = &pool->units[--q->tail];
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return unit;
+}
+
+/*
+ * Count the given number of bytes as hashed
+ */
+static void hash_progress(hash_pool *pool, uint32_t len)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->bytes_done += len;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Hash the whole of the given file of the pool with the given digest
+ */
+static void hash_whole(hash_pool *pool, uint32_t file, FILE *f,
+		       digest_ctx *md, uint8_t *buf)
+{
+	while (!TERMINATED) {
+		int len = fread(buf, 1, TREE_LEAF_SIZE, f);
+		digest_write(md, buf, len);
+		hash_progress(pool, len);
+
+		if (len < TREE_LEAF_SIZE)
+			break;
+	}
+
+	memcpy(pool->hashes[file], digest_final(md), hash_bytes(pool->algo));
+	digest_reset(md);
+}
+
+/*
+ * Hash the leaves of one node of the given file's tree hash
+ */
+static void hash_node(hash_pool *pool, hash_unit *u, FILE *f, uint8_t *buf)
+{
+	uint32_t hash_len = hash_bytes(HASH_TREE);
+	uint8_t leaves[TREE_FANOUT * MAX_HASH_BYTES];
+	uint32_t n = 0;
+
+	off_t start = (off_t)u->node * TREE_FANOUT * TREE_LEAF_SIZE;
+	if (fseeko(f, start, SEEK_SET) == -1) {
+		perror("fseeko");
+		exit(EXIT_FAILURE);
+	}
+
+	while (!TERMINATED && n < TREE_FANOUT) {
+		int len = fread(buf, 1, TREE_LEAF_SIZE, f);
+		if (len == 0)
+			break;
+
+		tree_leaf(buf, len, leaves + n * hash_len);
+		hash_progress(pool, len);
+		n++;
+
+		if (len < TREE_LEAF_SIZE)
+			break;
+	}
+
+	tree_node(leaves, n, pool->nodes[u->file] + u->node * hash_len);
+}
+
+/*
+ * Hash units taken from the pool until none are left
+ */
+static void *hash_files(void *arg)
+{
+	hash_worker *w = arg;
+	hash_pool *pool = w->pool;
+	uint8_t *tmpbuf = aligned_buffer(TREE_LEAF_SIZE);
+	digest_ctx *md = digest_open(pool->algo);
+	hash_unit *u;
+
+	while (!TERMINATED && (u = next_hash_unit(pool, w->id)) != NULL) {
+		FILE *f = fopen(pool->paths[u->file], "r");
+		if (NULL == f) {
+			fprintf(stderr, "%.*s: %s\n", NAME_BYTES,
+				pool->paths[u->file], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (pool->algo == HASH_TREE)
+			hash_node(pool, u, f, tmpbuf);
+		else
+			hash_whole(pool, u->file, f, md, tmpbuf);
+		fclose(f);
 
-	gcry_md_hd_t hd;
-	uint8_t tmpbuf[CHUNK_SIZE];
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->units_left[u->file] == 0)
+			pool->files_done++;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	digest_close(md);
+	free(tmpbuf);
+	return NULL;
+}
 
-	gcry_error_t err = gcry_md_open(&hd, HASH_ALGO, 0);
-	g_error(err);
+/*
+ * Hash the given units of the pool, covering the given number of
+ * files, over the given number of threads. Each thread starts with a
+ * contiguous run of the units. The spinner shows the progress of every
+ * thread together.
+ */
+static void run_hash_pool(hash_pool *pool, uint32_t n_units, uint32_t n_files,
+			  int threads)
+{
+	hash_worker workers[MAX_HASH_THREADS];
+	hash_queue queues[MAX_HASH_THREADS];
+
+	if ((uint32_t)threads > n_units)
+		threads = n_units > 0 ? n_units : 1;
+
+	pool->queues = queues;
+	pool->n_queues = threads;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	for (int t = 0; t < threads; t++) {
+		queues[t].head = (uint64_t)n_units * t / threads;
+		queues[t].tail = (uint64_t)n_units * (t + 1) / threads;
+		pthread_mutex_init(&queues[t].lock, NULL);
+
+		workers[t].pool = pool;
+		workers[t].id = t;
+		pthread_create(&workers[t].thread, NULL, hash_files, &workers[t]);
+	}
 
+	char desc[NAME_BYTES];
 	spinner *s = init_spinner("Hashing");
+	spin_reset(s, desc);
 
-	// Hash each file and store it. We will re-use the cipher handle
-	for (int i = 0; i < num_files; i++) {
-		spin_reset(s, basename(to_transfer[i]));
+	const struct timespec tick = {.tv_sec = 0, .tv_nsec = 50000000};
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		uint32_t files_done = pool->files_done;
+		uint64_t bytes_done = pool->bytes_done;
+		pthread_mutex_unlock(&pool->lock);
 
-		hashes[i] = malloc(HASH_BYTES);
+		snprintf(desc, sizeof(desc), "%u/%u files, %.1f MB   ",
+			 files_done, n_files, bytes_done / 1000000.0);
+		spin_update(s);
+
+		if (files_done == n_files || TERMINATED)
+			break;
+		nanosleep(&tick, NULL);
+	}
+
+	for (int t = 0; t < threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		pthread_mutex_destroy(&queues[t].lock);
+	}
+
+	spin_destroy(s);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Generate hashes of the given algorithm for each file are
+ * transferring. Returns an array of pointers to hashes in the same
+ * order as the argument. Will return NULL if one of the file paths is
+ * invalid. Files unchanged since they were cached aren't read, the
+ * cache may be NULL. The rest are hashed over the given number of
+ * threads.
+ */
+static uint8_t **generate_hashes(char **to_transfer, uint32_t num_files,
+				 hash_cache *cache, int threads, uint8_t algo)
+{
+	uint8_t **hashes = malloc(num_files * sizeof(uint8_t *));
+	uint8_t **nodes = calloc(num_files, sizeof(uint8_t *));
+	uint32_t *units_left = calloc(num_files, sizeof(uint32_t));
+	struct stat *stats = malloc(num_files * sizeof(struct stat));
+	uint32_t *order = malloc(num_files * sizeof(uint32_t));
+	if (NULL == hashes || NULL == nodes || NULL == units_left ||
+	    NULL == stats || NULL == order)
+		mem_error();
+
+	// Only files missing from the cache are handed to the pool, a tree
+	// hash as a unit per node so a large file is spread over threads
+	uint32_t n_pending = 0;
+	uint32_t n_units = 0;
+	for (uint32_t i = 0; i < num_files; i++) {
+		hashes[i] = calloc(MAX_HASH_BYTES, 1);
 		if (NULL == hashes[i])
 			mem_error();
 
-		FILE *f = fopen(to_transfer[i], "r");
-		if (NULL == f) {
+		if (stat(to_transfer[i], &stats[i]) == -1) {
 			fprintf(stderr, "%.*s: %s\n", NAME_BYTES,
 				to_transfer[i], strerror(errno));
 			exit(EXIT_FAILURE);
 		}
 
-		while (!TERMINATED) {
-			int len = fread(tmpbuf, 1, CHUNK_SIZE, f);
-			gcry_md_write(hd, tmpbuf, len);
-			spin_update(s);
+		if (NULL != cache &&
+		    hashcache_lookup(cache, &stats[i], hashes[i]))
+			continue;
 
-			if (len < CHUNK_SIZE)
-				break;
+		order[n_pending++] = i;
+		units_left[i] = 1;
+		if (algo == HASH_TREE) {
+			units_left[i] = tree_nodes(stats[i].st_size);
+			nodes[i] = malloc(units_left[i] * MAX_HASH_BYTES);
+			if (NULL == nodes[i])
+				mem_error();
 		}
+		n_units += units_left[i];
+	}
 
-		uint8_t *digest = gcry_md_read(hd, HASH_ALGO);
-		memcpy(hashes[i], digest, HASH_BYTES);
-		gcry_md_reset(hd);
-		fclose(f);
+	hash_unit *units = malloc(n_units * sizeof(hash_unit));
+	if (n_units > 0 && NULL == units)
+		mem_error();
+
+	uint32_t u = 0;
+	for (uint32_t i = 0; i < n_pending; i++) {
+		for (uint32_t node = 0; node < units_left[order[i]]; node++) {
+			units[u].file = order[i];
+			units[u++].node = node;
+		}
 	}
 
-	spin_destroy(s);
-	gcry_md_close(hd);
+	time_t hashed_at = time(NULL);
+	hash_pool pool = {.paths = to_transfer,
+			  .hashes = hashes,
+			  .nodes = nodes,
+			  .algo = algo,
+			  .units = units,
+			  .units_left = units_left};
+	if (n_pending > 0)
+		run_hash_pool(&pool, n_units, n_pending, threads);
+
+	for (uint32_t i = 0; i < n_pending && algo == HASH_TREE; i++) {
+		uint32_t f = order[i];
+		tree_root(nodes[f], tree_nodes(stats[f].st_size),
+			  stats[f].st_size, hashes[f]);
+	}
+
+	for (uint32_t i = 0; i < n_pending && NULL != cache && !TERMINATED; i++)
+		hashcache_store(cache, &stats[order[i]], hashes[order[i]],
+				hashed_at);
+
+	if (NULL != cache)
+		fprintf(stdout, "Hash cache: %u hits, %u misses\n", cache->hits,
+			cache->misses);
+
+	for (uint32_t i = 0; i < num_files; i++)
+		free(nodes[i]);
+	free(nodes);
+	free(units);
+	free(units_left);
+	free(stats);
+	free(order);
 	return hashes;
 }
 
 /*
  * Return a list of sizes of each file to be transferred
  */
-static uint32_t *parse_sizes(char **to_transfer, uint16_t num_files)
+static uint64_t *parse_sizes(char **to_transfer, uint32_t num_files)
 {
-	uint32_t *sizes = malloc(num_files * sizeof(uint32_t));
+	uint64_t *sizes = malloc(num_files * sizeof(uint64_t));
 	if (NULL == sizes)
 		mem_error();
 
-	for (int i = 0; i < num_files; i++) {
+	for (uint32_t i = 0; i < num_files; i++) {
 		sizes[i] = filesize(to_transfer[i]);
 	}
 
@@ -167,10 +581,10 @@ static uint32_t *parse_sizes(char **to_transfer, uint16_t num_files)
  * Parse the number of files that are comma separated in the command
  * line argument for files that should be transferred
  */
-static uint16_t parse_file_cnt(char *files_arg)
+static uint32_t parse_file_cnt(char *files_arg)
 {
 	int paths_len = strlen(files_arg);
-	uint16_t file_cnt = 1;
+	uint32_t file_cnt = 1;
 
 	for (int i = 0; i < paths_len; i++) {
 		if (files_arg[i] == ',')
@@ -181,23 +595,87 @@ static uint16_t parse_file_cnt(char *files_arg)
 }
 
 /*
- * Parse the next file requested by the server to transfer
+ * Parse the chunk size argument: auto, or a number of bytes with an
+ * optional k or m suffix. Returns 0 for auto, -1 for a size the
+ * protocol doesn't allow.
  */
-static uint16_t parse_next_file(uint8_t *request)
+static int64_t parse_chunk_size(char *arg)
 {
-	uint16_t next = 0;
-	next += request[1];
-	next += request[0] << 8;
-	return next;
+	if (strcmp(arg, "auto") == 0)
+		return 0;
+
+	char *end;
+	uint64_t size = strtoull(arg, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end++;
+	}
+
+	if (end == arg || *end != '\0' || !chunk_size_valid(size))
+		return -1;
+
+	return size;
+}
+
+/*
+ * Parse the next file requested by the server to transfer, from a
+ * response in the protocol version of the given list's header
+ */
+static uint32_t parse_next_file(data_head *list, uint8_t *request)
+{
+	return get_be(request, files_bytes(list->version));
 }
 
 /*
  * Parse the pass/fail status of a file transfer from the server
  * file request
  */
-static bool transfer_passed(uint8_t *request)
+static bool transfer_passed(data_head *list, uint8_t *request)
+{
+	return request[response_size(list->version) - 1] == TRANSFER_Y;
+}
+
+/*
+ * Record the result of a pipelined file transfer reported by the server
+ */
+static void record_result(data_head *list, uint8_t *result)
+{
+	data_node *n = datalist_get_index(list, parse_next_file(list, result));
+	if (NULL == n) {
+		fprintf(stderr, "Bad transfer result from server\n");
+		exit(EXIT_FAILURE);
+	}
+
+	n->transfer = transfer_passed(list, result) ? TRANSFER_Y : TRANSFER_N;
+}
+
+/*
+ * Record every transfer result the server has sent so far without
+ * waiting for more. Returns the number of results recorded, -1 when
+ * interrupted.
+ */
+static int drain_results(int sfd, data_head *list)
 {
-	return request[2] == TRANSFER_Y;
+	struct pollfd pfd = {.fd = sfd, .events = POLLIN};
+	uint8_t result[MAX_RETURN_SIZE];
+	uint32_t len = response_size(list->version);
+	int n = 0;
+
+	while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+		int r = recv_all(sfd, result, len);
+		if (r == -1)
+			return -1;
+		if (r == 0)
+			break;
+
+		record_result(list, result);
+		n++;
+	}
+
+	return n;
 }
 
 /*
@@ -208,67 +686,763 @@ static bool transfer_passed(uint8_t *request)
 static int init_transfer(int serv, data_head *dh)
 {
 	uint8_t *transfer_header = datalist_generate_payload(dh);
-	int header_len = HEADER_INIT_SIZE + (dh->size * HEADER_LINE_SIZE);
+	int header_len = datalist_payload_size(dh);
 
 	int r = write_all(serv, transfer_header, header_len);
 	free(transfer_header);
 	if (r == -1)
 		return 0;
 
-	uint8_t request[RETURN_SIZE];
-	r = recv_all(serv, request, RETURN_SIZE);
+	uint8_t request[MAX_RETURN_SIZE];
+	uint32_t len = response_size(dh->version);
+	r = recv_all(serv, request, len);
 	if (r == 0)
 		return 0;
 
 	// Verify the server has clients key
-	static const uint8_t no_key[RETURN_SIZE] = {0};
-	if (memcmp(request, no_key, 3) == 0) {
+	static const uint8_t no_key[MAX_RETURN_SIZE] = {0};
+	if (memcmp(request, no_key, len) == 0) {
 		return -1;
 	}
 
-	return parse_next_file(request);
+	return parse_next_file(dh, request);
 }
 
 /*
- * Encrypt and Write specified file to the server. Returns 1 if
- * the file is encrypted and written entirely, -1 if interrupted, 0 on failure.
+ * Position the source at the start of its current range, opening the
+ * range's file first in a packed stream. Returns false when that fails.
  */
-static int send_file(int sfd, gcry_cipher_hd_t hd, char *filepath, prg_bar *pb)
+static bool source_seek(source *src)
 {
-	FILE *f = fopen(filepath, "r");
-	if (NULL == f)
-		return 0;
+	if (NULL != src->paths) {
+		if (NULL != src->f)
+			fclose(src->f);
+
+		src->f = fopen(src->paths[src->cur], "r");
+		if (NULL == src->f)
+			return false;
+	}
+
+	return fseeko(src->f, src->extents[src->cur].offset, SEEK_SET) == 0;
+}
 
-	gcry_error_t err = 0;
-	uint8_t f_buf[CHUNK_SIZE];
+/*
+ * Read up to len bytes from the source into the given buffer. Returns
+ * the number of bytes read, short once the source or file ends. A file
+ * of a packed stream that went missing or got shorter is filled out with
+ * zeros instead, keeping the files after it in place, and fails on the
+ * server.
+ */
+static size_t source_read(source *src, uint8_t *buf, size_t len)
+{
+	size_t total = 0;
+
+	while (total < len && src->cur < src->n_extents) {
+		extent *e = &src->extents[src->cur];
+		if (src->cur_read == 0 && !source_seek(src) &&
+		    NULL == src->paths)
+			break;
+
+		size_t want = e->len - src->cur_read;
+		if (want > len - total)
+			want = len - total;
+
+		size_t n = 0;
+		if (NULL != src->f)
+			n = fread(buf + total, 1, want, src->f);
+		if (n < want && NULL != src->paths) {
+			memset(buf + total + n, 0, want - n);
+			n = want;
+		}
+
+		total += n;
+		src->cur_read += n;
+		if (n < want)
+			break;
+
+		if (src->cur_read == e->len) {
+			src->cur++;
+			src->cur_read = 0;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Compress and encrypt the chunk of len bytes following the frame's
+ * prefix, using scratch to compress into. The cipher must already be
+ * positioned at the chunk. A chunk that doesn't shrink is sent as is.
+ * Returns the number of bytes of the frame to send.
+ */
+static uint32_t seal_compressed(sender *s, gcry_cipher_hd_t hd, deflater *d,
+				uint8_t *frame, uint32_t len, uint8_t *scratch)
+{
+	uint8_t suite = s->list->suite;
+	uint32_t chunk_size = s->list->chunk_size;
+	uint8_t *data = frame + FRAME_PREFIX_BYTES;
+
+	uint64_t start = stats_start(s->st);
+	uint32_t z_len = deflate_chunk(d, s->z, data, len, scratch, chunk_size);
+	stats_add(s->st, s->file, STAT_COMPRESS, len, start);
+
+	uint32_t prefix = z_len == 0 ? 0 : FRAME_COMPRESSED | z_len;
+	uint32_t cipher_len = frame_cipher_size(prefix, chunk_size);
+	if (z_len > 0)
+		memcpy(data, scratch, cipher_len);
+
+	start = stats_start(s->st);
+	frame_set_prefix(frame, prefix);
+	frame_authenticate(hd, suite, frame);
+	encrypt_chunk(hd, suite, data, cipher_len);
+	stats_add(s->st, s->file, STAT_ENCRYPT, cipher_len, start);
+	return FRAME_PREFIX_BYTES +
+	       frame_payload_size(suite, prefix, chunk_size);
+}
+
+/*
+ * Write n sealed frames carrying len bytes of the file to the server,
+ * batched through the ring unless it is NULL, measuring the link for
+ * the compression level when compressing. Returns like write_all.
+ */
+static int send_frames(sender *s, uring *u, struct iovec *frames, int n,
+		       uint64_t len)
+{
+	if (s->sent == 0)
+		s->started = tuner_clock();
+
+	uint64_t start = stats_start(s->st);
+	int r = send_batch(u, s->sfd, frames, n);
+	if (r > 0) {
+		s->sent += len;
+		stats_add(s->st, s->file, STAT_SEND, r, start);
+	}
+
+	if (r > 0 && NULL != s->z)
+		compressor_add_link(s->z, len);
+
+	// The server answers as files of a packed stream finish, it mustn't
+	// be left blocked on responses nobody reads
+	if (r > 0 && NULL != s->results) {
+		int got = drain_results(s->sfd, s->list);
+		if (got == -1)
+			return -1;
+		*s->results += got;
+	}
+	return r;
+}
+
+/*
+ * Write one sealed frame carrying len bytes of the file to the server.
+ * Returns like write_all.
+ */
+static int send_frame(sender *s, uint8_t *frame, uint32_t frame_len,
+		      uint32_t len)
+{
+	struct iovec iov = {.iov_base = frame, .iov_len = frame_len};
+	return send_frames(s, NULL, &iov, 1, len);
+}
+
+/*
+ * Encrypt and Write len bytes of the source one chunk at a time
+ */
+static int send_serial(sender *s, uint32_t idx, source *src, uint64_t offset,
+		       uint64_t len)
+{
+	uint32_t chunk_size = s->list->chunk_size;
+	uint32_t frame_size = chunk_frame_size(s->list->suite, chunk_size);
+	uint8_t *f_buf = aligned_buffer(FRAME_PREFIX_BYTES + frame_size);
+	uint8_t *z_buf = NULL;
+	int status = 1;
+
+	// Compressed frames start with their prefix
+	deflater *d = NULL;
+	uint8_t *data = f_buf;
+	if (NULL != s->z) {
+		d = deflater_init();
+		z_buf = aligned_buffer(chunk_size);
+		compressor_set_threads(s->z, 1);
+		data += FRAME_PREFIX_BYTES;
+	}
 
 	// Read a chunk from the file, encrypt, and write to server
-	while (!TERMINATED) {
-		int f_len = fread(f_buf, 1, CHUNK_SIZE, f);
+	while (!TERMINATED && len > 0) {
+		int to_read = len < chunk_size ? (int)len : (int)chunk_size;
+		uint64_t start = stats_start(s->st);
+		int f_len = source_read(src, data, to_read);
 		if (f_len == 0)
 			break;
+		stats_add(s->st, s->file, STAT_READ, f_len, start);
+		len -= f_len;
 
 		// Any remaining bytes in file buf are set to random garbage
-		gcry_randomize(f_buf + f_len, CHUNK_SIZE - f_len,
-			       GCRY_STRONG_RANDOM);
+		if (f_len < (int)chunk_size) {
+			start = stats_start(s->st);
+			gcry_randomize(data + f_len, chunk_size - f_len,
+				       GCRY_STRONG_RANDOM);
+			stats_add(s->st, s->file, STAT_RANDOMIZE,
+				  chunk_size - f_len, start);
+		}
+
+		cipher_seek(s->hd, s->list->suite, s->list->vector, idx, offset,
+			    chunk_size);
+		uint32_t frame_len = frame_size;
+		if (NULL != d) {
+			frame_len = seal_compressed(s, s->hd, d, f_buf, f_len,
+						    z_buf);
+		} else {
+			start = stats_start(s->st);
+			encrypt_chunk(s->hd, s->list->suite, f_buf, chunk_size);
+			stats_add(s->st, s->file, STAT_ENCRYPT, chunk_size,
+				  start);
+		}
+		offset += f_len;
 
-		err = gcry_cipher_encrypt(hd, f_buf, CHUNK_SIZE, NULL, 0);
-		g_error(err);
+		int r = send_frame(s, f_buf, frame_len, f_len);
+		if (r == -1)
+			status = -1;
+		if (r <= 0)
+			break;
 
-		int r = write_all(sfd, f_buf, CHUNK_SIZE);
-		if (r == -1) {
-			fclose(f);
-			return -1;
+		if (NULL != s->pb)
+			prg_update(s->pb);
+
+		if (f_len < to_read)
+			break;
+	}
+
+	if (NULL != d)
+		deflater_destroy(d);
+	free(z_buf);
+	free(f_buf);
+
+	// The server would wait forever for the rest of an interrupted file
+	return TERMINATED ? -1 : status;
+}
+
+/*
+ * Number of threads encrypting chunks for the given cipher suite. A
+ * chained suite has to be encrypted in order by one thread.
+ */
+static int encrypt_threads(uint8_t suite)
+{
+	if (suite == CIPHER_CBC)
+		return 1;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		return 1;
+
+	return cores < MAX_ENCRYPT_THREADS ? (int)cores : MAX_ENCRYPT_THREADS;
+}
+
+/*
+ * Return a ring reading the worker's file into the slots of its
+ * pipeline, or NULL when io_uring is unavailable
+ */
+static uring *read_uring(tx_worker *w)
+{
+	uring *u = uring_init();
+	if (NULL == u)
+		return NULL;
+
+	// Registering only spares the kernel work, reads go ahead without
+	int fd = fileno(w->src->f);
+	uring_register_files(u, &fd, 1);
+
+	struct iovec *bufs = malloc(w->r->depth * sizeof(struct iovec));
+	if (NULL == bufs)
+		mem_error();
+
+	for (uint32_t i = 0; i < w->r->depth; i++) {
+		bufs[i].iov_base = w->r->slots[i].data;
+		bufs[i].iov_len = w->r->slot_size;
+	}
+	uring_register_buffers(u, bufs, w->r->depth);
+	free(bufs);
+	return u;
+}
+
+/*
+ * Read chunks of the range into the ring, padding the last one with
+ * random garbage, until the range or file ends. Batched, the chunks
+ * with free slots are read with one submission.
+ */
+static void *read_stage(void *arg)
+{
+	tx_worker *w = arg;
+	uint64_t offset = w->offset;
+	uint64_t len = w->len;
+	uint64_t seq = 0;
+	uint32_t chunk_size = w->s->list->chunk_size;
+	ring_slot *batch[URING_BATCH];
+	struct iovec bufs[URING_BATCH];
+	uint64_t offsets[URING_BATCH];
+	uint32_t lens[URING_BATCH];
+	ring_slot *slot;
+
+	uint32_t head = NULL != w->s->z ? FRAME_PREFIX_BYTES : 0;
+
+	// The ring reads chunks at their offsets, so only of a single range
+	uring *u = NULL;
+	uint64_t pos = 0;
+	if (w->s->batched && NULL == w->src->paths && w->src->n_extents == 1) {
+		u = read_uring(w);
+		pos = w->src->extents[0].offset;
+	}
+
+	while ((slot = ring_claim(w->r, STAGE_READ)) != NULL) {
+		// Chunks whose slots are already free are read together
+		int n = 0;
+		uint64_t queued = 0;
+		while (NULL != slot) {
+			uint64_t left = len - queued;
+			bufs[n].iov_base = slot->data + head;
+			bufs[n].iov_len = left < chunk_size ? left : chunk_size;
+			offsets[n] = pos + queued;
+			queued += bufs[n].iov_len;
+			batch[n++] = slot;
+
+			slot = NULL;
+			if (NULL != u && n < URING_BATCH && queued < len)
+				slot = ring_try_claim(w->r, STAGE_READ);
+		}
+
+		// An interrupted read ends the range at the first chunk
+		lens[0] = 0;
+		uint64_t start = stats_start(w->s->st);
+		if (TERMINATED || len == 0)
+			n = 1;
+		else if (NULL == u)
+			lens[0] = source_read(w->src, bufs[0].iov_base,
+					      bufs[0].iov_len);
+		else if (!read_batch(u, fileno(w->src->f), bufs, offsets, lens,
+				     n))
+			n = 1;
+
+		uint64_t got = 0;
+		for (int i = 0; i < n; i++)
+			got += lens[i];
+		if (got > 0)
+			stats_add(w->s->st, w->s->file, STAT_READ, got, start);
+
+		bool ended = false;
+		for (int i = 0; i < n && !ended; i++) {
+			uint8_t *data = bufs[i].iov_base;
+			uint32_t f_len = lens[i];
+			if (f_len == 0) {
+				ended = true;
+				break;
+			}
+
+			if (f_len < chunk_size) {
+				start = stats_start(w->s->st);
+				gcry_randomize(data + f_len, chunk_size - f_len,
+					       GCRY_STRONG_RANDOM);
+				stats_add(w->s->st, w->s->file, STAT_RANDOMIZE,
+					  chunk_size - f_len, start);
+			}
+			batch[i]->offset = offset;
+			batch[i]->len = f_len;
+			offset += f_len;
+			pos += f_len;
+			len -= f_len;
+			ring_release(w->r, batch[i], STAGE_READ);
+			seq++;
+
+			ended = f_len < bufs[i].iov_len || len == 0;
+		}
+
+		if (ended) {
+			ring_set_end(w->r, seq);
+			break;
+		}
+	}
+
+	if (NULL != u)
+		uring_destroy(u);
+	return NULL;
+}
+
+/*
+ * Compress when enabled and encrypt chunks in the ring. Seekable suites
+ * may run several of these at once, each with its own cipher context.
+ */
+static void *encrypt_stage(void *arg)
+{
+	tx_worker *w = arg;
+	data_head *list = w->s->list;
+	uint32_t frame_size = chunk_frame_size(list->suite, list->chunk_size);
+	ring_slot *slot;
+
+	deflater *d = NULL;
+	uint8_t *z_buf = NULL;
+	if (NULL != w->s->z) {
+		d = deflater_init();
+		z_buf = aligned_buffer(list->chunk_size);
+	}
+
+	while ((slot = ring_claim(w->r, STAGE_ENCRYPT)) != NULL) {
+		cipher_seek(w->hd, list->suite, list->vector, w->idx,
+			    slot->offset, list->chunk_size);
+		slot->frame_len = frame_size;
+		if (NULL != d) {
+			slot->frame_len = seal_compressed(
+			    w->s, w->hd, d, slot->data, slot->len, z_buf);
+		} else {
+			uint64_t start = stats_start(w->s->st);
+			encrypt_chunk(w->hd, list->suite, slot->data,
+				      list->chunk_size);
+			stats_add(w->s->st, w->s->file, STAT_ENCRYPT,
+				  list->chunk_size, start);
 		}
+		ring_release(w->r, slot, STAGE_ENCRYPT);
+	}
 
-		prg_update(pb);
+	if (NULL != d) {
+		deflater_destroy(d);
+		free(z_buf);
+	}
+	return NULL;
+}
 
-		if (f_len < CHUNK_SIZE)
+/*
+ * Send len bytes of the source through a pipeline: a reader fills a
+ * ring of buffers, encryption threads work on them and this thread writes
+ * them to the server in order. The ring's depth bounds how far reading
+ * and encryption run ahead of the socket. Sends with send_serial
+ * instead when the threads can't be started.
+ */
+static int send_staged(sender *s, uint32_t idx, source *src, uint64_t offset,
+		       uint64_t len)
+{
+	uint8_t suite = s->list->suite;
+	uint32_t frame_size = chunk_frame_size(suite, s->list->chunk_size);
+	int encrypters = encrypt_threads(suite);
+	int status = 1;
+
+	uint32_t head = NULL != s->z ? FRAME_PREFIX_BYTES : 0;
+	ring *r = ring_init(s->depth, head + frame_size, TX_STAGES);
+
+	if (NULL != s->z)
+		compressor_set_threads(s->z, encrypters);
+
+	// The sender's own context keeps a chained suite's state
+	tx_worker workers[MAX_ENCRYPT_THREADS];
+	int started;
+	bool running = true;
+	for (started = 0; started < encrypters; started++) {
+		tx_worker *w = &workers[started];
+		w->s = s;
+		w->r = r;
+		w->idx = idx;
+		w->hd = s->hd;
+		if (started > 0)
+			w->hd =
+			    init_cipher_context(s->list->vector, s->key, suite);
+		if (pthread_create(&w->thread, NULL, encrypt_stage, w) != 0) {
+			if (started > 0)
+				gcry_cipher_close(w->hd);
+			running = false;
 			break;
+		}
+	}
+
+	// Started last, so nothing is read before every thread runs
+	tx_worker reader = {
+	    .s = s, .r = r, .idx = idx, .src = src, .offset = offset, .len = len};
+	running = running &&
+		  pthread_create(&reader.thread, NULL, read_stage, &reader) == 0;
+
+	// The threads that did start stop once the ring is closed
+	if (!running) {
+		ring_close(r);
+		for (int i = 0; i < started; i++) {
+			pthread_join(workers[i].thread, NULL);
+			if (i > 0)
+				gcry_cipher_close(workers[i].hd);
+		}
+		ring_destroy(r);
+		return send_serial(s, idx, src, offset, len);
+	}
+
+	uring *u = s->batched ? uring_init() : NULL;
+	if (NULL != u)
+		uring_register_files(u, &s->sfd, 1);
+
+	ring_slot *batch[URING_BATCH];
+	struct iovec frames[URING_BATCH];
+	ring_slot *slot;
+	while ((slot = ring_claim(r, STAGE_SEND)) != NULL) {
+		// Frames already encrypted are sent together
+		int n = 0;
+		uint64_t sent = 0;
+		while (NULL != slot) {
+			frames[n].iov_base = slot->data;
+			frames[n].iov_len = slot->frame_len;
+			sent += slot->len;
+			batch[n++] = slot;
+
+			slot = NULL;
+			if (NULL != u && n < URING_BATCH)
+				slot = ring_try_claim(r, STAGE_SEND);
+		}
+
+		int w = send_frames(s, u, frames, n, sent);
+		if (w <= 0) {
+			status = w == -1 ? -1 : 1;
+			ring_close(r);
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (NULL != s->pb)
+				prg_update(s->pb);
+			ring_release(r, batch[i], STAGE_SEND);
+		}
+	}
+
+	if (NULL != u)
+		uring_destroy(u);
+	pthread_join(reader.thread, NULL);
+	for (int i = 0; i < encrypters; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (i > 0)
+			gcry_cipher_close(workers[i].hd);
+	}
+
+	ring_destroy(r);
+	return TERMINATED ? -1 : status;
+}
+
+/*
+ * Encrypt and Write len bytes of the specified file, at the given index of
+ * the transfer, starting at offset, to the server. Returns 1 if the range is
+ * encrypted and written entirely, -1 if interrupted, 0 on failure. Sending
+ * stops early when the server drops the connection, as it does for a
+ * corrupt chunk, leaving its response to report the failure.
+ */
+static int send_range(sender *s, uint32_t idx, char *filepath, uint64_t offset,
+		      uint64_t len)
+{
+	FILE *f = fopen(filepath, "r");
+	if (NULL == f)
+		return 0;
+
+	uint64_t size = filesize(filepath);
+	uint64_t remaining = size > offset ? size - offset : 0;
+	if (len < remaining)
+		remaining = len;
+
+	extent e = {.offset = offset, .len = remaining};
+	source src = {.f = f, .extents = &e, .n_extents = 1};
+
+	int r;
+	if (s->depth > 0 &&
+	    remaining / s->list->chunk_size >= PIPELINE_MIN_CHUNKS)
+		r = send_staged(s, idx, &src, offset, remaining);
+	else
+		r = send_serial(s, idx, &src, offset, remaining);
+
+	fclose(f);
+	return r;
+}
+
+/*
+ * Return the ranges of the file covered by the chunks of the recipe
+ * the server is missing, adjacent chunks merged into one range. The
+ * number of ranges is stored in n.
+ */
+static extent *missing_extents(recipe *r, uint32_t *n)
+{
+	extent *extents = malloc((r->n + 1) * sizeof(extent));
+	if (NULL == extents)
+		mem_error();
+
+	*n = 0;
+	for (uint32_t i = 0; i < r->n; i++) {
+		if (!recipe_missing(r, i))
+			continue;
+
+		cdc_chunk *c = &r->chunks[i];
+		if (*n > 0 && extents[*n - 1].offset + extents[*n - 1].len ==
+				  c->offset) {
+			extents[*n - 1].len += c->len;
+			continue;
+		}
+
+		extents[*n].offset = c->offset;
+		extents[*n].len = c->len;
+		(*n)++;
+	}
+
+	return extents;
+}
+
+/*
+ * Send the specified file deduplicated against the server's chunk
+ * store: its recipe goes first, the server answers with the chunks it
+ * is missing, then only those are encrypted and written back to back.
+ * Returns like send_range.
+ */
+static int send_deduped(sender *s, uint32_t idx, char *filepath)
+{
+	recipe *r = recipe_build(filepath);
+	FILE *f = fopen(filepath, "r");
+	if (NULL == r || NULL == f) {
+		if (NULL != r)
+			recipe_destroy(r);
+		if (NULL != f)
+			fclose(f);
+		return 0;
 	}
 
+	uint32_t payload_len;
+	uint8_t *payload = recipe_payload(r, &payload_len);
+	int status = write_all(s->sfd, payload, payload_len);
+	free(payload);
+
+	uint32_t bitmap_len = recipe_bitmap_size(r);
+	uint8_t *bitmap = malloc(bitmap_len + 1);
+	if (NULL == bitmap)
+		mem_error();
+
+	if (status > 0 && bitmap_len > 0)
+		status = recv_all(s->sfd, bitmap, bitmap_len);
+
+	// A dropped connection is reported by the missing response
+	if (status <= 0) {
+		free(bitmap);
+		recipe_destroy(r);
+		fclose(f);
+		return status == -1 ? -1 : 1;
+	}
+
+	recipe_set_missing(r, bitmap);
+	free(bitmap);
+
+	uint32_t n_extents;
+	extent *extents = missing_extents(r, &n_extents);
+	source src = {.f = f, .extents = extents, .n_extents = n_extents};
+	uint64_t len = r->missing_len;
+	uint32_t chunk_size = s->list->chunk_size;
+
+	if (NULL != s->pb)
+		prg_reset(s->pb, len / chunk_size, chunk_size,
+			  basename(filepath));
+
+	// Offsets count the bytes sent, not positions in the file
+	if (s->depth > 0 && len / chunk_size >= PIPELINE_MIN_CHUNKS)
+		status = send_staged(s, idx, &src, 0, len);
+	else
+		status = send_serial(s, idx, &src, 0, len);
+
+	free(extents);
+	recipe_destroy(r);
 	fclose(f);
-	return 1;
+	return status;
+}
+
+/*
+ * Encrypt and Write specified file, at the given index of the transfer, to the
+ * server, from the offset the server asked to resume it at. Returns 1 if the
+ * file is encrypted and written entirely, -1 if interrupted, 0 on failure.
+ */
+static int send_file(sender *s, uint32_t idx, data_node *file)
+{
+	if (s->list->flags & FLAG_DEDUPE)
+		return send_deduped(s, idx, file->name);
+
+	return send_range(s, idx, file->name, file->resume, UINT64_MAX);
+}
+
+/*
+ * Send every file the server accepted as one stream: the contents of
+ * each from its resume offset, back-to-back, with only the last chunk
+ * of the stream padded. Chunks are encrypted as those of file 0, at
+ * their offset in the stream. The server's results read meanwhile are
+ * counted in results. Returns like send_range.
+ */
+static int send_packed(sender *s, int *results)
+{
+	data_head *list = s->list;
+	extent *extents = malloc((list->size + 1) * sizeof(extent));
+	char **paths = malloc((list->size + 1) * sizeof(char *));
+	if (NULL == extents || NULL == paths)
+		mem_error();
+
+	// Accepted files are the ones marked failed until the server reports
+	uint32_t n = 0;
+	uint64_t len = 0;
+	for (data_node *f = list->first; f != NULL; f = f->next) {
+		if (f->transfer != TRANSFER_N || f->resume == f->size)
+			continue;
+
+		extents[n].offset = f->resume;
+		extents[n].len = f->size - f->resume;
+		paths[n++] = f->name;
+		len += f->size - f->resume;
+	}
+
+	if (NULL != s->pb)
+		prg_reset(s->pb, len / list->chunk_size, list->chunk_size,
+			  "packed files");
+
+	source src = {.f = NULL, .paths = paths, .extents = extents,
+		      .n_extents = n};
+	s->results = results;
+	s->file = 0; // The stream is timed as a whole
+
+	int r;
+	if (s->depth > 0 && len / list->chunk_size >= PIPELINE_MIN_CHUNKS)
+		r = send_staged(s, 0, &src, 0, len);
+	else
+		r = send_serial(s, 0, &src, 0, len);
+
+	s->results = NULL;
+	if (NULL != src.f)
+		fclose(src.f);
+	free(paths);
+	free(extents);
+	return r;
+}
+
+/*
+ * Read the offset the server resumes each file of the transfer from,
+ * each as wide as the header's file sizes. Returns like recv_all.
+ */
+static int recv_resume_offsets(int sfd, data_head *list)
+{
+	uint32_t width = size_bytes(list->version);
+	uint32_t len = list->size * width;
+	uint8_t *offsets = malloc(len + 1);
+	if (NULL == offsets)
+		mem_error();
+
+	int r = recv_all(sfd, offsets, len);
+	uint32_t i = 0;
+	for (data_node *n = list->first; n != NULL && r > 0; n = n->next) {
+		n->resume = get_be(offsets + i++ * width, width);
+		if (n->resume > n->size)
+			n->resume = 0; // Sent whole, the server fails it
+	}
+
+	free(offsets);
+	return r;
+}
+
+/*
+ * Start the progress bar for the part of the file still to be sent in
+ * chunks of the given size
+ */
+static void show_progress(prg_bar *pb, data_node *file, uint32_t chunk_size)
+{
+	if (file->resume > 0)
+		fprintf(stdout, "Resuming %s at %" PRIu64 " bytes\n",
+			basename(file->name), file->resume);
+
+	prg_reset(pb, (file->size - file->resume) / chunk_size, chunk_size,
+		  basename(file->name));
 }
 
 /*
@@ -276,16 +1450,23 @@ static int send_file(int sfd, gcry_cipher_hd_t hd, char *filepath, prg_bar *pb)
  * files to the server
  */
 static client *new_client(char *svr_ip, char *svr_port, char *loc_ip,
-			  char *loc_port, char *comma_files, char *key_path)
+			  char *loc_port, char *comma_files, char *key_path,
+			  int stripes, hash_cache *cache, int hash_threads,
+			  uint8_t hash_algo)
 {
 	client *c = malloc(sizeof(client));
 	if (NULL == c)
 		mem_error();
 
 	// Determine file names, sizes, and hashes and store them
-	uint16_t num_files = parse_file_cnt(comma_files);
+	uint32_t num_files = parse_file_cnt(comma_files);
+	if (num_files > MAX_FILES) {
+		fprintf(stderr, "at most %d files can be sent at once\n",
+			MAX_FILES);
+		exit(EXIT_FAILURE);
+	}
 	char **files = parse_filepaths(comma_files, num_files);
-	uint32_t *sizes = parse_sizes(files, num_files);
+	uint64_t *sizes = parse_sizes(files, num_files);
 
 	c->vector = malloc(INIT_VEC_BYTES);
 	if (NULL == c->vector)
@@ -293,17 +1474,21 @@ static client *new_client(char *svr_ip, char *svr_port, char *loc_ip,
 	gcry_create_nonce(c->vector, INIT_VEC_BYTES);
 
 	c->transferring = datalist_init(c->vector);
-	uint8_t **hashes = generate_hashes(files, num_files);
+	c->striped = datalist_init(c->vector);
+	c->transferring->hash_algo = hash_algo;
+	c->striped->hash_algo = hash_algo;
+	uint8_t **hashes =
+	    generate_hashes(files, num_files, cache, hash_threads, hash_algo);
 
 	// Create the list based on what the client wants to send to the
 	// server
-	for (int i = 0; i < num_files; i++) {
+	for (uint32_t i = 0; i < num_files; i++) {
 		// Don't add files to the list that have the same hash. We will
 		// skip all files with the same hash except the last
-		int j = i + 1;
+		uint32_t j = i + 1;
 		bool duplicate = false;
 		while (j < num_files) {
-			if (memcmp(hashes[i], hashes[j], HASH_BYTES) != 0) {
+			if (memcmp(hashes[i], hashes[j], MAX_HASH_BYTES) != 0) {
 				j++;
 				continue;
 			}
@@ -317,7 +1502,14 @@ static client *new_client(char *svr_ip, char *svr_port, char *loc_ip,
 		if (duplicate)
 			continue;
 
-		datalist_append(c->transferring, files[i], sizes[i], hashes[i],
+		// Large files are sent on their own striped connections
+		data_head *list = c->transferring;
+		if (stripes > 1 &&
+		    sizes[i] >= (uint64_t)stripes * STRIPE_MIN_CHUNKS *
+				    DEFAULT_CHUNK_SIZE)
+			list = c->striped;
+
+		datalist_append(list, files[i], sizes[i], hashes[i],
 				TRANSFER_D);
 		free(files[i]);
 		free(hashes[i]);
@@ -333,6 +1525,13 @@ static client *new_client(char *svr_ip, char *svr_port, char *loc_ip,
 	c->r_ip = svr_ip;
 	c->l_port = loc_port;
 	c->l_ip = loc_ip;
+	c->stripes = stripes;
+	c->stripe_ips = NULL;
+	c->n_stripe_ips = 0;
+	c->depth = DEFAULT_RING_DEPTH;
+	c->batched = false;
+	c->tuner = NULL;
+	c->st = NULL;
 
 	free(files);
 	free(hashes);
@@ -346,20 +1545,27 @@ static client *new_client(char *svr_ip, char *svr_port, char *loc_ip,
 static void destroy_client(client *c)
 {
 	datalist_destroy(c->transferring);
+	datalist_destroy(c->striped);
+	for (int i = 0; i < c->n_stripe_ips; i++)
+		free(c->stripe_ips[i]);
+	free(c->stripe_ips);
 	free(c->key);
 	free(c->vector);
+	tuner_destroy(c->tuner);
+	if (NULL != c->st)
+		stats_destroy(c->st);
 	free(c);
 	c = NULL;
 }
 
 /*
- * Log transfer results for the given client. Successful transfers
+ * Log transfer results for the given list. Successful transfers
  * display the short hash (similar to short git hashes).
  */
-static void log_transfer_results(client *c)
+static void log_transfer_results(data_head *list)
 {
 	int idx = 1;
-	data_node *n = datalist_get_index(c->transferring, idx);
+	data_node *n = datalist_get_index(list, idx);
 
 	if (n != NULL)
 		fprintf(stdout, "Transfer summary:\n");
@@ -369,7 +1575,8 @@ static void log_transfer_results(client *c)
 
 		switch (n->transfer) {
 		case TRANSFER_Y: {
-			char *hex_hash = hash_to_hex(n->hash);
+			char *hex_hash =
+			    hash_to_hex(n->hash, hash_bytes(list->hash_algo));
 			fprintf(stdout,
 				"%s successfully transferred with fingerprint "
 				"%.*s\n",
@@ -388,8 +1595,99 @@ static void log_transfer_results(client *c)
 		}
 
 		idx += 1;
-		n = datalist_get_index(c->transferring, idx);
+		n = datalist_get_index(list, idx);
+	}
+}
+
+/*
+ * Send every file the server accepted back-to-back, collecting the
+ * server's results as they arrive instead of waiting on each file.
+ * Returns true on successful transfer of all non-duplicate files.
+ */
+static bool send_pipelined(sender *s, client *c, bool *interrupted)
+{
+	int sfd = s->sfd;
+	data_head *list = c->transferring;
+	uint32_t set_len = (list->size + 7) / 8;
+	uint8_t *set = malloc(set_len);
+	if (NULL == set)
+		mem_error();
+
+	int r = recv_all(sfd, set, set_len);
+	if (r > 0 && (list->flags & FLAG_RESUME))
+		r = recv_resume_offsets(sfd, list);
+	if (r <= 0) {
+		free(set);
+		*interrupted = r == -1;
+		return false;
 	}
+
+	// Accepted files fail unless the server reports otherwise
+	int pending = 0;
+	uint32_t i = 0;
+	for (data_node *n = list->first; n != NULL; n = n->next, i++) {
+		if (set[i / 8] & (0x80 >> (i % 8))) {
+			n->transfer = TRANSFER_N;
+			pending++;
+		}
+	}
+
+	// A packed transfer sends them all as one stream instead
+	bool packing = (list->flags & FLAG_PACK) != 0;
+	int results = 0;
+	bool ok = true;
+	if (packing) {
+		r = send_packed(s, &results);
+		ok = r == 1;
+		*interrupted = r == -1;
+		if (r == 0)
+			prg_error(s->pb, "sending files failed");
+	}
+
+	i = 0;
+	for (data_node *n = list->first; n != NULL && ok && !packing;
+	     n = n->next, i++) {
+		if (!(set[i / 8] & (0x80 >> (i % 8))))
+			continue;
+
+		show_progress(s->pb, n, list->chunk_size);
+		s->file = i + 1;
+		r = send_file(s, i + 1, n);
+		if (r == 0) {
+			prg_error(s->pb, "sending file failed");
+			ok = false;
+		} else if (r == -1) {
+			*interrupted = true;
+			ok = false;
+		} else if ((r = drain_results(sfd, list)) == -1) {
+			*interrupted = true;
+			ok = false;
+		} else {
+			results += r;
+		}
+	}
+
+	// Wait for the results of the files still being processed
+	uint8_t result[MAX_RETURN_SIZE];
+	while (ok && results < pending) {
+		r = recv_all(sfd, result, response_size(list->version));
+		if (r <= 0) {
+			*interrupted = r == -1;
+			break;
+		}
+
+		record_result(list, result);
+		results++;
+	}
+
+	free(set);
+
+	for (data_node *n = list->first; n != NULL; n = n->next) {
+		if (n->transfer == TRANSFER_N)
+			return false;
+	}
+
+	return ok;
 }
 
 /*
@@ -412,6 +1710,14 @@ static bool transfer_files(client *c, int burn)
 		return true;
 	}
 
+	// A packed stream pads only its last chunk
+	data_head *list = c->transferring;
+	uint64_t bytes = 0;
+	for (data_node *n = list->first; n != NULL; n = n->next)
+		bytes += n->size;
+	list->chunk_size = tuner_chunk_size(
+	    c->tuner, bytes, (list->flags & FLAG_PACK) ? 1 : list->size);
+
 	int requested_idx = init_transfer(sfd, c->transferring);
 	if (requested_idx == -1) {
 		fprintf(stderr, "No AES key on server\n");
@@ -431,21 +1737,45 @@ static bool transfer_files(client *c, int burn)
 
 	fprintf(stdout, "Server initiated file transfer\n");
 
-	uint8_t resp_buf[RETURN_SIZE]; // Server response after file sent
+	uint8_t resp_buf[MAX_RETURN_SIZE]; // Server response after file sent
 	bool all_sent = true; // Whether all NON-duplicate were successful
 	bool interrupted = false;
-	gcry_cipher_hd_t hd = init_cipher_context(c->vector, c->key);
+	gcry_cipher_hd_t hd = init_cipher_context(c->vector, c->key,
+						  c->transferring->suite);
 	prg_bar *pb = init_prg_bar();
+	sender s = {.sfd = sfd,
+		    .hd = hd,
+		    .key = c->key,
+		    .list = c->transferring,
+		    .pb = pb,
+		    .depth = c->depth,
+		    .batched = c->batched,
+		    .st = c->st};
+	if (c->transferring->flags & FLAG_COMPRESS)
+		s.z = compressor_init();
+
+	if (c->transferring->flags & FLAG_PIPELINE) {
+		all_sent = send_pipelined(&s, c, &interrupted);
+		file = NULL;
+	} else if (c->transferring->flags & FLAG_RESUME) {
+		int r = recv_resume_offsets(sfd, c->transferring);
+		if (r <= 0) {
+			interrupted = r == -1;
+			all_sent = false;
+			file = NULL;
+		}
+	}
 
 	// We send any files the server requests
 	while (file != NULL) {
-		prg_reset(pb, file->size / CHUNK_SIZE, CHUNK_SIZE,
-			  basename(file->name));
+		show_progress(pb, file, s.list->chunk_size);
 
-		int r = send_file(sfd, hd, file->name, pb);
+		s.file = requested_idx;
+		int r = send_file(&s, requested_idx, file);
 		if (r == 0) {
 			prg_error(pb, "sending file failed");
 			all_sent = false;
+			file->transfer = TRANSFER_N;
 			break;
 		}
 		if (r == -1) {
@@ -453,43 +1783,220 @@ static bool transfer_files(client *c, int burn)
 			break;
 		}
 
-		r = recv_all(sfd, resp_buf, RETURN_SIZE);
+		r = recv_all(sfd, resp_buf, response_size(s.list->version));
 		if (r == -1) {
 			interrupted = true;
 			break;
 		}
+		if (r == 0) {
+			prg_error(pb, "server closed the connection");
+			all_sent = false;
+			file->transfer = TRANSFER_N;
+			break;
+		}
 
-		if (!transfer_passed(resp_buf)) {
+		if (!transfer_passed(s.list, resp_buf)) {
 			prg_error(pb, "server indicated the transfer failed");
 			all_sent = false;
+			file->transfer = TRANSFER_N;
 			break;
 		}
 
 		file->transfer = TRANSFER_Y;
-		requested_idx = parse_next_file(resp_buf);
+		requested_idx = parse_next_file(s.list, resp_buf);
 		file = datalist_get_index(c->transferring, requested_idx);
 	}
 
 	prg_destroy(pb); // First to clear stdout
 
 	if (!interrupted)
-		log_transfer_results(c);
+		log_transfer_results(c->transferring);
 
+	if (NULL != s.z)
+		compressor_destroy(s.z);
 	gcry_cipher_close(hd);
+	if (!interrupted)
+		tuner_record(c->tuner, sfd, s.sent, tuner_clock() - s.started);
 	close(sfd);
 	return all_sent;
 }
 
+/*
+ * Send one stripe of a file on its own connection. The stripe's
+ * connection has its own initialization vector.
+ */
+static void *send_stripe(void *arg)
+{
+	stripe_job *job = arg;
+	client *c = job->c;
+	data_node *file = job->file;
+	job->transfer = TRANSFER_N;
+
+	char *loc_ip = c->l_ip;
+	if (NULL != c->stripe_ips)
+		loc_ip = c->stripe_ips[job->stripe % c->n_stripe_ips];
+
+	int sfd = client_socket(c->r_ip, c->r_port, loc_ip, NULL);
+
+	// Stripes use the key and directory of the client's own ip:port,
+	// the ip is the one every stripe connects from unless it is given
+	char *ip = c->l_ip;
+	if (NULL == ip)
+		ip = socket_local_ip(sfd);
+	if (NULL == ip) {
+		fprintf(stderr, "Unable to determine local ip\n");
+		close(sfd);
+		return NULL;
+	}
+
+	uint8_t vector[INIT_VEC_BYTES];
+	gcry_create_nonce(vector, INIT_VEC_BYTES);
+
+	data_head *dh = datalist_init(vector);
+	dh->flags = FLAG_STRIPE | (c->transferring->flags & FLAG_COMPRESS);
+	dh->suite = c->striped->suite;
+	dh->hash_algo = c->striped->hash_algo;
+	snprintf(dh->owner, sizeof(dh->owner), "%s:%s", ip, c->l_port);
+	if (ip != c->l_ip)
+		free(ip);
+	dh->owner_key = c->key;
+	dh->stripe = job->stripe;
+	memcpy(dh->nonce, job->nonce, STRIPE_NONCE_BYTES);
+	dh->stripes = c->stripes;
+	dh->chunk_size = job->chunk_size;
+	datalist_append(dh, file->name, file->size, file->hash, TRANSFER_D);
+
+	int requested_idx = init_transfer(sfd, dh);
+	if (requested_idx == 0)
+		job->transfer = TRANSFER_D; // Already stored
+
+	if (requested_idx == 1) {
+		uint64_t offset, len;
+		uint8_t resp_buf[MAX_RETURN_SIZE];
+		gcry_cipher_hd_t hd = init_cipher_context(vector, c->key, dh->suite);
+		sender s = {.sfd = sfd,
+			    .hd = hd,
+			    .key = c->key,
+			    .list = dh,
+			    .pb = NULL,
+			    .depth = c->depth,
+			    .batched = c->batched,
+			    .st = c->st,
+			    .file = job->file_idx};
+		if (dh->flags & FLAG_COMPRESS)
+			s.z = compressor_init();
+		datalist_stripe_range(dh, &offset, &len);
+
+		int r = send_range(&s, 1, file->name, offset, len);
+		if (r == 1 &&
+		    recv_all(sfd, resp_buf, response_size(dh->version)) > 0 &&
+		    transfer_passed(dh, resp_buf))
+			job->transfer = TRANSFER_Y;
+
+		if (r == 1)
+			tuner_record(c->tuner, sfd, s.sent,
+				     tuner_clock() - s.started);
+		if (NULL != s.z)
+			compressor_destroy(s.z);
+		gcry_cipher_close(hd);
+	}
+
+	datalist_destroy(dh);
+	close(sfd);
+	return NULL;
+}
+
+/*
+ * Send each large file split into byte ranges over concurrent
+ * connections. The server stores the file once every range has
+ * arrived. Returns true when every striped file was transferred.
+ */
+static bool transfer_striped(client *c)
+{
+	bool all_sent = true;
+	pthread_t threads[MAX_STRIPES];
+	stripe_job jobs[MAX_STRIPES];
+	bool started[MAX_STRIPES];
+
+	uint32_t file_idx = c->transferring->size;
+	for (data_node *n = c->striped->first; n != NULL && !TERMINATED;
+	     n = n->next) {
+		file_idx++;
+		fprintf(stdout, "Striping %s over %d connections...\n",
+			basename(n->name), c->stripes);
+
+		// Stripes share the chunk size, a tuned one leaving each of
+		// them enough chunks to pipeline
+		uint32_t chunk_size = tuner_chunk_size(c->tuner, n->size, 1);
+		while (c->tuner->fixed == 0 && chunk_size > MIN_CHUNK_SIZE &&
+		       n->size / chunk_size <
+			   (uint64_t)c->stripes * STRIPE_MIN_CHUNKS)
+			chunk_size /= 2;
+
+		// The server keeps the progress of each attempt apart
+		uint8_t nonce[STRIPE_NONCE_BYTES];
+		gcry_create_nonce(nonce, STRIPE_NONCE_BYTES);
+
+		for (int i = 0; i < c->stripes; i++) {
+			jobs[i].c = c;
+			jobs[i].nonce = nonce;
+			jobs[i].chunk_size = chunk_size;
+			jobs[i].file = n;
+			jobs[i].file_idx = file_idx;
+			jobs[i].stripe = i;
+
+			// A stripe without a thread of its own is sent here
+			started[i] = pthread_create(&threads[i], NULL,
+						    send_stripe, &jobs[i]) == 0;
+			if (!started[i])
+				send_stripe(&jobs[i]);
+		}
+
+		// One failed range fails the file, the server reports a
+		// duplicate on every connection
+		n->transfer = TRANSFER_Y;
+		for (int i = 0; i < c->stripes; i++) {
+			if (started[i])
+				pthread_join(threads[i], NULL);
+			if (jobs[i].transfer == TRANSFER_N)
+				n->transfer = TRANSFER_N;
+			else if (jobs[i].transfer == TRANSFER_D &&
+				 n->transfer == TRANSFER_Y)
+				n->transfer = TRANSFER_D;
+		}
+
+		all_sent = all_sent && n->transfer != TRANSFER_N;
+	}
+
+	if (!TERMINATED)
+		log_transfer_results(c->striped);
+
+	return all_sent;
+}
+
 int main(int argc, char *argv[])
 {
 	int opt = 0;
 	int burn = NO_BURN;
+	int stripes = 1;
+	int suite = CIPHER_CBC;
+	int depth = DEFAULT_RING_DEPTH;
+	bool rehash = false;
+	int hash_threads = 0;
+	int hash_algo = HASH_SHA1;
+	char *cache_path = NULL;
+	uint8_t flags = 0;
+	char *stripe_ips = NULL;
 	char *l_port = NULL, *l_ip = NULL;
 	char *r_port = NULL, *r_ip = NULL;
 	char *key_path = NULL, *file_paths = NULL;
+	int64_t chunk_size = DEFAULT_CHUNK_SIZE;
+	bool batched = false;
+	bool timed = false;
 	init_sig_handler();
 
-	while ((opt = getopt(argc, argv, "l:r:k:f:hb")) != -1) {
+	while ((opt = getopt(argc, argv,
+			     "l:r:k:f:ps:L:c:d:C:Rj:H:DuzPS:UThb")) != -1) {
 		switch (opt) {
 		case 'r':
 			r_ip = parse_ip(optarg);
@@ -505,6 +2012,66 @@ int main(int argc, char *argv[])
 		case 'f':
 			file_paths = strdup(optarg);
 			break;
+		case 'p':
+			flags |= FLAG_PIPELINE;
+			break;
+		case 's':
+			stripes = atoi(optarg);
+			if (stripes < 1 || stripes > MAX_STRIPES)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'L':
+			stripe_ips = strdup(optarg);
+			break;
+		case 'c':
+			suite = parse_cipher_suite(optarg);
+			if (suite == -1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			if (depth < 0 || depth > MAX_RING_DEPTH)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'C':
+			cache_path = strdup(optarg);
+			break;
+		case 'R':
+			rehash = true;
+			break;
+		case 'j':
+			hash_threads = atoi(optarg);
+			if (hash_threads < 1 || hash_threads > MAX_HASH_THREADS)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'H':
+			hash_algo = parse_hash_algo(optarg);
+			if (hash_algo == -1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'D':
+			flags |= FLAG_DEDUPE;
+			break;
+		case 'u':
+			flags |= FLAG_RESUME;
+			break;
+		case 'z':
+			flags |= FLAG_COMPRESS;
+			break;
+		case 'P':
+			flags |= FLAG_PACK | FLAG_PIPELINE;
+			break;
+		case 'S':
+			chunk_size = parse_chunk_size(optarg);
+			if (chunk_size == -1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'U':
+			batched = true;
+			break;
+		case 'T':
+			timed = true;
+			break;
 		case 'b':
 			// Top secret, so this isn't in the usage message
 			burn = BURN;
@@ -528,25 +2095,92 @@ int main(int argc, char *argv[])
 	if (NULL == l_port)
 		usage(argv[0], EXIT_FAILURE);
 
+	// Deduplicated files are sent one at a time, whole
+	if ((flags & FLAG_DEDUPE) && ((flags & FLAG_PIPELINE) || stripes > 1))
+		usage(argv[0], EXIT_FAILURE);
+
+	// Deduplicated files already skip what the server holds
+	if ((flags & FLAG_DEDUPE) && (flags & FLAG_RESUME))
+		usage(argv[0], EXIT_FAILURE);
+
+	// Stripes from other ips need to say which ip owns them
+	if (NULL != stripe_ips && NULL == l_ip)
+		usage(argv[0], EXIT_FAILURE);
+
 	if (NULL == key_path)
 		key_path = strdup(DEFAULT_KEY_PATH);
 
 	if (NULL == r_port)
 		r_port = strdup(DEFAULT_SERVER_PORT);
 
+	if (NULL == cache_path)
+		cache_path = strdup(DEFAULT_HASH_CACHE);
+
+	if (hash_threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		hash_threads = cores < 1 ? 1 : (int)cores;
+		if (hash_threads > DEFAULT_HASH_THREADS)
+			hash_threads = DEFAULT_HASH_THREADS;
+	}
+
+	hash_cache *cache = hashcache_load(cache_path, hash_algo);
+	if (rehash)
+		hashcache_clear(cache);
+
 	init_gcrypt();
-	client *c =
-	    new_client(r_ip, r_port, l_ip, l_port, file_paths, key_path);
+	client *c = new_client(r_ip, r_port, l_ip, l_port, file_paths,
+			       key_path, stripes, cache, hash_threads, hash_algo);
+	hashcache_save(cache);
+	hashcache_destroy(cache);
+	c->transferring->flags = flags;
+	c->transferring->suite = suite;
+	c->striped->suite = suite;
+	c->depth = depth;
+	c->batched = batched;
+
+	// Measurements are kept per server
+	char server[TUNE_LINE_BYTES];
+	snprintf(server, sizeof(server), "%s:%s",
+		 NULL == r_ip ? "localhost" : r_ip, r_port);
+	c->tuner = tuner_init(chunk_size, DEFAULT_TUNE_PATH, server);
+
+	if (NULL != stripe_ips) {
+		c->n_stripe_ips = parse_file_cnt(stripe_ips);
+		c->stripe_ips = parse_filepaths(stripe_ips, c->n_stripe_ips);
+		free(stripe_ips);
+	}
+
+	// Striped files are counted after the ones sent whole
+	if (timed) {
+		data_head *lists[] = {c->transferring, c->striped};
+		c->st = stats_init(c->transferring->size + c->striped->size);
+		uint32_t i = 1;
+		for (int l = 0; l < 2; l++) {
+			for (data_node *n = lists[l]->first; n != NULL;
+			     n = n->next)
+				stats_name(c->st, i++, n->name);
+		}
+	}
 
 	int status = EXIT_SUCCESS;
 	if (!TERMINATED) {
-		bool ok = transfer_files(c, burn);
+		bool ok = true;
+		if (c->transferring->size > 0 || burn == BURN)
+			ok = transfer_files(c, burn);
+
+		if (c->striped->size > 0 && burn == NO_BURN && !TERMINATED)
+			ok = transfer_striped(c) && ok;
+
 		if (!ok) {
 			status = EXIT_FAILURE;
 			fprintf(stderr, "Transferring all files failed\n");
 		}
 	}
 
+	if (NULL != c->st)
+		stats_report(c->st, stdout, "this session");
+
+	tuner_save(c->tuner);
 	destroy_client(c);
 
 	if (l_port != NULL)
@@ -560,6 +2194,7 @@ int main(int argc, char *argv[])
 
 	free(r_port);
 	free(key_path);
+	free(cache_path);
 	free(file_paths);
 	return status;
 }
@@ -63,24 +63,158 @@ void init_gcrypt()
 	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 }
 
-gcry_cipher_hd_t init_cipher_context(uint8_t *vector, uint8_t *key)
+gcry_cipher_hd_t init_cipher_context(uint8_t *vector, uint8_t *key,
+				     uint8_t suite)
 {
 	gcry_cipher_hd_t hd;
 	gcry_error_t err = 0;
+	int mode = GCRY_CIPHER_MODE_CBC;
 
-	err =
-	    gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CBC, 0);
+	if (suite == CIPHER_CTR)
+		mode = GCRY_CIPHER_MODE_CTR;
+	else if (suite == CIPHER_GCM)
+		mode = GCRY_CIPHER_MODE_GCM;
+
+	err = gcry_cipher_open(&hd, GCRY_CIPHER_AES256, mode, 0);
 	g_error(err);
 
 	err = gcry_cipher_setkey(hd, key, KEY_SIZE);
 	g_error(err);
 
-	gcry_cipher_setiv(hd, vector, INIT_VEC_BYTES);
+	if (suite == CIPHER_CBC)
+		err = gcry_cipher_setiv(hd, vector, INIT_VEC_BYTES);
+	else
+		cipher_seek(hd, suite, vector, 0, 0, DEFAULT_CHUNK_SIZE);
 	g_error(err);
 
 	return hd;
 }
 
+void cipher_seek(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *vector,
+		 uint32_t file_idx, uint64_t offset, uint32_t chunk_size)
+{
+	if (suite == CIPHER_CBC)
+		return;
+
+	uint8_t ctr[AES_BLOCKSIZE];
+	memcpy(ctr, vector, AES_BLOCKSIZE / 2);
+
+	for (int i = 0; i < 4; i++)
+		ctr[AES_BLOCKSIZE / 2 - 1 - i] ^= (file_idx >> (8 * i)) & 0xFF;
+
+	gcry_error_t err = 0;
+	if (suite == CIPHER_GCM) {
+		uint32_t chunk = offset / chunk_size;
+		for (int i = 0; i < 4; i++)
+			ctr[GCM_NONCE_BYTES - 1 - i] = (chunk >> (8 * i)) & 0xFF;
+
+		err = gcry_cipher_setiv(hd, ctr, GCM_NONCE_BYTES);
+	} else {
+		uint64_t block = offset / AES_BLOCKSIZE;
+		for (int i = 0; i < 8; i++)
+			ctr[AES_BLOCKSIZE - 1 - i] = (block >> (8 * i)) & 0xFF;
+
+		err = gcry_cipher_setctr(hd, ctr, AES_BLOCKSIZE);
+	}
+	g_error(err);
+}
+
+uint32_t chunk_frame_size(uint8_t suite, uint32_t chunk_size)
+{
+	if (suite == CIPHER_GCM)
+		return chunk_size + TAG_BYTES;
+
+	return chunk_size;
+}
+
+bool chunk_size_valid(uint64_t chunk_size)
+{
+	return chunk_size >= MIN_CHUNK_SIZE && chunk_size <= MAX_CHUNK_SIZE &&
+	       (chunk_size & (chunk_size - 1)) == 0;
+}
+
+uint8_t *aligned_buffer(size_t len)
+{
+	void *buf;
+	if (posix_memalign(&buf, BUFFER_ALIGN, len) != 0)
+		mem_error();
+
+	return buf;
+}
+
+void encrypt_chunk(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *frame,
+		   uint32_t len)
+{
+	gcry_error_t err = gcry_cipher_encrypt(hd, frame, len, NULL, 0);
+	g_error(err);
+
+	if (suite == CIPHER_GCM) {
+		err = gcry_cipher_gettag(hd, frame + len, TAG_BYTES);
+		g_error(err);
+	}
+}
+
+bool decrypt_chunk(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *frame,
+		   uint32_t len)
+{
+	gcry_error_t err = gcry_cipher_decrypt(hd, frame, len, NULL, 0);
+	g_error(err);
+
+	if (suite != CIPHER_GCM)
+		return true;
+
+	err = gcry_cipher_checktag(hd, frame + len, TAG_BYTES);
+	if (gcry_err_code(err) == GPG_ERR_CHECKSUM)
+		return false;
+
+	g_error(err);
+	return true;
+}
+
+uint32_t files_bytes(uint8_t version)
+{
+	return version >= WIDE_PROTOCOL_VERSION ? WIDE_FILES_BYTES : FILES_BYTES;
+}
+
+uint32_t size_bytes(uint8_t version)
+{
+	return version >= WIDE_PROTOCOL_VERSION ? WIDE_SIZE_BYTES : SIZE_BYTES;
+}
+
+uint32_t response_size(uint8_t version)
+{
+	return version >= WIDE_PROTOCOL_VERSION ? WIDE_RETURN_SIZE : RETURN_SIZE;
+}
+
+void put_be(uint8_t *buf, uint64_t value, uint32_t bytes)
+{
+	for (uint32_t i = 0; i < bytes; i++)
+		buf[bytes - 1 - i] = (value >> (8 * i)) & 0xFF;
+}
+
+uint64_t get_be(uint8_t *buf, uint32_t bytes)
+{
+	uint64_t value = 0;
+	for (uint32_t i = 0; i < bytes; i++)
+		value = value << 8 | buf[i];
+
+	return value;
+}
+
+int parse_cipher_suite(char *name)
+{
+	if (strcmp(name, "cbc") == 0)
+		return CIPHER_CBC;
+
+	if (strcmp(name, "ctr") == 0)
+		return CIPHER_CTR;
+
+	if (strcmp(name, "gcm") == 0)
+		return CIPHER_GCM;
+
+	return -1;
+}
+
 char *parse_ip(char *ip_port)
 {
 	int host_len = 0;
@@ -129,16 +263,16 @@ char *parse_port(char *ip_port)
 	return port;
 }
 
-char *hash_to_hex(uint8_t *hash)
+char *hash_to_hex(uint8_t *hash, uint32_t len)
 {
-	char *hex = malloc(HASH_BYTES * 2 + 1);
+	char *hex = malloc(len * 2 + 1);
 	if (NULL == hex)
 		mem_error();
 
-	for (int i = 0; i < HASH_BYTES; i++) {
-		snprintf(&hex[i * 2], 2 * HASH_BYTES + 1, "%02X", hash[i]);
+	for (uint32_t i = 0; i < len; i++) {
+		snprintf(&hex[i * 2], 3, "%02X", hash[i]);
 	}
 
-	hex[HASH_BYTES * 2] = '\0';
+	hex[len * 2] = '\0';
 	return hex;
 }
@@ -11,6 +11,7 @@
 
 #include <gcrypt.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define DEFAULT_SERVER_PORT "6060"
@@ -20,14 +21,71 @@
 #define NAME_BYTES 255
 #define SIZE_BYTES 4
 
-#define HASH_ALGO GCRY_MD_SHA1
-#define HASH_BYTES 20
-
 #define RETURN_SIZE 3	// Response from server
-#define CHUNK_SIZE (2 << 14) //  ~32 KB for better large file performance
+
+// Files are sent in chunks of a size the client picks, a power of two
+// within these bounds. Headers before version 5 always use the default.
+#define DEFAULT_CHUNK_SIZE (2 << 14) //  ~32 KB for better large file performance
+#define MIN_CHUNK_SIZE (1 << 12)
+#define MAX_CHUNK_SIZE (1 << 22)
+#define BUFFER_ALIGN 4096 // Chunk buffers are page aligned
 
 #define HEADER_INIT_SIZE (FILES_BYTES + INIT_VEC_BYTES)
-#define HEADER_LINE_SIZE (NAME_BYTES + SIZE_BYTES + HASH_BYTES)
+#define HEADER_LINE_SIZE(size_len, hash_len)                                   \
+	(NAME_BYTES + (size_len) + (hash_len))
+
+// Extended headers start with a zero file count, followed by the
+// protocol version, transfer flags, cipher suite, since version 3 the
+// hash algorithm and since version 5 the chunk size
+#define PROTOCOL_VERSION 5
+#define MIN_PROTOCOL_VERSION 2
+
+// Since version 4 the file count, file sizes and the file index of
+// server responses are wider
+#define WIDE_PROTOCOL_VERSION 4
+#define WIDE_FILES_BYTES 4
+#define WIDE_SIZE_BYTES 8
+#define WIDE_RETURN_SIZE 5
+#define MAX_RETURN_SIZE WIDE_RETURN_SIZE
+#define HEADER_WIDE_SIZE (HEADER_EXT_SIZE - FILES_BYTES + WIDE_FILES_BYTES)
+#define CHUNKED_PROTOCOL_VERSION 5
+#define CHUNK_SIZE_BYTES 4
+#define HEADER_CHUNKED_SIZE (HEADER_WIDE_SIZE + CHUNK_SIZE_BYTES)
+#define MAX_FILES (1 << 20) // Most files a server accepts in one header
+#define MARKER_BYTES 2
+#define VERSION_BYTES 1
+#define FLAGS_BYTES 1
+#define CIPHER_BYTES 1
+#define HASH_ALGO_BYTES 1
+#define HEADER_EXT_SIZE                                                        \
+	(MARKER_BYTES + VERSION_BYTES + FLAGS_BYTES + CIPHER_BYTES +            \
+	 HASH_ALGO_BYTES + HEADER_INIT_SIZE)
+
+#define CIPHER_CBC 0 // AES-256-CBC chained across the whole transfer
+#define CIPHER_CTR 1 // AES-256-CTR, counter derived from file and offset
+#define CIPHER_GCM 2 // AES-256-GCM, every chunk authenticated by a tag
+#define CIPHER_SUITES 3
+
+#define TAG_BYTES 16 // GCM tag following each encrypted chunk
+#define GCM_NONCE_BYTES 12
+
+#define FLAG_PIPELINE 0x01 // Files sent back-to-back, results returned async
+#define FLAG_STRIPE 0x02   // One byte range of a file sent over many sockets
+#define FLAG_DEDUPE 0x04   // Only chunks the server is missing are sent
+#define FLAG_RESUME 0x08   // Files the server has part of are resumed
+#define FLAG_COMPRESS 0x10 // Chunks are deflated before they are encrypted
+#define FLAG_PACK 0x20     // Files sent as one stream, only its end padded
+
+// Stripe descriptor following the file of a striped transfer
+#define OWNER_BYTES 64 // ip:port of the client that owns the file
+#define STRIPE_IDX_BYTES 1
+#define STRIPE_CNT_BYTES 1
+#define STRIPE_NONCE_BYTES 16 // Shared by the stripes of one attempt at a file
+#define STRIPE_MAC_BYTES 32 // HMAC-SHA256 of the header with the owner's key
+#define STRIPE_DESC_SIZE                                                       \
+	(OWNER_BYTES + STRIPE_IDX_BYTES + STRIPE_CNT_BYTES +                    \
+	 STRIPE_NONCE_BYTES + STRIPE_MAC_BYTES)
+#define MAX_STRIPES 64
 
 #define TRANSFER_D 2 // Duplicate
 #define TRANSFER_Y 1 // Successful
@@ -63,10 +121,89 @@ void mem_error(void);
 void init_gcrypt();
 
 /*
- * Initialize an AES-256 cipher context with the given initialization
- * vector and key
+ * Initialize an AES-256 cipher context for the given cipher suite with
+ * the given initialization vector and key
+ */
+gcry_cipher_hd_t init_cipher_context(uint8_t *vector, uint8_t *key,
+				     uint8_t suite);
+
+/*
+ * Position the cipher context at the given byte offset of the file at
+ * the given index, so chunks can be processed in any order. Counter
+ * blocks are the first half of the initialization vector xor the file
+ * index, followed by the offset in blocks. GCM nonces use the number of
+ * the chunk of chunk_size bytes in place of the block offset. Chained
+ * suites can't seek and are left as is.
+ */
+void cipher_seek(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *vector,
+		 uint32_t file_idx, uint64_t offset, uint32_t chunk_size);
+
+/*
+ * Return the number of bytes each chunk of the given size takes on the
+ * wire for the given cipher suite
+ */
+uint32_t chunk_frame_size(uint8_t suite, uint32_t chunk_size);
+
+/*
+ * Returns true if the given chunk size is a power of two within the
+ * bounds every server accepts
+ */
+bool chunk_size_valid(uint64_t chunk_size);
+
+/*
+ * Return a new buffer of len bytes aligned to BUFFER_ALIGN, released
+ * with free
+ */
+uint8_t *aligned_buffer(size_t len);
+
+/*
+ * Encrypt the first len bytes of a chunk frame in place, the whole
+ * chunk unless it is compressed. Authenticated suites append the
+ * chunk's tag after them.
+ */
+void encrypt_chunk(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *frame,
+		   uint32_t len);
+
+/*
+ * Decrypt the first len bytes of a chunk frame in place. Returns false
+ * when the frame fails authentication, the decrypted contents must not
+ * be used then.
+ */
+bool decrypt_chunk(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *frame,
+		   uint32_t len);
+
+/*
+ * Return the number of bytes of the file count and of each file index
+ * in the given protocol version, 1 being the original header
+ */
+uint32_t files_bytes(uint8_t version);
+
+/*
+ * Return the number of bytes of each file size in the given protocol
+ * version
+ */
+uint32_t size_bytes(uint8_t version);
+
+/*
+ * Return the number of bytes of a server response in the given
+ * protocol version: a file index followed by a transfer status
+ */
+uint32_t response_size(uint8_t version);
+
+/*
+ * Store the given value big-endian in the given number of bytes
+ */
+void put_be(uint8_t *buf, uint64_t value, uint32_t bytes);
+
+/*
+ * Return the big-endian value stored in the given number of bytes
+ */
+uint64_t get_be(uint8_t *buf, uint32_t bytes);
+
+/*
+ * Return the cipher suite with the given name, -1 if unknown
  */
-gcry_cipher_hd_t init_cipher_context(uint8_t *vector, uint8_t *key);
+int parse_cipher_suite(char *name);
 
 /*
  * Parse the ip address from the given string with an optional ip and
@@ -81,9 +218,9 @@ char *parse_ip(char *ip_port);
 char *parse_port(char *ip_port);
 
 /*
- * Convert a binary hash to hex representation safe for file system
- * and terminal use
+ * Convert a binary hash of len bytes to hex representation safe for
+ * file system and terminal use
  */
-char *hash_to_hex(uint8_t *hash);
+char *hash_to_hex(uint8_t *hash, uint32_t len);
 
 #endif /* COMMON_H */
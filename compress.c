@@ -0,0 +1,230 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Per-chunk compression of transfers, at a level adapting to
+ *  the link and the CPU
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "compress.h"
+
+/*
+ * Return a monotonic clock reading in nanoseconds
+ */
+static uint64_t compress_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+compressor *compressor_init(void)
+{
+	compressor *c = calloc(1, sizeof(compressor));
+	if (NULL == c)
+		mem_error();
+
+	pthread_mutex_init(&c->lock, NULL);
+	c->level = COMPRESS_MIN_LEVEL;
+	c->threads = 1;
+	return c;
+}
+
+void compressor_set_threads(compressor *c, int threads)
+{
+	pthread_mutex_lock(&c->lock);
+	c->threads = threads;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Return the level to compress the next chunk at
+ */
+static int compressor_level(compressor *c)
+{
+	pthread_mutex_lock(&c->lock);
+	int level = c->level;
+	pthread_mutex_unlock(&c->lock);
+	return level;
+}
+
+/*
+ * Record that compressing len bytes of a chunk took the given time
+ */
+static void compressor_add_cpu(compressor *c, uint32_t len, uint64_t ns)
+{
+	pthread_mutex_lock(&c->lock);
+	c->cpu_bytes += len;
+	c->cpu_ns += ns;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Blend a rate measured over the last window into a smoothed rate
+ */
+static double smooth(double rate, double measured)
+{
+	if (rate == 0)
+		return measured;
+
+	return (3 * rate + measured) / 4;
+}
+
+void compressor_add_link(compressor *c, uint32_t len)
+{
+	uint64_t now = compress_clock();
+
+	pthread_mutex_lock(&c->lock);
+	if (c->link_bytes == 0)
+		c->link_start = now;
+	c->link_bytes += len;
+
+	uint64_t elapsed = now - c->link_start;
+	if (c->link_bytes >= COMPRESS_ADAPT_BYTES && c->cpu_ns > 0 &&
+	    elapsed > 0) {
+		// Both rates are in bytes of chunk contents per nanosecond,
+		// smoothed over windows since socket buffers make the link
+		// look faster while they fill
+		double cpu = (double)c->cpu_bytes * c->threads / c->cpu_ns;
+		double link = (double)c->link_bytes / elapsed;
+		c->cpu_rate = smooth(c->cpu_rate, cpu);
+		c->link_rate = smooth(c->link_rate, link);
+
+		// Compression that keeps up with the link can afford to work
+		// harder, compression holding the transfer back has to ease
+		// off. The slack between them keeps the level from flapping.
+		if (c->cpu_rate < 1.25 * c->link_rate &&
+		    c->level > COMPRESS_MIN_LEVEL)
+			c->level--;
+		else if (c->cpu_rate > 2 * c->link_rate &&
+			 c->level < COMPRESS_MAX_LEVEL)
+			c->level++;
+
+		c->cpu_bytes = c->cpu_ns = 0;
+		c->link_bytes = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void compressor_destroy(compressor *c)
+{
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+deflater *deflater_init(void)
+{
+	deflater *d = calloc(1, sizeof(deflater));
+	if (NULL == d)
+		mem_error();
+
+	d->level = COMPRESS_MIN_LEVEL;
+	if (deflateInit(&d->zs, d->level) != Z_OK)
+		mem_error();
+
+	return d;
+}
+
+void deflater_destroy(deflater *d)
+{
+	deflateEnd(&d->zs);
+	free(d);
+}
+
+/*
+ * Round the length of compressed contents up to whole cipher blocks
+ */
+static uint32_t padded_size(uint32_t len)
+{
+	return (len + AES_BLOCKSIZE - 1) / AES_BLOCKSIZE * AES_BLOCKSIZE;
+}
+
+uint32_t deflate_chunk(deflater *d, compressor *c, uint8_t *in, uint32_t len,
+		       uint8_t *out, uint32_t chunk_size)
+{
+	uint64_t start = compress_clock();
+
+	deflateReset(&d->zs);
+	int level = compressor_level(c);
+	if (level != d->level) {
+		deflateParams(&d->zs, level, Z_DEFAULT_STRATEGY);
+		d->level = level;
+	}
+
+	// Output that can't fit a frame smaller than a whole chunk is cut
+	// off, the chunk is sent as is then
+	d->zs.next_in = in;
+	d->zs.avail_in = len;
+	d->zs.next_out = out;
+	d->zs.avail_out = chunk_size - AES_BLOCKSIZE;
+	int status = deflate(&d->zs, Z_FINISH);
+
+	compressor_add_cpu(c, len, compress_clock() - start);
+	if (status != Z_STREAM_END)
+		return 0;
+
+	uint32_t out_len = d->zs.total_out;
+	gcry_create_nonce(out + out_len, padded_size(out_len) - out_len);
+	return out_len;
+}
+
+bool inflate_chunk(uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t len)
+{
+	uLongf out_len = len;
+	return uncompress(out, &out_len, in, in_len) == Z_OK && out_len == len;
+}
+
+uint32_t frame_prefix(uint8_t *frame)
+{
+	return (uint32_t)frame[0] << 24 | (uint32_t)frame[1] << 16 |
+	       (uint32_t)frame[2] << 8 | frame[3];
+}
+
+void frame_set_prefix(uint8_t *frame, uint32_t prefix)
+{
+	for (int i = 0; i < FRAME_PREFIX_BYTES; i++)
+		frame[FRAME_PREFIX_BYTES - 1 - i] = (prefix >> (8 * i)) & 0xFF;
+}
+
+uint32_t frame_cipher_size(uint32_t prefix, uint32_t chunk_size)
+{
+	if (prefix == 0)
+		return chunk_size;
+
+	uint32_t len = prefix & ~FRAME_COMPRESSED;
+	if (!(prefix & FRAME_COMPRESSED) || len == 0 ||
+	    padded_size(len) >= chunk_size)
+		return 0;
+
+	return padded_size(len);
+}
+
+uint32_t frame_payload_size(uint8_t suite, uint32_t prefix,
+			    uint32_t chunk_size)
+{
+	uint32_t len = frame_cipher_size(prefix, chunk_size);
+	if (len == 0 || suite != CIPHER_GCM)
+		return len;
+
+	return len + TAG_BYTES;
+}
+
+void frame_authenticate(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *frame)
+{
+	if (suite != CIPHER_GCM)
+		return;
+
+	gcry_error_t err = gcry_cipher_authenticate(hd, frame,
+						    FRAME_PREFIX_BYTES);
+	g_error(err);
+}
@@ -0,0 +1,136 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to per-chunk compression of transfers. Chunks are
+ *  deflated before they are encrypted, at a level that adapts to how
+ *  fast the link drains them compared to how fast they are compressed.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "common.h"
+
+// Every frame of a compressed transfer starts with a prefix holding the
+// length of its compressed contents, 0 for a chunk sent as is
+#define FRAME_PREFIX_BYTES 4
+#define FRAME_COMPRESSED 0x80000000
+
+#define COMPRESS_MIN_LEVEL 1
+#define COMPRESS_MAX_LEVEL 9
+#define COMPRESS_ADAPT_BYTES (1 << 22) // Sent between level changes
+
+/*
+ * Level chunks of one connection are compressed at, and the throughput
+ * measured since it last changed. Every thread compressing for the
+ * connection shares it.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	int level;
+	int threads;	     // Threads compressing at once
+	uint64_t cpu_bytes;  // Chunk bytes compressed
+	uint64_t cpu_ns;     // Time spent compressing them
+	uint64_t link_bytes; // Chunk bytes sent
+	uint64_t link_start; // When the first of them was sent
+	double cpu_rate;     // Smoothed bytes compressed per nanosecond
+	double link_rate;    // Smoothed bytes sent per nanosecond
+} compressor;
+
+/*
+ * A deflate stream owned by one compressing thread, reset for every
+ * chunk so chunks inflate independently
+ */
+typedef struct {
+	z_stream zs;
+	int level;
+} deflater;
+
+/*
+ * Create the shared compression state of a connection, starting at the
+ * fastest level
+ */
+compressor *compressor_init(void);
+
+/*
+ * Set the number of threads compressing chunks in parallel from now on
+ */
+void compressor_set_threads(compressor *c, int threads);
+
+/*
+ * Record that a frame carrying len bytes of chunk contents was sent.
+ * Every COMPRESS_ADAPT_BYTES, the rate chunks were sent at is compared
+ * with the rate they were compressed at: the level is raised while the
+ * link is the bottleneck and lowered while compression is.
+ */
+void compressor_add_link(compressor *c, uint32_t len);
+
+/*
+ * Release the shared compression state
+ */
+void compressor_destroy(compressor *c);
+
+/*
+ * Create a deflate stream for a thread compressing chunks
+ */
+deflater *deflater_init(void);
+
+/*
+ * Release a deflate stream
+ */
+void deflater_destroy(deflater *d);
+
+/*
+ * Compress len bytes of a chunk of the transfer's chunk size into out,
+ * which holds a whole chunk, at the connection's current level. Returns
+ * the compressed length, or 0 when the chunk doesn't get smaller than a
+ * whole chunk frame and should be sent as is.
+ */
+uint32_t deflate_chunk(deflater *d, compressor *c, uint8_t *in, uint32_t len,
+		       uint8_t *out, uint32_t chunk_size);
+
+/*
+ * Decompress a chunk into out, which must end up exactly len bytes
+ * long. Returns false when the data is corrupt.
+ */
+bool inflate_chunk(uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t len);
+
+/*
+ * Return the prefix at the start of a frame
+ */
+uint32_t frame_prefix(uint8_t *frame);
+
+/*
+ * Store the prefix at the start of a frame
+ */
+void frame_set_prefix(uint8_t *frame, uint32_t prefix);
+
+/*
+ * Return the number of encrypted bytes following a frame's prefix, for
+ * chunks of the given size: compressed contents are padded to whole
+ * cipher blocks. Returns 0 for a prefix no valid frame has.
+ */
+uint32_t frame_payload_size(uint8_t suite, uint32_t prefix,
+			    uint32_t chunk_size);
+
+/*
+ * Return the number of encrypted bytes of a payload, without the tag
+ * of authenticated suites
+ */
+uint32_t frame_cipher_size(uint32_t prefix, uint32_t chunk_size);
+
+/*
+ * Authenticate a frame's prefix along with its contents, for suites
+ * with a tag. Called after the cipher is positioned at the chunk.
+ */
+void frame_authenticate(gcry_cipher_hd_t hd, uint8_t suite, uint8_t *frame);
+
+#endif /* COMPRESS_H */
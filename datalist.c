@@ -7,9 +7,9 @@
  *  transfer specific fields
  */
 
-#include <arpa/inet.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -18,7 +18,7 @@
 
 data_head *datalist_init(uint8_t *vector)
 {
-	data_head *list = calloc(1, sizeof(data_node));
+	data_head *list = calloc(1, sizeof(data_head));
 	if (list == NULL)
 		mem_error();
 
@@ -33,15 +33,25 @@ data_head *datalist_init(uint8_t *vector)
 	list->first = NULL;
 	list->last = NULL;
 	list->size = 0;
+	list->version = 1;
+	list->flags = 0;
+	list->suite = CIPHER_CBC;
+	list->hash_algo = HASH_SHA1;
+	list->chunk_size = DEFAULT_CHUNK_SIZE;
+	memset(list->owner, '\0', sizeof(list->owner));
+	list->owner_key = NULL;
+	list->stripe = 0;
+	list->stripes = 0;
 
 	return list;
 }
 
 /*
- * Return a new node with the given name, size, hash, and transfer status
+ * Return a new node with the given name, size, hash of hash_len bytes,
+ * and transfer status
  */
-static data_node *datalist_create_node(char *name, uint32_t size, uint8_t *hash,
-				       int transfer)
+static data_node *datalist_create_node(char *name, uint64_t size, uint8_t *hash,
+				       uint32_t hash_len, int transfer)
 {
 	data_node *node = calloc(1, sizeof(data_node));
 	if (node == NULL)
@@ -52,23 +62,25 @@ static data_node *datalist_create_node(char *name, uint32_t size, uint8_t *hash,
 		mem_error();
 	memcpy(node->name, name, NAME_BYTES);
 
-	node->hash = calloc(HASH_BYTES, 1);
+	node->hash = calloc(MAX_HASH_BYTES, 1);
 	if (node->hash == NULL)
 		mem_error();
-	memcpy(node->hash, hash, HASH_BYTES);
+	memcpy(node->hash, hash, hash_len);
 
 	node->transfer = transfer;
 	node->next = NULL;
 	node->prev = NULL;
 	node->size = size;
+	node->resume = 0;
 
 	return node;
 }
 
-void datalist_append(data_head *list, char *name, uint32_t size, uint8_t *hash,
+void datalist_append(data_head *list, char *name, uint64_t size, uint8_t *hash,
 		     int transfer)
 {
-	data_node *newNode = datalist_create_node(name, size, hash, transfer);
+	data_node *newNode = datalist_create_node(
+	    name, size, hash, hash_bytes(list->hash_algo), transfer);
 	if (list->size == 0) {
 		list->first = newNode;
 		list->last = newNode;
@@ -87,6 +99,7 @@ void datalist_append(data_head *list, char *name, uint32_t size, uint8_t *hash,
  */
 static void datalist_remove(data_head *list, data_node *node)
 {
+	list->hint = NULL;
 	if (list->size == 1) {
 		list->first = NULL;
 		list->last = NULL;
@@ -114,18 +127,64 @@ static void datalist_remove(data_head *list, data_node *node)
 }
 
 /*
- * Set the given nodes name, size and hash from the given bytes
+ * Copy the given nodes name, size of size_len bytes and hash of
+ * hash_len bytes to the given location
  */
-static void datalist_copy_item(data_node *node, uint8_t *copy_location)
+static void datalist_copy_item(data_node *node, uint8_t *copy_location,
+			       uint32_t size_len, uint32_t hash_len)
 {
 	memcpy(copy_location, basename(node->name), NAME_BYTES);
 	copy_location += NAME_BYTES;
 
-	uint32_t net_file_size = htonl(node->size);
-	memcpy(copy_location, &net_file_size, sizeof(uint32_t));
+	put_be(copy_location, node->size, size_len);
+	copy_location += size_len;
+	memcpy(copy_location, node->hash, hash_len);
+}
+
+/*
+ * Returns true if the original header can't hold the given list's file
+ * count or one of its file sizes
+ */
+static bool datalist_wide(data_head *list)
+{
+	if (list->size > UINT16_MAX)
+		return true;
+
+	for (data_node *pos = list->first; pos != NULL; pos = pos->next) {
+		if (pos->size > UINT32_MAX)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Return the protocol version of the header sent for the given list.
+ * Lists needing none of the extended fields use the original header.
+ */
+static uint8_t datalist_header_version(data_head *list)
+{
+	if (list->flags != 0 || list->suite != CIPHER_CBC ||
+	    list->hash_algo != HASH_SHA1 ||
+	    list->chunk_size != DEFAULT_CHUNK_SIZE || datalist_wide(list))
+		return PROTOCOL_VERSION;
 
-	copy_location += SIZE_BYTES;
-	memcpy(copy_location, node->hash, HASH_BYTES);
+	return 1;
+}
+
+uint32_t datalist_payload_size(data_head *list)
+{
+	uint8_t version = datalist_header_version(list);
+	uint32_t payload_size = HEADER_INIT_SIZE;
+	if (version > 1)
+		payload_size = HEADER_CHUNKED_SIZE;
+
+	if (list->flags & FLAG_STRIPE)
+		payload_size += STRIPE_DESC_SIZE;
+
+	return payload_size +
+	       list->size * HEADER_LINE_SIZE(size_bytes(version),
+					     hash_bytes(list->hash_algo));
 }
 
 uint8_t *datalist_generate_payload(data_head *list)
@@ -134,31 +193,75 @@ uint8_t *datalist_generate_payload(data_head *list)
 	uint8_t *copy_location;
 	data_node *pos = list->first;
 
-	int payload_size = HEADER_INIT_SIZE;
-	payload_size += list->size * HEADER_LINE_SIZE;
-
-	payload = calloc(payload_size, 1);
+	payload = calloc(datalist_payload_size(list), 1);
 	if (payload == NULL)
 		mem_error();
 
 	copy_location = payload;
 
-	uint16_t tmp = htons(list->size);
-	memcpy(copy_location, &tmp, sizeof(uint16_t));
+	// Marker is left zeroed
+	list->version = datalist_header_version(list);
+	if (list->version > 1) {
+		copy_location += MARKER_BYTES;
+		*copy_location = PROTOCOL_VERSION;
+		copy_location += VERSION_BYTES;
+		*copy_location = list->flags;
+		copy_location += FLAGS_BYTES;
+		*copy_location = list->suite;
+		copy_location += CIPHER_BYTES;
+		*copy_location = list->hash_algo;
+		copy_location += HASH_ALGO_BYTES;
+		put_be(copy_location, list->chunk_size, CHUNK_SIZE_BYTES);
+		copy_location += CHUNK_SIZE_BYTES;
+	}
 
-	copy_location += FILES_BYTES;
+	put_be(copy_location, list->size, files_bytes(list->version));
+	copy_location += files_bytes(list->version);
 	memcpy(copy_location, list->vector, INIT_VEC_BYTES);
 	copy_location += INIT_VEC_BYTES;
 
+	uint32_t size_len = size_bytes(list->version);
+	uint32_t hash_len = hash_bytes(list->hash_algo);
 	while (pos != NULL) {
-		datalist_copy_item(pos, copy_location);
-		copy_location += NAME_BYTES + HASH_BYTES + SIZE_BYTES;
+		datalist_copy_item(pos, copy_location, size_len, hash_len);
+		copy_location += HEADER_LINE_SIZE(size_len, hash_len);
 		pos = pos->next;
 	}
 
+	if (list->flags & FLAG_STRIPE) {
+		memcpy(copy_location, list->owner, strlen(list->owner));
+		copy_location += OWNER_BYTES;
+		*copy_location = list->stripe;
+		copy_location += STRIPE_IDX_BYTES;
+		*copy_location = list->stripes;
+		copy_location += STRIPE_CNT_BYTES;
+		memcpy(copy_location, list->nonce, STRIPE_NONCE_BYTES);
+		copy_location += STRIPE_NONCE_BYTES;
+
+		// The owner's key proves the stripe belongs to the owner
+		digest_hmac(list->owner_key, payload, copy_location - payload,
+			    copy_location);
+	}
+
 	return payload;
 }
 
+void datalist_stripe_range(data_head *list, uint64_t *offset, uint64_t *len)
+{
+	uint64_t size = list->first->size;
+	uint32_t chunk_size = list->chunk_size;
+	uint64_t chunks = size / chunk_size + (size % chunk_size != 0);
+	uint64_t per_stripe = (chunks + list->stripes - 1) / list->stripes;
+
+	*offset = list->stripe * per_stripe * chunk_size;
+	*len = per_stripe * chunk_size;
+
+	if (*offset > size)
+		*offset = size;
+	if (*len > size - *offset)
+		*len = size - *offset;
+}
+
 void datalist_destroy(data_head *list)
 {
 	while (list->first != NULL)
@@ -175,11 +278,20 @@ data_node *datalist_get_index(data_head *list, uint32_t index)
 	if (index > list->size || index < 1)
 		return NULL;
 
+	// Files are mostly visited in order, so the walk starts from the
+	// last node looked up when it is on the way
 	data_node *node = list->first;
+	uint32_t i = 1;
+	if (NULL != list->hint && list->hint_idx <= index) {
+		node = list->hint;
+		i = list->hint_idx;
+	}
 
-	for (uint32_t i = 1; i < index; i++, node = node->next)
+	for (; i < index; i++, node = node->next)
 		;
 
+	list->hint = node;
+	list->hint_idx = index;
 	return node;
 }
 
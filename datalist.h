@@ -12,6 +12,9 @@
 
 #include <stdint.h>
 
+#include "common.h"
+#include "digest.h"
+
 /*
  * Represents a single file for transfer
  */
@@ -19,9 +22,10 @@ typedef struct data_node {
 	struct data_node *prev;
 	struct data_node *next;
 	char *name;
-	uint32_t size;
+	uint64_t size;
 	uint8_t *hash;
 	int transfer;
+	uint64_t resume; // Offset the transfer of the file resumes from
 } data_node;
 
 /*
@@ -32,6 +36,20 @@ typedef struct data_head {
 	data_node *last;
 	uint32_t size;
 	uint8_t *vector;
+	uint8_t version; // Protocol version of the header, 1 for the original
+	uint8_t flags;  // Transfer flags, extended header sent when set
+	uint8_t suite; // Cipher suite, extended header sent unless CBC
+	uint8_t hash_algo; // Extended header sent unless SHA-1
+	uint32_t chunk_size; // Extended header sent unless the default
+	data_node *hint;   // Last node looked up by index
+	uint32_t hint_idx;
+
+	// Striped transfers only
+	char owner[OWNER_BYTES + 1];
+	uint8_t stripe; // 0 based index of the range being sent
+	uint8_t stripes;
+	uint8_t nonce[STRIPE_NONCE_BYTES]; // Tells attempts at the file apart
+	uint8_t *owner_key; // Sending only, the header is authenticated with it
 } data_head;
 
 /*
@@ -41,9 +59,9 @@ data_head *datalist_init(uint8_t *vector);
 
 /*
  * Append a new node to the given list with the given name, size,
- * hash, and transfer status
+ * hash, and transfer status. The hash uses the list's algorithm.
  */
-void datalist_append(data_head *list, char *name, uint32_t size, uint8_t *hash,
+void datalist_append(data_head *list, char *name, uint64_t size, uint8_t *hash,
 		     int transfer);
 
 /*
@@ -52,15 +70,30 @@ void datalist_append(data_head *list, char *name, uint32_t size, uint8_t *hash,
 void datalist_destroy(data_head *list);
 
 /*
- * Return the node in the list at the given index (1 based index)
+ * Return the node in the list at the given index (1 based index).
+ * Looking nodes up in order walks the list once.
  */
 data_node *datalist_get_index(data_head *list, uint32_t index);
 
 /*
- * Return the initial transfer payload for the given list
+ * Return the initial transfer payload for the given list, recording the
+ * protocol version it is written in as the list's version
  */
 uint8_t *datalist_generate_payload(data_head *list);
 
+/*
+ * Return the size in bytes of the initial transfer payload for the
+ * given list
+ */
+uint32_t datalist_payload_size(data_head *list);
+
+/*
+ * Return the byte range of the first file in the given striped list
+ * that is sent by the list's stripe. Every stripe but the last covers
+ * the same whole number of chunks.
+ */
+void datalist_stripe_range(data_head *list, uint64_t *offset, uint64_t *len);
+
 /*
  * Return the index of the next node active for transferring relative
  * to the provided index. Returns list size + 1 if no more nodes after
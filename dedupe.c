@@ -0,0 +1,404 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Chunk level deduplication. Clients split files at content
+ *  defined boundaries, servers keep every chunk received in a
+ *  per-client chunk store.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dedupe.h"
+#include "digest.h"
+#include "filesys.h"
+#include "hashindex.h"
+
+#define CDC_BUF_SIZE (4 * CDC_MAX_SIZE)
+#define GEAR_SEED 0x2545F4914F6CDD1DULL
+
+// Normalized chunking: cuts are harder to find before the average size
+// and easier after it. The masks use the top bits, which depend on the
+// last 64 bytes read.
+#define CDC_MASK_HARD (((1ULL << 18) - 1) << 46)
+#define CDC_MASK_EASY (((1ULL << 14) - 1) << 50)
+
+static uint64_t gear[256];
+static bool gear_ready;
+
+/*
+ * Fill the gear table the rolling hash adds for each byte. It has to
+ * be the same everywhere so equal contents are cut the same way, so it
+ * comes from a fixed seed.
+ */
+static void init_gear(void)
+{
+	uint64_t x = GEAR_SEED;
+
+	for (int i = 0; i < 256; i++) {
+		// splitmix64
+		uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		gear[i] = z ^ (z >> 31);
+	}
+
+	gear_ready = true;
+}
+
+/*
+ * Return the length of the chunk at the start of the given bytes, a
+ * FastCDC style gear hash picking the cut point
+ */
+static uint32_t cdc_cut(uint8_t *buf, uint32_t len)
+{
+	if (len <= CDC_MIN_SIZE)
+		return len;
+
+	if (len > CDC_MAX_SIZE)
+		len = CDC_MAX_SIZE;
+
+	uint32_t normal = len < CDC_AVG_SIZE ? len : CDC_AVG_SIZE;
+	uint64_t fp = 0;
+	uint32_t i = CDC_MIN_SIZE;
+
+	for (; i < normal; i++) {
+		fp = (fp << 1) + gear[buf[i]];
+		if (!(fp & CDC_MASK_HARD))
+			return i + 1;
+	}
+
+	for (; i < len; i++) {
+		fp = (fp << 1) + gear[buf[i]];
+		if (!(fp & CDC_MASK_EASY))
+			return i + 1;
+	}
+
+	return len;
+}
+
+/*
+ * Append a chunk of the given bytes at the given offset to the recipe
+ */
+static void recipe_append(recipe *r, uint32_t *cap, uint8_t *data,
+			  uint64_t offset, uint32_t len)
+{
+	if (r->n == *cap) {
+		*cap = *cap == 0 ? 64 : 2 * *cap;
+		r->chunks = realloc(r->chunks, *cap * sizeof(cdc_chunk));
+		if (NULL == r->chunks)
+			mem_error();
+	}
+
+	cdc_chunk *c = &r->chunks[r->n++];
+	c->offset = offset;
+	c->len = len;
+	gcry_md_hash_buffer(GCRY_MD_SHA256, c->digest, data, len);
+}
+
+recipe *recipe_build(char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (NULL == f)
+		return NULL;
+
+	if (!gear_ready)
+		init_gear();
+
+	uint8_t *buf = malloc(CDC_BUF_SIZE);
+	recipe *r = calloc(1, sizeof(recipe));
+	if (NULL == buf || NULL == r)
+		mem_error();
+
+	uint32_t cap = 0, start = 0, have = 0;
+	uint64_t offset = 0;
+	bool eof = false;
+
+	while (!TERMINATED) {
+		// Keep at least a whole chunk buffered until the file ends
+		if (!eof && have - start < CDC_MAX_SIZE) {
+			memmove(buf, buf + start, have - start);
+			have -= start;
+			start = 0;
+
+			size_t n = fread(buf + have, 1, CDC_BUF_SIZE - have, f);
+			have += n;
+			eof = n == 0;
+			continue;
+		}
+
+		if (start == have)
+			break;
+
+		uint32_t len = cdc_cut(buf + start, have - start);
+		recipe_append(r, &cap, buf + start, offset, len);
+		start += len;
+		offset += len;
+	}
+
+	free(buf);
+	fclose(f);
+	return r;
+}
+
+uint8_t *recipe_payload(recipe *r, uint32_t *len)
+{
+	*len = RECIPE_COUNT_BYTES + r->n * RECIPE_ENTRY_SIZE;
+	uint8_t *payload = malloc(*len);
+	if (NULL == payload)
+		mem_error();
+
+	uint32_t count = htonl(r->n);
+	memcpy(payload, &count, RECIPE_COUNT_BYTES);
+
+	uint8_t *entry = payload + RECIPE_COUNT_BYTES;
+	for (uint32_t i = 0; i < r->n; i++, entry += RECIPE_ENTRY_SIZE) {
+		uint32_t chunk_len = htonl(r->chunks[i].len);
+		memcpy(entry, &chunk_len, RECIPE_LEN_BYTES);
+		memcpy(entry + RECIPE_LEN_BYTES, r->chunks[i].digest,
+		       CHUNK_DIGEST_BYTES);
+	}
+
+	return payload;
+}
+
+uint32_t recipe_count(uint8_t *payload)
+{
+	uint32_t count;
+	memcpy(&count, payload, RECIPE_COUNT_BYTES);
+	return ntohl(count);
+}
+
+uint64_t recipe_max_count(uint64_t file_size)
+{
+	// Only the last chunk can be shorter than the minimum
+	return file_size / CDC_MIN_SIZE + 1;
+}
+
+recipe *recipe_parse(uint8_t *entries, uint32_t count, uint64_t file_size)
+{
+	recipe *r = calloc(1, sizeof(recipe));
+	if (NULL == r)
+		mem_error();
+
+	r->n = count;
+	r->chunks = calloc(count, sizeof(cdc_chunk));
+	r->missing = calloc(recipe_bitmap_size(r), 1);
+	if ((count > 0 && NULL == r->chunks) || NULL == r->missing)
+		mem_error();
+
+	uint64_t offset = 0;
+	bool valid = true;
+	for (uint32_t i = 0; i < count && valid; i++) {
+		uint32_t len;
+		memcpy(&len, entries, RECIPE_LEN_BYTES);
+		len = ntohl(len);
+
+		valid = len > 0 && len <= CDC_MAX_SIZE &&
+			len <= file_size - offset;
+		r->chunks[i].offset = offset;
+		r->chunks[i].len = len;
+		memcpy(r->chunks[i].digest, entries + RECIPE_LEN_BYTES,
+		       CHUNK_DIGEST_BYTES);
+
+		offset += len;
+		entries += RECIPE_ENTRY_SIZE;
+	}
+
+	if (!valid || offset != file_size) {
+		recipe_destroy(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+uint32_t recipe_bitmap_size(recipe *r) { return (r->n + 7) / 8; }
+
+bool recipe_missing(recipe *r, uint32_t i)
+{
+	return (r->missing[i / 8] & (0x80 >> (i % 8))) != 0;
+}
+
+void recipe_set_missing(recipe *r, uint8_t *bitmap)
+{
+	if (NULL == r->missing) {
+		r->missing = malloc(recipe_bitmap_size(r));
+		if (NULL == r->missing && r->n > 0)
+			mem_error();
+	}
+
+	memcpy(r->missing, bitmap, recipe_bitmap_size(r));
+	r->missing_len = 0;
+	for (uint32_t i = 0; i < r->n; i++) {
+		if (recipe_missing(r, i))
+			r->missing_len += r->chunks[i].len;
+	}
+}
+
+void recipe_destroy(recipe *r)
+{
+	free(r->chunks);
+	free(r->missing);
+	free(r);
+}
+
+/*
+ * Order chunks by digest, then by position in the recipe
+ */
+static int compare_chunks(const void *a, const void *b)
+{
+	const cdc_chunk *x = *(cdc_chunk *const *)a;
+	const cdc_chunk *y = *(cdc_chunk *const *)b;
+
+	int d = memcmp(x->digest, y->digest, CHUNK_DIGEST_BYTES);
+	if (d != 0)
+		return d;
+
+	return x < y ? -1 : x > y;
+}
+
+void chunkstore_find_missing(char *chunk_dir, recipe *r)
+{
+	cdc_chunk **sorted = malloc(r->n * sizeof(cdc_chunk *));
+	if (NULL == sorted && r->n > 0)
+		mem_error();
+
+	for (uint32_t i = 0; i < r->n; i++)
+		sorted[i] = &r->chunks[i];
+	qsort(sorted, r->n, sizeof(cdc_chunk *), compare_chunks);
+
+	hash_index *idx = hashindex_open(chunk_dir);
+	memset(r->missing, 0, recipe_bitmap_size(r));
+	r->missing_len = 0;
+
+	for (uint32_t i = 0; i < r->n; i++) {
+		cdc_chunk *c = sorted[i];
+		if (i > 0 && memcmp(sorted[i - 1]->digest, c->digest,
+				    CHUNK_DIGEST_BYTES) == 0)
+			continue; // Repeated later in the file
+
+		if (hashindex_stored(chunk_dir, idx, CHUNK_ALGO, c->digest))
+			continue;
+
+		uint32_t pos = c - r->chunks;
+		r->missing[pos / 8] |= 0x80 >> (pos % 8);
+		r->missing_len += c->len;
+	}
+
+	if (NULL != idx)
+		hashindex_close(idx);
+	free(sorted);
+}
+
+/*
+ * Store a chunk under its digest in the chunk store. The chunk is
+ * written aside and renamed into place, so a connection storing the
+ * same chunk at the same time never exposes a partial one. Returns
+ * false on failure.
+ */
+static bool store_chunk(char *chunk_dir, cdc_chunk *c, uint8_t *data)
+{
+	char *tmp = concat_paths(chunk_dir, "incoming-XXXXXX");
+	int fd = mkstemp(tmp);
+	if (fd == -1) {
+		perror("mkstemp chunk");
+		free(tmp);
+		return false;
+	}
+
+	bool ok = write(fd, data, c->len) == (ssize_t)c->len;
+	ok = close(fd) == 0 && ok;
+
+	char *name = hash_name(CHUNK_ALGO, c->digest);
+	char *path = concat_paths(chunk_dir, name);
+	if (!ok || rename(tmp, path) == -1) {
+		perror("store chunk");
+		unlink(tmp);
+		ok = false;
+	}
+
+	free(path);
+	free(name);
+	free(tmp);
+	return ok;
+}
+
+bool chunkstore_store(char *chunk_dir, recipe *r, int stream_fd)
+{
+	uint8_t *buf = malloc(CDC_MAX_SIZE);
+	uint8_t **stored = malloc(r->n * sizeof(uint8_t *));
+	if (NULL == buf || (NULL == stored && r->n > 0))
+		mem_error();
+
+	uint32_t n_stored = 0;
+	off_t offset = 0;
+	bool ok = true;
+
+	for (uint32_t i = 0; i < r->n && ok; i++) {
+		if (!recipe_missing(r, i))
+			continue;
+
+		cdc_chunk *c = &r->chunks[i];
+		uint8_t digest[CHUNK_DIGEST_BYTES];
+		ok = pread(stream_fd, buf, c->len, offset) == (ssize_t)c->len;
+		offset += c->len;
+		if (!ok)
+			break;
+
+		gcry_md_hash_buffer(GCRY_MD_SHA256, digest, buf, c->len);
+		ok = memcmp(digest, c->digest, CHUNK_DIGEST_BYTES) == 0 &&
+		     store_chunk(chunk_dir, c, buf);
+		if (ok)
+			stored[n_stored++] = c->digest;
+	}
+
+	// Chunks stored before a failure are still valid
+	hashindex_add(chunk_dir, CHUNK_ALGO, stored, n_stored);
+
+	free(stored);
+	free(buf);
+	return ok;
+}
+
+bool chunkstore_assemble(char *chunk_dir, recipe *r, int out_fd,
+			 digest_ctx *md)
+{
+	uint8_t *buf = malloc(CDC_MAX_SIZE);
+	if (NULL == buf)
+		mem_error();
+
+	bool ok = true;
+	for (uint32_t i = 0; i < r->n && ok; i++) {
+		cdc_chunk *c = &r->chunks[i];
+		char *name = hash_name(CHUNK_ALGO, c->digest);
+		char *path = concat_paths(chunk_dir, name);
+
+		int fd = open(path, O_RDONLY);
+		ok = fd != -1 && read(fd, buf, c->len) == (ssize_t)c->len;
+		if (fd != -1)
+			close(fd);
+
+		if (ok) {
+			digest_write(md, buf, c->len);
+			ok = write(out_fd, buf, c->len) == (ssize_t)c->len;
+		} else {
+			fprintf(stderr, "chunk %s missing from the store\n", name);
+		}
+
+		free(path);
+		free(name);
+	}
+
+	free(buf);
+	return ok;
+}
@@ -0,0 +1,125 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to chunk level deduplication. Clients split files
+ *  at content defined boundaries, servers keep every chunk received in
+ *  a per-client chunk store.
+ */
+
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "digest.h"
+
+// Chunk sizes of the content defined chunker
+#define CDC_MIN_SIZE (1 << 14)
+#define CDC_AVG_SIZE (1 << 16)
+#define CDC_MAX_SIZE (1 << 18)
+
+#define CHUNK_ALGO HASH_SHA256 // Chunks are named by their SHA-256
+#define CHUNK_DIGEST_BYTES 32
+#define RECIPE_COUNT_BYTES 4
+#define RECIPE_LEN_BYTES 4
+#define RECIPE_ENTRY_SIZE (RECIPE_LEN_BYTES + CHUNK_DIGEST_BYTES)
+
+#define CHUNKS_DIR "chunks" // Chunk store inside a client's directory
+
+/*
+ * A content defined chunk of a file
+ */
+typedef struct {
+	uint64_t offset; // Offset of the chunk in the file
+	uint32_t len;
+	uint8_t digest[CHUNK_DIGEST_BYTES];
+} cdc_chunk;
+
+/*
+ * Every chunk of a file in order, and which of them the server is
+ * missing and has to be sent
+ */
+typedef struct {
+	cdc_chunk *chunks;
+	uint32_t n;
+	uint8_t *missing;     // Bitmap, the first chunk is the top bit
+	uint64_t missing_len; // Bytes in the chunks missing
+} recipe;
+
+/*
+ * Split the file at the given path into content defined chunks.
+ * Returns NULL when the file can't be read.
+ */
+recipe *recipe_build(char *path);
+
+/*
+ * Return the chunk count and the length and digest of every chunk of
+ * the recipe as sent to the server. The size of the payload is stored
+ * in len.
+ */
+uint8_t *recipe_payload(recipe *r, uint32_t *len);
+
+/*
+ * Return the chunk count at the start of a recipe payload
+ */
+uint32_t recipe_count(uint8_t *payload);
+
+/*
+ * Return the most chunks a recipe of a file of the given size can have
+ */
+uint64_t recipe_max_count(uint64_t file_size);
+
+/*
+ * Parse the given number of chunk entries, following the chunk count,
+ * of the recipe of a file of the given size. Returns NULL unless the
+ * chunks exactly cover the file.
+ */
+recipe *recipe_parse(uint8_t *entries, uint32_t count, uint64_t file_size);
+
+/*
+ * Return the number of bytes in the bitmap of missing chunks
+ */
+uint32_t recipe_bitmap_size(recipe *r);
+
+/*
+ * Returns true if the chunk at the given index is missing on the server
+ */
+bool recipe_missing(recipe *r, uint32_t i);
+
+/*
+ * Set the chunks missing on the server from the bitmap it answered with
+ */
+void recipe_set_missing(recipe *r, uint8_t *bitmap);
+
+/*
+ * Release the recipe
+ */
+void recipe_destroy(recipe *r);
+
+/*
+ * Mark the chunks of the recipe that aren't in the given chunk store.
+ * A chunk repeated in the recipe is only missing once, at its first
+ * occurrence.
+ */
+void chunkstore_find_missing(char *chunk_dir, recipe *r);
+
+/*
+ * Store the missing chunks of the recipe, read back to back from the
+ * given file descriptor. Returns false when a chunk doesn't match its
+ * digest.
+ */
+bool chunkstore_store(char *chunk_dir, recipe *r, int stream_fd);
+
+/*
+ * Write the file of the recipe to the given file descriptor from the
+ * chunk store, adding it to the given digest. Returns false when a
+ * chunk can't be read.
+ */
+bool chunkstore_assemble(char *chunk_dir, recipe *r, int out_fd,
+			 digest_ctx *md);
+
+#endif /* DEDUPE_H */
@@ -0,0 +1,366 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: File digests a transfer can be validated with, including a
+ *  tree hash built from independently hashed chunks
+ */
+
+#include <gcrypt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "digest.h"
+
+#define TREE_ALGO GCRY_MD_SHA256
+
+/*
+ * Name, stored file prefix and gcrypt algorithm of each hash algorithm.
+ * Tree hashes use SHA-256 for every level.
+ */
+static const struct {
+	char *name;
+	char *prefix;
+	int md;
+} algos[HASH_ALGOS] = {
+    [HASH_SHA1] = {"sha1", "", GCRY_MD_SHA1},
+    [HASH_SHA256] = {"sha256", "sha256-", GCRY_MD_SHA256},
+    [HASH_BLAKE2B] = {"blake2b", "blake2b-", GCRY_MD_BLAKE2B_256},
+    [HASH_TREE] = {"tree", "tree-", TREE_ALGO},
+};
+
+uint32_t hash_bytes(uint8_t algo)
+{
+	return gcry_md_get_algo_dlen(algos[algo].md);
+}
+
+int parse_hash_algo(char *name)
+{
+	for (int i = 0; i < HASH_ALGOS; i++) {
+		if (strcmp(name, algos[i].name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+char *hash_name(uint8_t algo, uint8_t *hash)
+{
+	char *hex = hash_to_hex(hash, hash_bytes(algo));
+	char *name = malloc(HASH_NAME_BYTES);
+	if (NULL == name)
+		mem_error();
+
+	snprintf(name, HASH_NAME_BYTES, "%s%s", algos[algo].prefix, hex);
+	free(hex);
+	return name;
+}
+
+/*
+ * Return the value of the upper case hex digit, -1 if it isn't one
+ */
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+bool parse_hash_name(char *name, uint8_t *algo, uint8_t *hash)
+{
+	// SHA-1 has no prefix, so it is tried last
+	for (int i = HASH_ALGOS - 1; i >= 0; i--) {
+		size_t prefix_len = strlen(algos[i].prefix);
+		uint32_t len = hash_bytes(i);
+		if (strncmp(name, algos[i].prefix, prefix_len) != 0 ||
+		    strlen(name) != prefix_len + 2 * len)
+			continue;
+
+		char *hex = name + prefix_len;
+		bool valid = true;
+		for (uint32_t b = 0; b < len && valid; b++) {
+			int hi = hex_digit(hex[2 * b]);
+			int lo = hex_digit(hex[2 * b + 1]);
+			valid = hi != -1 && lo != -1;
+			hash[b] = hi << 4 | lo;
+		}
+
+		if (valid) {
+			*algo = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void tree_leaf(uint8_t *chunk, uint32_t len, uint8_t *leaf)
+{
+	gcry_md_hash_buffer(TREE_ALGO, leaf, chunk, len);
+}
+
+void tree_leaves(uint8_t *data, uint32_t len, uint8_t *leaves)
+{
+	for (uint32_t done = 0; done < len; done += TREE_LEAF_SIZE) {
+		uint32_t n = len - done < TREE_LEAF_SIZE ? len - done
+							  : TREE_LEAF_SIZE;
+		tree_leaf(data + done, n, leaves);
+		leaves += hash_bytes(HASH_TREE);
+	}
+}
+
+void tree_node(uint8_t *leaves, uint32_t n_leaves, uint8_t *node)
+{
+	gcry_md_hash_buffer(TREE_ALGO, node, leaves,
+			    n_leaves * hash_bytes(HASH_TREE));
+}
+
+void tree_root(uint8_t *nodes, uint32_t n_nodes, uint64_t size,
+	       uint8_t *root)
+{
+	gcry_md_hd_t md;
+	gcry_error_t err = gcry_md_open(&md, TREE_ALGO, 0);
+	g_error(err);
+
+	// The size ends the root so files of different sizes never share it
+	uint8_t be_size[sizeof(uint64_t)];
+	for (int i = 0; i < 8; i++)
+		be_size[7 - i] = (size >> (8 * i)) & 0xFF;
+
+	gcry_md_write(md, nodes, n_nodes * hash_bytes(HASH_TREE));
+	gcry_md_write(md, be_size, sizeof(be_size));
+	memcpy(root, gcry_md_read(md, TREE_ALGO), hash_bytes(HASH_TREE));
+	gcry_md_close(md);
+}
+
+void digest_hmac(uint8_t *key, uint8_t *data, uint32_t len, uint8_t *mac)
+{
+	gcry_md_hd_t md;
+	gcry_error_t err = gcry_md_open(&md, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+	g_error(err);
+	err = gcry_md_setkey(md, key, KEY_SIZE);
+	g_error(err);
+
+	gcry_md_write(md, data, len);
+	memcpy(mac, gcry_md_read(md, GCRY_MD_SHA256), HMAC_BYTES);
+	gcry_md_close(md);
+}
+
+uint32_t tree_nodes(uint64_t size)
+{
+	uint64_t node_size = (uint64_t)TREE_FANOUT * TREE_LEAF_SIZE;
+	if (size == 0)
+		return 1;
+
+	return (size + node_size - 1) / node_size;
+}
+
+digest_ctx *digest_open(uint8_t algo)
+{
+	digest_ctx *d = calloc(1, sizeof(digest_ctx));
+	if (NULL == d)
+		mem_error();
+
+	d->algo = algo;
+	gcry_error_t err = gcry_md_open(&d->md, algos[algo].md, 0);
+	g_error(err);
+
+	if (algo == HASH_TREE) {
+		d->leaves = malloc(TREE_FANOUT * MAX_HASH_BYTES);
+		if (NULL == d->leaves)
+			mem_error();
+	}
+
+	return d;
+}
+
+/*
+ * Make room for at least the given number of nodes in the tree
+ */
+static void digest_reserve_nodes(digest_ctx *d, uint32_t n)
+{
+	if (n <= d->cap_nodes)
+		return;
+
+	while (d->cap_nodes < n)
+		d->cap_nodes = d->cap_nodes == 0 ? 16 : 2 * d->cap_nodes;
+
+	d->nodes = realloc(d->nodes, d->cap_nodes * hash_bytes(HASH_TREE));
+	if (NULL == d->nodes)
+		mem_error();
+}
+
+/*
+ * Hash the leaves of the current node and add it to the tree
+ */
+static void digest_flush_node(digest_ctx *d)
+{
+	uint32_t len = hash_bytes(HASH_TREE);
+
+	digest_reserve_nodes(d, d->n_nodes + 1);
+
+	tree_node(d->leaves, d->n_leaves, d->nodes + d->n_nodes * len);
+	d->n_nodes++;
+	d->n_leaves = 0;
+}
+
+void digest_add_leaf(digest_ctx *d, uint8_t *leaf, uint32_t len)
+{
+	uint32_t leaf_len = hash_bytes(HASH_TREE);
+
+	memcpy(d->leaves + d->n_leaves * leaf_len, leaf, leaf_len);
+	d->size += len;
+	if (++d->n_leaves == TREE_FANOUT)
+		digest_flush_node(d);
+}
+
+void digest_add_leaves(digest_ctx *d, uint8_t *leaves, uint32_t len)
+{
+	for (uint32_t done = 0; done < len; done += TREE_LEAF_SIZE) {
+		uint32_t n = len - done < TREE_LEAF_SIZE ? len - done
+							  : TREE_LEAF_SIZE;
+		digest_add_leaf(d, leaves, n);
+		leaves += hash_bytes(HASH_TREE);
+	}
+}
+
+void digest_write(digest_ctx *d, uint8_t *data, uint32_t len)
+{
+	if (d->algo != HASH_TREE) {
+		gcry_md_write(d->md, data, len);
+		d->size += len;
+		return;
+	}
+
+	uint8_t leaf[MAX_HASH_BYTES];
+	while (len > 0) {
+		// Whole leaves skip the incremental context
+		if (d->fill == 0 && len >= TREE_LEAF_SIZE) {
+			tree_leaf(data, TREE_LEAF_SIZE, leaf);
+			digest_add_leaf(d, leaf, TREE_LEAF_SIZE);
+			data += TREE_LEAF_SIZE;
+			len -= TREE_LEAF_SIZE;
+			continue;
+		}
+
+		uint32_t n = TREE_LEAF_SIZE - d->fill;
+		if (n > len)
+			n = len;
+
+		gcry_md_write(d->md, data, n);
+		d->fill += n;
+		data += n;
+		len -= n;
+
+		if (d->fill == TREE_LEAF_SIZE) {
+			d->fill = 0;
+			digest_add_leaf(d, gcry_md_read(d->md, TREE_ALGO),
+					TREE_LEAF_SIZE);
+			gcry_md_reset(d->md);
+		}
+	}
+}
+
+/*
+ * Fixed fields of a saved tree hash, followed by its nodes and then
+ * the leaves of the current node. Saved state stays on the host that
+ * wrote it, fields are in native byte order.
+ */
+typedef struct {
+	uint64_t size;
+	uint32_t n_nodes;
+	uint32_t n_leaves;
+} digest_state;
+
+uint8_t *digest_save(digest_ctx *d, uint32_t *len)
+{
+	*len = 0;
+	if (d->algo != HASH_TREE || d->fill != 0)
+		return NULL;
+
+	uint32_t hash_len = hash_bytes(HASH_TREE);
+	uint32_t nodes_len = d->n_nodes * hash_len;
+	*len = sizeof(digest_state) + nodes_len + d->n_leaves * hash_len;
+
+	uint8_t *state = malloc(*len);
+	if (NULL == state)
+		mem_error();
+
+	digest_state fixed = {d->size, d->n_nodes, d->n_leaves};
+	memcpy(state, &fixed, sizeof(fixed));
+	memcpy(state + sizeof(fixed), d->nodes, nodes_len);
+	memcpy(state + sizeof(fixed) + nodes_len, d->leaves,
+	       d->n_leaves * hash_len);
+	return state;
+}
+
+bool digest_restore(digest_ctx *d, uint8_t *state, uint32_t len)
+{
+	uint32_t hash_len = hash_bytes(HASH_TREE);
+	digest_state fixed;
+
+	if (d->algo != HASH_TREE || len < sizeof(fixed))
+		return false;
+
+	memcpy(&fixed, state, sizeof(fixed));
+	if (fixed.n_leaves >= TREE_FANOUT ||
+	    len != sizeof(fixed) +
+		       ((uint64_t)fixed.n_nodes + fixed.n_leaves) * hash_len)
+		return false;
+
+	digest_reset(d);
+	digest_reserve_nodes(d, fixed.n_nodes);
+	state += sizeof(fixed);
+	memcpy(d->nodes, state, fixed.n_nodes * hash_len);
+	memcpy(d->leaves, state + fixed.n_nodes * hash_len,
+	       fixed.n_leaves * hash_len);
+
+	d->n_nodes = fixed.n_nodes;
+	d->n_leaves = fixed.n_leaves;
+	d->size = fixed.size;
+	return true;
+}
+
+uint8_t *digest_final(digest_ctx *d)
+{
+	if (d->algo != HASH_TREE) {
+		memcpy(d->out, gcry_md_read(d->md, algos[d->algo].md),
+		       hash_bytes(d->algo));
+		return d->out;
+	}
+
+	// A partial last leaf is still a leaf of its own
+	if (d->fill > 0) {
+		digest_add_leaf(d, gcry_md_read(d->md, TREE_ALGO), d->fill);
+		d->fill = 0;
+	}
+
+	if (d->n_leaves > 0 || d->n_nodes == 0)
+		digest_flush_node(d);
+
+	tree_root(d->nodes, d->n_nodes, d->size, d->out);
+	return d->out;
+}
+
+void digest_reset(digest_ctx *d)
+{
+	gcry_md_reset(d->md);
+	d->size = 0;
+	d->fill = 0;
+	d->n_leaves = 0;
+	d->n_nodes = 0;
+}
+
+void digest_close(digest_ctx *d)
+{
+	gcry_md_close(d->md);
+	free(d->leaves);
+	free(d->nodes);
+	free(d);
+}
@@ -0,0 +1,168 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to the file digests a transfer can be validated
+ *  with, including a tree hash built from independently hashed chunks
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <gcrypt.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define HASH_SHA1 0    // SHA-1, the original header always uses this
+#define HASH_SHA256 1  // SHA-256 over the whole file
+#define HASH_BLAKE2B 2 // BLAKE2b-256 over the whole file
+#define HASH_TREE 3    // SHA-256 tree over the file's leaves
+#define HASH_ALGOS 4
+
+#define MAX_HASH_BYTES 32
+#define HMAC_BYTES 32 // HMAC-SHA256
+#define TREE_FANOUT 256 // Leaf digests hashed into each node of a tree
+
+// Bytes of a file hashed into each leaf of a tree, fixed whatever the
+// chunk size of a transfer so a file always has the same tree hash
+#define TREE_LEAF_SIZE (2 << 14)
+
+// Longest stored file name, the algorithm's prefix and the hash in hex
+#define HASH_NAME_BYTES (sizeof("blake2b-") + 2 * MAX_HASH_BYTES)
+
+/*
+ * A file's digest computed incrementally. Tree hashes keep the digests
+ * of the leaves of the current node and of every node so far.
+ */
+typedef struct {
+	uint8_t algo;
+	gcry_md_hd_t md; // Whole file, or the current leaf of a tree
+	uint64_t size;   // Bytes hashed
+
+	// Tree hashes only
+	uint32_t fill; // Bytes of the current leaf hashed
+	uint8_t *leaves;
+	uint32_t n_leaves;
+	uint8_t *nodes;
+	uint32_t n_nodes;
+	uint32_t cap_nodes;
+
+	uint8_t out[MAX_HASH_BYTES];
+} digest_ctx;
+
+/*
+ * Return the number of bytes in a digest of the given algorithm
+ */
+uint32_t hash_bytes(uint8_t algo);
+
+/*
+ * Return the hash algorithm with the given name, -1 if unknown
+ */
+int parse_hash_algo(char *name);
+
+/*
+ * Return the name a file with the given hash is stored under. SHA-1
+ * hashes are plain hex, as stored before other algorithms existed,
+ * the others are prefixed with the algorithm.
+ */
+char *hash_name(uint8_t algo, uint8_t *hash);
+
+/*
+ * Parse the name of a stored file into its hash algorithm and hash.
+ * Returns false when the name isn't one given by hash_name.
+ */
+bool parse_hash_name(char *name, uint8_t *algo, uint8_t *hash);
+
+/*
+ * Hash one leaf of a file, of up to TREE_LEAF_SIZE bytes, for a tree
+ * hash. Leaves can be hashed on any thread in any order.
+ */
+void tree_leaf(uint8_t *chunk, uint32_t len, uint8_t *leaf);
+
+/*
+ * Hash len bytes of a file starting at a leaf boundary into its
+ * consecutive leaves, only the last of which may be short
+ */
+void tree_leaves(uint8_t *data, uint32_t len, uint8_t *leaves);
+
+/*
+ * Hash the given leaves, up to TREE_FANOUT of them, into a node of a
+ * tree hash
+ */
+void tree_node(uint8_t *leaves, uint32_t n_leaves, uint8_t *node);
+
+/*
+ * Hash the given nodes of a file of the given size into the file's
+ * tree hash. Every file has at least one node, an empty file's node has
+ * no leaves.
+ */
+void tree_root(uint8_t *nodes, uint32_t n_nodes, uint64_t size,
+	       uint8_t *root);
+
+/*
+ * Write the HMAC-SHA256 of len bytes of data, keyed with the given
+ * client key, to mac
+ */
+void digest_hmac(uint8_t *key, uint8_t *data, uint32_t len, uint8_t *mac);
+
+/*
+ * Return the number of nodes in the tree hash of a file of the given
+ * size
+ */
+uint32_t tree_nodes(uint64_t size);
+
+/*
+ * Start a digest of the given algorithm
+ */
+digest_ctx *digest_open(uint8_t algo);
+
+/*
+ * Add the next len bytes of the file to the digest
+ */
+void digest_write(digest_ctx *d, uint8_t *data, uint32_t len);
+
+/*
+ * Add the next leaf of the file, of len bytes, to a tree hash by its
+ * digest. The digest must be at a leaf boundary.
+ */
+void digest_add_leaf(digest_ctx *d, uint8_t *leaf, uint32_t len);
+
+/*
+ * Add the next len bytes of the file to a tree hash by the leaves
+ * tree_leaves gave for them. The digest must be at a leaf boundary.
+ */
+void digest_add_leaves(digest_ctx *d, uint8_t *leaves, uint32_t len);
+
+/*
+ * Return the state of a tree hash at a leaf boundary, so another
+ * digest can carry on from the same point. The size of the state is
+ * stored in len. Returns NULL for the other algorithms, gcrypt can't
+ * export their state.
+ */
+uint8_t *digest_save(digest_ctx *d, uint32_t *len);
+
+/*
+ * Continue a fresh tree hash from a state given by digest_save.
+ * Returns false when the state is damaged.
+ */
+bool digest_restore(digest_ctx *d, uint8_t *state, uint32_t len);
+
+/*
+ * Finish the digest and return it, valid until the digest is reset
+ */
+uint8_t *digest_final(digest_ctx *d);
+
+/*
+ * Clear the digest for another file of the same algorithm
+ */
+void digest_reset(digest_ctx *d);
+
+/*
+ * Free the digest
+ */
+void digest_close(digest_ctx *d);
+
+#endif /* DIGEST_H */
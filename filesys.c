@@ -9,16 +9,21 @@
 #define _XOPEN_SOURCE // enable sys/stat macros
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "filesys.h"
+#include "uring.h"
 
 uint8_t *read_key(char *key_path)
 {
@@ -68,7 +73,7 @@ bool ensure_dir(char *path)
 	return true;
 }
 
-uint32_t filesize(char *path)
+uint64_t filesize(char *path)
 {
 	struct stat st;
 
@@ -88,3 +93,141 @@ char *concat_paths(char *s1, char *s2)
 	snprintf(path, PATH_MAX, "%s/%s", s1, s2);
 	return path;
 }
+
+out_file *out_open(int fd, uint64_t size)
+{
+	out_file *out = malloc(sizeof(out_file));
+	if (NULL == out)
+		mem_error();
+
+	out->fd = fd;
+	out->size = size;
+	out->map = NULL;
+	out->map_off = 0;
+	out->map_len = 0;
+	out->mappable = size > 0;
+
+	if (size == 0)
+		return out;
+
+	// Sparse files can still be mapped where allocation isn't supported.
+	// Any other failure, like a full disk, would fault a mapping.
+#ifdef __APPLE__
+	int err = EOPNOTSUPP;
+#else
+	int err = posix_fallocate(fd, 0, size);
+#endif
+	if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+		close(fd);
+		free(out);
+		errno = err;
+		return NULL;
+	}
+
+	if (err != 0 && ftruncate(fd, size) == -1)
+		out->mappable = false;
+
+	return out;
+}
+
+uint8_t *out_window(out_file *out, uint64_t offset, uint32_t len)
+{
+	if (!out->mappable || len == 0)
+		return NULL;
+
+	if (NULL != out->map && offset >= out->map_off &&
+	    offset + len <= out->map_off + out->map_len)
+		return out->map + (offset - out->map_off);
+
+	// Windows are aligned so chunks never straddle two of them
+	uint64_t start = offset - offset % OUT_WINDOW;
+	uint32_t map_len = OUT_WINDOW;
+	if (out->size - start < OUT_WINDOW)
+		map_len = out->size - start;
+
+	if (offset + len > start + map_len)
+		return NULL;
+
+	if (NULL != out->map)
+		munmap(out->map, out->map_len);
+
+	out->map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			out->fd, start);
+	if (out->map == MAP_FAILED) {
+		out->map = NULL;
+		out->mappable = false;
+		return NULL;
+	}
+
+	out->map_off = start;
+	out->map_len = map_len;
+	return out->map + (offset - start);
+}
+
+void out_write(out_file *out, uint64_t offset, uint8_t *data, uint32_t len)
+{
+	uint8_t *dst = out_window(out, offset, len);
+	if (NULL != dst) {
+		memcpy(dst, data, len);
+		return;
+	}
+
+	while (len > 0) {
+		ssize_t n = pwrite(out->fd, data, len, offset);
+		if (n == -1) {
+			perror("pwrite");
+			exit(EXIT_FAILURE);
+		}
+
+		data += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+/*
+ * Read from the offset into the buffer until it is full or the file
+ * ends, starting done bytes in. Returns the bytes of the buffer filled.
+ */
+static uint32_t read_full(int fd, struct iovec *buf, uint64_t offset,
+			  uint32_t done)
+{
+	while (done < buf->iov_len) {
+		ssize_t n = pread(fd, (uint8_t *)buf->iov_base + done,
+				  buf->iov_len - done, offset + done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+
+	return done;
+}
+
+bool read_batch(uring *u, int fd, struct iovec *bufs, uint64_t *offsets,
+		uint32_t *lens, int n)
+{
+	int32_t res[URING_BATCH];
+	for (int i = 0; NULL != u && i < n; i++)
+		uring_prep_read(u, fd, bufs[i].iov_base, bufs[i].iov_len,
+				offsets[i]);
+
+	if (NULL != u && uring_run(u, res) == -1)
+		return false;
+
+	// Reads cut short or failed in the ring are finished with pread
+	for (int i = 0; i < n; i++) {
+		uint32_t done = NULL != u && res[i] > 0 ? res[i] : 0;
+		lens[i] = read_full(fd, &bufs[i], offsets[i], done);
+	}
+
+	return true;
+}
+
+void out_close(out_file *out)
+{
+	if (NULL != out->map)
+		munmap(out->map, out->map_len);
+
+	close(out->fd);
+	free(out);
+}
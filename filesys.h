@@ -10,6 +10,10 @@
 #define FILESYS_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "uring.h"
 
 #define DEFAULT_KEY_PATH ".key"
 #define KEYS_DIR "keys"
@@ -17,8 +21,21 @@
 #define RECV_DIR "received"
 #define HASHES_DIR "hashes"
 #define FILES_DIR "files"
-#define CWD_KEYS "../../keys"
-#define CUR_DIR "./"
+
+#define OUT_WINDOW (1 << 22) // Bytes of an output file mapped at a time
+
+/*
+ * A file of known size written at any offset through memory mapped
+ * windows, or with pwrite where the file can't be mapped
+ */
+typedef struct {
+	int fd;
+	uint64_t size;
+	uint8_t *map; // Current window, NULL when none is mapped
+	uint64_t map_off;
+	uint32_t map_len;
+	bool mappable;
+} out_file;
 
 /*
  * Read a 256 bit key from a file at the specified path. Returns a key
@@ -38,11 +55,45 @@ bool ensure_dir(char *path);
  * Return the size of a file in bytes at the given path. Will return
  * 0 if the path isn't a valid file
  */
-uint32_t filesize(char *path);
+uint64_t filesize(char *path);
 
 /*
  * Concatenate two file paths. s2 is appended to s1
  */
 char *concat_paths(char *s1, char *s2);
 
+/*
+ * Take ownership of the open file descriptor for writing a file of the
+ * given size. The file's blocks are allocated up front so it is laid out
+ * in as few extents as possible. Returns NULL, closing the descriptor,
+ * when there is no room for them.
+ */
+out_file *out_open(int fd, uint64_t size);
+
+/*
+ * Return where len bytes at the given offset of the file can be written
+ * in memory, NULL when they don't fit in a window and out_write has to
+ * be used. The pointer is valid until the next call on the file.
+ */
+uint8_t *out_window(out_file *out, uint64_t offset, uint32_t len);
+
+/*
+ * Write len bytes of data at the given offset of the file
+ */
+void out_write(out_file *out, uint64_t offset, uint8_t *data, uint32_t len);
+
+/*
+ * Unmap and close the file
+ */
+void out_close(out_file *out);
+
+/*
+ * Fill n buffers, at most URING_BATCH, from the file, each from its own
+ * offset, submitted together through the ring, or one after the other
+ * when it is NULL. The bytes read into each are stored in lens, short
+ * where the file ends or can't be read. Returns false when interrupted.
+ */
+bool read_batch(uring *u, int fd, struct iovec *bufs, uint64_t *offsets,
+		uint32_t *lens, int n);
+
 #endif /* FILESYS_H */
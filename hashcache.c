@@ -0,0 +1,235 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Persistent cache of file hashes for the client, keyed by
+ *  device, inode, size and modification time
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "common.h"
+#include "digest.h"
+#include "hashcache.h"
+
+#define HASH_CACHE_MAGIC "EFTHASH2"
+#define HASH_CACHE_MAGIC_BYTES 8
+
+/*
+ * Start of the cache file, followed by count entries. The file is only
+ * meant for the host that wrote it, fields are in native byte order.
+ */
+typedef struct {
+	char magic[HASH_CACHE_MAGIC_BYTES];
+	uint32_t algo;
+	uint32_t hash_bytes;
+	uint32_t count;
+} cache_header;
+
+/*
+ * Return the modification time of the stat in nanoseconds
+ */
+static int64_t mtime_ns(struct stat *st)
+{
+#ifdef __APPLE__
+	struct timespec ts = st->st_mtimespec;
+#else
+	struct timespec ts = st->st_mtim;
+#endif
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Order entries by device, then inode
+ */
+static int compare_key(const void *a, const void *b)
+{
+	const hash_entry *x = a, *y = b;
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Order entries from most to least recently used
+ */
+static int compare_used(const void *a, const void *b)
+{
+	const hash_entry *x = a, *y = b;
+
+	if (x->used != y->used)
+		return x->used > y->used ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Return the entry for the file with the given stat, NULL if there is
+ * none, whether or not it is still valid
+ */
+static hash_entry *find_entry(hash_cache *hc, struct stat *st)
+{
+	hash_entry key = {.dev = st->st_dev, .ino = st->st_ino};
+
+	hash_entry *e =
+	    bsearch(&key, hc->entries, hc->n_sorted, sizeof(hash_entry),
+		    compare_key);
+	if (NULL != e)
+		return e;
+
+	for (uint32_t i = hc->n_sorted; i < hc->n; i++) {
+		if (compare_key(&key, &hc->entries[i]) == 0)
+			return &hc->entries[i];
+	}
+
+	return NULL;
+}
+
+hash_cache *hashcache_load(char *path, uint8_t algo)
+{
+	hash_cache *hc = calloc(1, sizeof(hash_cache));
+	if (NULL == hc)
+		mem_error();
+
+	hc->path = strdup(path);
+	if (NULL == hc->path)
+		mem_error();
+	hc->algo = algo;
+
+	FILE *fp = fopen(path, "r");
+	if (NULL == fp)
+		return hc;
+
+	cache_header h;
+	bool valid = fread(&h, sizeof(h), 1, fp) == 1 &&
+		     memcmp(h.magic, HASH_CACHE_MAGIC,
+			    HASH_CACHE_MAGIC_BYTES) == 0 &&
+		     h.algo == algo && h.hash_bytes == MAX_HASH_BYTES;
+
+	if (valid && h.count > 0) {
+		hc->entries = malloc(h.count * sizeof(hash_entry));
+		if (NULL == hc->entries)
+			mem_error();
+
+		if (fread(hc->entries, sizeof(hash_entry), h.count, fp) ==
+		    h.count) {
+			hc->n = hc->n_sorted = hc->cap = h.count;
+			qsort(hc->entries, hc->n, sizeof(hash_entry),
+			      compare_key);
+		}
+	}
+
+	fclose(fp);
+	return hc;
+}
+
+bool hashcache_lookup(hash_cache *hc, struct stat *st, uint8_t *hash)
+{
+	hash_entry *e = find_entry(hc, st);
+	if (NULL == e || e->size != (uint64_t)st->st_size ||
+	    e->mtime_ns != mtime_ns(st)) {
+		hc->misses++;
+		return false;
+	}
+
+	memcpy(hash, e->hash, hash_bytes(hc->algo));
+	e->used = time(NULL);
+	hc->dirty = true;
+	hc->hits++;
+	return true;
+}
+
+void hashcache_store(hash_cache *hc, struct stat *st, uint8_t *hash,
+		     time_t hashed_at)
+{
+	// A write in the same second as the read may keep the same mtime
+	if (st->st_mtime >= hashed_at - 1)
+		return;
+
+	hash_entry *e = find_entry(hc, st);
+	if (NULL == e) {
+		if (hc->n == hc->cap) {
+			hc->cap = hc->cap == 0 ? 64 : 2 * hc->cap;
+			hc->entries =
+			    realloc(hc->entries, hc->cap * sizeof(hash_entry));
+			if (NULL == hc->entries)
+				mem_error();
+		}
+
+		e = &hc->entries[hc->n++];
+		e->dev = st->st_dev;
+		e->ino = st->st_ino;
+	}
+
+	e->size = st->st_size;
+	e->mtime_ns = mtime_ns(st);
+	e->used = time(NULL);
+	memset(e->hash, 0, MAX_HASH_BYTES);
+	memcpy(e->hash, hash, hash_bytes(hc->algo));
+	hc->dirty = true;
+}
+
+void hashcache_clear(hash_cache *hc)
+{
+	hc->n = hc->n_sorted = 0;
+	hc->dirty = true;
+}
+
+void hashcache_save(hash_cache *hc)
+{
+	if (!hc->dirty)
+		return;
+
+	if (hc->n > HASH_CACHE_MAX_ENTRIES) {
+		qsort(hc->entries, hc->n, sizeof(hash_entry), compare_used);
+		hc->n = HASH_CACHE_MAX_ENTRIES;
+	}
+
+	qsort(hc->entries, hc->n, sizeof(hash_entry), compare_key);
+	hc->n_sorted = hc->n;
+
+	cache_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, HASH_CACHE_MAGIC, HASH_CACHE_MAGIC_BYTES);
+	h.algo = hc->algo;
+	h.hash_bytes = MAX_HASH_BYTES;
+	h.count = hc->n;
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", hc->path);
+
+	FILE *fp = fopen(tmp, "w");
+	if (NULL == fp) {
+		perror("hash cache");
+		return;
+	}
+
+	bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+		  fwrite(hc->entries, sizeof(hash_entry), hc->n, fp) == hc->n;
+	ok = fclose(fp) == 0 && ok;
+
+	if (!ok || rename(tmp, hc->path) == -1) {
+		perror("hash cache");
+		remove(tmp);
+		return;
+	}
+
+	hc->dirty = false;
+}
+
+void hashcache_destroy(hash_cache *hc)
+{
+	free(hc->path);
+	free(hc->entries);
+	free(hc);
+}
@@ -0,0 +1,91 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to the client's persistent cache of file hashes,
+ *  so unchanged files aren't read again before every transfer
+ */
+
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "digest.h"
+
+#define DEFAULT_HASH_CACHE ".hashcache"
+#define HASH_CACHE_MAX_ENTRIES 65536 // Least recently used entries are dropped
+
+/*
+ * The hash of a file as it was when hashed. The entry is valid while
+ * the file at the device and inode still has the same size and
+ * modification time.
+ */
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t used; // Last run the entry was looked up or stored
+	uint8_t hash[MAX_HASH_BYTES];
+} hash_entry;
+
+/*
+ * Every cached hash, sorted by device and inode up to n_sorted. Entries
+ * added since loading are searched linearly until the cache is saved.
+ */
+typedef struct {
+	char *path;
+	uint8_t algo; // Every hash in the cache uses the same algorithm
+	hash_entry *entries;
+	uint32_t n;
+	uint32_t n_sorted;
+	uint32_t cap;
+	bool dirty;
+	uint32_t hits;
+	uint32_t misses;
+} hash_cache;
+
+/*
+ * Load the cache of hashes of the given algorithm stored at the given
+ * path. A missing or unreadable cache, or one made with another hash
+ * algorithm, loads empty.
+ */
+hash_cache *hashcache_load(char *path, uint8_t algo);
+
+/*
+ * Copy the cached hash of the file with the given stat into hash.
+ * Returns false, counting a miss, when the file isn't cached or has
+ * changed since it was hashed.
+ */
+bool hashcache_lookup(hash_cache *hc, struct stat *st, uint8_t *hash);
+
+/*
+ * Remember the hash of the file with the given stat. The file was read
+ * starting at the given time; files modified that recently are not
+ * cached, a change within the same timestamp could go unnoticed.
+ */
+void hashcache_store(hash_cache *hc, struct stat *st, uint8_t *hash,
+		     time_t hashed_at);
+
+/*
+ * Forget every cached hash
+ */
+void hashcache_clear(hash_cache *hc);
+
+/*
+ * Write the cache back to its path if it changed. The file is replaced
+ * atomically so an interrupted save keeps the previous cache.
+ */
+void hashcache_save(hash_cache *hc);
+
+/*
+ * Free the cache
+ */
+void hashcache_destroy(hash_cache *hc);
+
+#endif /* HASHCACHE_H */
@@ -0,0 +1,393 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Persistent index of the files stored for a client, so
+ *  duplicates are found without reading the client's directory
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "digest.h"
+#include "filesys.h"
+#include "hashindex.h"
+
+#define INDEX_MAGIC "EFTIDX1"
+#define INDEX_MAGIC_BYTES 8
+#define BLOOM_HASHES 4
+
+/*
+ * Start of the index file. The index is only meant for the host that
+ * wrote it, fields are in native byte order.
+ */
+typedef struct {
+	char magic[INDEX_MAGIC_BYTES];
+	uint32_t slots;
+	uint32_t count;
+} index_header;
+
+/*
+ * Return the size of an index file with the given number of slots
+ */
+static size_t index_size(uint32_t slots)
+{
+	return sizeof(index_header) + slots + (size_t)slots * sizeof(index_slot);
+}
+
+/*
+ * Point the index at the header, filter and table in the given map.
+ * Returns false when the map doesn't hold a valid index.
+ */
+static bool index_layout(hash_index *idx, uint8_t *map, size_t len)
+{
+	index_header *h = (index_header *)map;
+
+	if (len < sizeof(index_header) ||
+	    memcmp(h->magic, INDEX_MAGIC, INDEX_MAGIC_BYTES) != 0 ||
+	    h->slots < INDEX_MIN_SLOTS || (h->slots & (h->slots - 1)) != 0 ||
+	    len != index_size(h->slots) || h->count >= h->slots)
+		return false;
+
+	idx->map = map;
+	idx->map_len = len;
+	idx->count = &h->count;
+	idx->slots = h->slots;
+	idx->bloom = map + sizeof(index_header);
+	idx->table = (index_slot *)(idx->bloom + h->slots);
+	return true;
+}
+
+/*
+ * Map the index at the given path, for writing when writable is set.
+ * Returns NULL when it is missing or damaged.
+ */
+static hash_index *index_map(char *path, bool writable)
+{
+	int fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(index_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+	uint8_t *map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hash_index *idx = malloc(sizeof(hash_index));
+	if (NULL == idx)
+		mem_error();
+
+	if (!index_layout(idx, map, st.st_size)) {
+		munmap(map, st.st_size);
+		free(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+/*
+ * Return the value of the 4 bytes of the hash at the given offset
+ */
+static uint32_t hash_word(uint8_t *hash, int offset)
+{
+	uint32_t word;
+	memcpy(&word, hash + offset, sizeof(word));
+	return word;
+}
+
+/*
+ * Return the i-th filter bit of the given hash. Hashes are uniformly
+ * distributed already, so their bytes are used as is.
+ */
+static uint32_t bloom_bit(hash_index *idx, uint8_t *hash, int i)
+{
+	uint32_t h1 = hash_word(hash, 8);
+	uint32_t h2 = hash_word(hash, 12) | 1;
+
+	return (h1 + i * h2) & (idx->slots * 8 - 1);
+}
+
+/*
+ * Return the slot holding the given hash, or the empty slot it would go
+ * in. The table is never more than half full.
+ */
+static index_slot *index_find(hash_index *idx, uint8_t algo, uint8_t *hash)
+{
+	uint32_t mask = idx->slots - 1;
+	uint32_t len = hash_bytes(algo);
+
+	for (uint32_t i = hash_word(hash, 0) & mask;; i = (i + 1) & mask) {
+		index_slot *s = &idx->table[i];
+		if (s->algo == 0 ||
+		    (s->algo == algo + 1 && memcmp(s->hash, hash, len) == 0))
+			return s;
+	}
+}
+
+/*
+ * Add the given hash to an index with room for it
+ */
+static void index_insert(hash_index *idx, uint8_t algo, uint8_t *hash)
+{
+	for (int i = 0; i < BLOOM_HASHES; i++) {
+		uint32_t bit = bloom_bit(idx, hash, i);
+		idx->bloom[bit / 8] |= 1 << (bit % 8);
+	}
+
+	index_slot *s = index_find(idx, algo, hash);
+	if (s->algo != 0)
+		return;
+
+	// Readers in other processes see the slot once the tag is set
+	memcpy(s->hash, hash, hash_bytes(algo));
+	s->algo = algo + 1;
+	(*idx->count)++;
+}
+
+bool hashindex_contains(hash_index *idx, uint8_t algo, uint8_t *hash)
+{
+	for (int i = 0; i < BLOOM_HASHES; i++) {
+		uint32_t bit = bloom_bit(idx, hash, i);
+		if (!(idx->bloom[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+
+	return index_find(idx, algo, hash)->algo != 0;
+}
+
+bool hashindex_stored(char *dir, hash_index *idx, uint8_t algo,
+		      uint8_t *hash)
+{
+	if (NULL != idx && !hashindex_contains(idx, algo, hash))
+		return false;
+
+	char *name = hash_name(algo, hash);
+	char *path = concat_paths(dir, name);
+	struct stat st;
+	bool stored = stat(path, &st) == 0;
+
+	free(path);
+	free(name);
+	return stored;
+}
+
+void hashindex_close(hash_index *idx)
+{
+	munmap(idx->map, idx->map_len);
+	free(idx);
+}
+
+/*
+ * Take the lock every process changing the index of the given client
+ * directory holds. Returns the descriptor to close to release it, -1
+ * on failure.
+ */
+static int index_lock(char *client_dir)
+{
+	char *path = concat_paths(client_dir, INDEX_LOCK_NAME);
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	free(path);
+	if (fd == -1) {
+		perror("open index lock");
+		return -1;
+	}
+
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	if (fcntl(fd, F_SETLKW, &lock) == -1) {
+		perror("lock index");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Replace the index of the given client directory with one holding
+ * the given entries, sized so it is at most a quarter full. The new
+ * index is written aside and renamed over the old one, so readers
+ * always map a whole index. Returns false on failure.
+ */
+static bool index_write(char *client_dir, index_slot *entries, uint32_t n)
+{
+	uint32_t slots = INDEX_MIN_SLOTS;
+	while (slots / 4 < n)
+		slots *= 2;
+
+	size_t len = index_size(slots);
+	uint8_t *map = calloc(len, 1);
+	if (NULL == map)
+		mem_error();
+
+	index_header *h = (index_header *)map;
+	memcpy(h->magic, INDEX_MAGIC, INDEX_MAGIC_BYTES);
+	h->slots = slots;
+
+	hash_index idx;
+	index_layout(&idx, map, len);
+	for (uint32_t i = 0; i < n; i++)
+		index_insert(&idx, entries[i].algo - 1, entries[i].hash);
+
+	char *path = concat_paths(client_dir, INDEX_NAME);
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	bool ok = false;
+	FILE *fp = fopen(tmp, "w");
+	if (NULL != fp) {
+		ok = fwrite(map, len, 1, fp) == 1;
+		ok = fclose(fp) == 0 && ok;
+		ok = ok && rename(tmp, path) == 0;
+	}
+
+	if (!ok) {
+		perror("write index");
+		remove(tmp);
+	}
+
+	free(path);
+	free(map);
+	return ok;
+}
+
+/*
+ * Append an entry for the given hash to the growing array of entries
+ */
+static void append_entry(index_slot **entries, uint32_t *n, uint32_t *cap,
+			 uint8_t algo, uint8_t *hash)
+{
+	if (*n == *cap) {
+		*cap = *cap == 0 ? 64 : 2 * *cap;
+		*entries = realloc(*entries, *cap * sizeof(index_slot));
+		if (NULL == *entries)
+			mem_error();
+	}
+
+	index_slot *e = &(*entries)[(*n)++];
+	memset(e, 0, sizeof(index_slot));
+	e->algo = algo + 1;
+	memcpy(e->hash, hash, hash_bytes(algo));
+}
+
+/*
+ * Build the index of the given client directory from the files stored
+ * in it. Returns false on failure.
+ */
+static bool index_rebuild(char *client_dir)
+{
+	DIR *d = opendir(client_dir);
+	if (NULL == d)
+		return false;
+
+	index_slot *entries = NULL;
+	uint32_t n = 0, cap = 0;
+	uint8_t algo, hash[MAX_HASH_BYTES];
+
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		if (parse_hash_name(entry->d_name, &algo, hash))
+			append_entry(&entries, &n, &cap, algo, hash);
+	}
+	closedir(d);
+
+	bool ok = index_write(client_dir, entries, n);
+	free(entries);
+	return ok;
+}
+
+/*
+ * Build a larger index holding every entry of the given index and the
+ * given hash. Returns false on failure.
+ */
+static bool index_grow(char *client_dir, hash_index *idx, uint8_t algo,
+		       uint8_t *hash)
+{
+	index_slot *entries = NULL;
+	uint32_t n = 0, cap = 0;
+
+	for (uint32_t i = 0; i < idx->slots; i++) {
+		index_slot *s = &idx->table[i];
+		if (s->algo != 0)
+			append_entry(&entries, &n, &cap, s->algo - 1, s->hash);
+	}
+	append_entry(&entries, &n, &cap, algo, hash);
+
+	bool ok = index_write(client_dir, entries, n);
+	free(entries);
+	return ok;
+}
+
+hash_index *hashindex_open(char *client_dir)
+{
+	char *path = concat_paths(client_dir, INDEX_NAME);
+	hash_index *idx = index_map(path, false);
+
+	if (NULL == idx) {
+		int lock = index_lock(client_dir);
+		if (lock != -1) {
+			// Another process may have built it meanwhile
+			idx = index_map(path, false);
+			if (NULL == idx && index_rebuild(client_dir))
+				idx = index_map(path, false);
+			close(lock);
+		}
+	}
+
+	free(path);
+	return idx;
+}
+
+void hashindex_add(char *client_dir, uint8_t algo, uint8_t **hashes,
+		   uint32_t n)
+{
+	int lock = index_lock(client_dir);
+	if (lock == -1)
+		return;
+
+	// A rebuilt index already has the files, they are in the directory
+	char *path = concat_paths(client_dir, INDEX_NAME);
+	hash_index *idx = index_map(path, true);
+	if (NULL == idx)
+		index_rebuild(client_dir);
+
+	for (uint32_t i = 0; i < n && NULL != idx; i++) {
+		if (hashindex_contains(idx, algo, hashes[i]))
+			continue;
+
+		if (2 * (*idx->count + 1) <= idx->slots) {
+			index_insert(idx, algo, hashes[i]);
+			continue;
+		}
+
+		index_grow(client_dir, idx, algo, hashes[i]);
+		hashindex_close(idx);
+		idx = index_map(path, true);
+	}
+
+	if (NULL != idx)
+		hashindex_close(idx);
+	free(path);
+	close(lock); // Releases the lock
+}
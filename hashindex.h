@@ -0,0 +1,81 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to the server's persistent index of the files
+ *  stored for a client, so duplicates are found without reading the
+ *  client's directory
+ */
+
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "digest.h"
+
+#define INDEX_NAME ".index"
+#define INDEX_LOCK_NAME ".index.lock"
+#define INDEX_MIN_SLOTS 1024
+
+/*
+ * One slot of the index's open addressing table
+ */
+typedef struct {
+	uint8_t algo; // Hash algorithm + 1, 0 while the slot is empty
+	uint8_t hash[MAX_HASH_BYTES];
+} index_slot;
+
+/*
+ * A client's index mapped into memory. The file is a small header, a
+ * Bloom filter with a byte per slot, then the table of slots. Slots are
+ * found by the hash's leading bytes, the filter uses the bytes after.
+ */
+typedef struct {
+	uint8_t *map;
+	size_t map_len;
+	uint32_t *count;
+	uint32_t slots; // Always a power of two
+	uint8_t *bloom;
+	index_slot *table;
+} hash_index;
+
+/*
+ * Map the index of the given client directory for lookups. The index
+ * is built from the directory when it is missing or damaged. Returns
+ * NULL when there is no usable index.
+ */
+hash_index *hashindex_open(char *client_dir);
+
+/*
+ * Returns true if the index holds the given hash of the given
+ * algorithm. The file may still have been removed since it was added.
+ */
+bool hashindex_contains(hash_index *idx, uint8_t algo, uint8_t *hash);
+
+/*
+ * Returns true if a file with the given hash of the given algorithm is
+ * stored in the given directory. The directory's index, which may be
+ * NULL, rules out files that were never stored. Files it has are
+ * confirmed on disk, they may have been removed since.
+ */
+bool hashindex_stored(char *dir, hash_index *idx, uint8_t algo,
+		      uint8_t *hash);
+
+/*
+ * Unmap the index
+ */
+void hashindex_close(hash_index *idx);
+
+/*
+ * Add the given number of files just stored in the given client
+ * directory, with the given hashes, to its index. Other processes may
+ * add to the same index at the same time.
+ */
+void hashindex_add(char *client_dir, uint8_t algo, uint8_t **hashes,
+		   uint32_t n);
+
+#endif /* HASHINDEX_H */
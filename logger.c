@@ -0,0 +1,392 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: The server's asynchronous logger. Each process queues its
+ *  formatted lines on a bounded ring that any of its threads adds to
+ *  without locking, and a thread of its own writes them out in batches.
+ *  A full ring or a line over the rate drops the line instead of
+ *  waiting.
+ */
+
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "logger.h"
+
+#define LOG_SLOTS 1024	     // Lines queued at most, a power of two
+#define LOG_LINE_BYTES 512   // Longest line written, longer are cut
+#define LOG_TEXT_BYTES 384   // Longest message, leaving room for JSON
+#define LOG_BATCH_BYTES 65536 // Written to a stream at once
+#define LOG_IDLE_MS 100	     // Longest wait for lines when there are none
+
+/*
+ * A queued line. The slot is free for the line of position seq, and
+ * holds it once seq is one past it.
+ */
+typedef struct {
+	uint64_t seq;
+	int level;
+	uint32_t len;
+	char line[LOG_LINE_BYTES];
+} log_slot;
+
+/*
+ * Lines of a stream gathered to be written at once
+ */
+typedef struct {
+	int fd;
+	uint32_t len;
+	char data[LOG_BATCH_BYTES];
+} log_batch;
+
+static const char *level_names[LEVELS] = {"debug", "info", "warn", "error"};
+
+static int min_level = LEVEL_INFO;
+static bool json_lines;
+static uint32_t max_rate; // Lines a second, 0 for any number
+
+static log_slot *slots;
+static uint64_t head; // Position the next line is queued at
+static uint64_t tail; // Position the writer reads next
+static uint64_t dropped;
+static uint64_t rate_second; // Second the lines in rate_count are from
+static uint32_t rate_count;
+static bool running; // The writer of this process is running
+static bool stopping;
+static bool registered;
+static pthread_t writer;
+static log_batch batches[2]; // stdout and stderr, used by the writer
+
+void log_init(int level, bool json, uint32_t rate)
+{
+	min_level = level;
+	json_lines = json;
+	max_rate = rate;
+}
+
+int log_level(char *name)
+{
+	for (int i = 0; i < LEVELS; i++)
+		if (strcmp(name, level_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Returns true if another line fits in this second's rate. The count
+ * restarts with each second.
+ */
+static bool within_rate(void)
+{
+	if (max_rate == 0)
+		return true;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t second = ts.tv_sec;
+	uint64_t seen = __atomic_load_n(&rate_second, __ATOMIC_RELAXED);
+	if (seen != second &&
+	    __atomic_compare_exchange_n(&rate_second, &seen, second, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&rate_count, 0, __ATOMIC_RELAXED);
+
+	return __atomic_fetch_add(&rate_count, 1, __ATOMIC_RELAXED) < max_rate;
+}
+
+/*
+ * Copy text into a JSON string of at most room bytes, quotes excluded.
+ * Returns the bytes used, escapes that don't fit are left out whole.
+ */
+static uint32_t json_escape(char *out, uint32_t room, const char *text)
+{
+	uint32_t len = 0;
+	for (; *text != '\0'; text++) {
+		char esc[8];
+		uint8_t c = (uint8_t)*text;
+		int n = 1;
+		esc[0] = c;
+
+		if (c == '"' || c == '\\')
+			n = snprintf(esc, sizeof(esc), "\\%c", c);
+		else if (c == '\n')
+			n = snprintf(esc, sizeof(esc), "\\n");
+		else if (c < 0x20)
+			n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+
+		if (len + n > room)
+			break;
+		memcpy(out + len, esc, n);
+		len += n;
+	}
+
+	return len;
+}
+
+/*
+ * Format a line of the given level with the given message into out,
+ * which holds LOG_LINE_BYTES. Returns the length of the line.
+ */
+static uint32_t format_line(char *out, int level, const char *text)
+{
+	if (!json_lines) {
+		uint32_t len = strlen(text);
+		memcpy(out, text, len);
+		out[len] = '\n';
+		return len + 1;
+	}
+
+	struct timespec ts;
+	struct tm tm;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	uint32_t len = snprintf(
+	    out, LOG_LINE_BYTES,
+	    "{\"time\":\"%s.%03ldZ\",\"level\":\"%s\",\"pid\":%ld,\"msg\":\"",
+	    stamp, ts.tv_nsec / 1000000, level_names[level], (long)getpid());
+	len += json_escape(out + len, LOG_LINE_BYTES - len - 3, text);
+	memcpy(out + len, "\"}\n", 3);
+	return len + 3;
+}
+
+/*
+ * Write len bytes to the given stream. Lines that can't be written are
+ * lost, there is nowhere to report it.
+ */
+static void write_out(int fd, char *data, uint32_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Return the stream lines of the given level are written to
+ */
+static int level_fd(int level)
+{
+	return level >= LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+/*
+ * Write a batch's lines and empty it
+ */
+static void flush_batch(log_batch *b)
+{
+	write_out(b->fd, b->data, b->len);
+	b->len = 0;
+}
+
+/*
+ * Queue a formatted line on the ring. Returns false when the ring is
+ * full.
+ */
+static bool queue_line(int level, char *line, uint32_t len)
+{
+	uint64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	log_slot *s;
+
+	for (;;) {
+		s = &slots[pos & (LOG_SLOTS - 1)];
+		uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			// Claim it, pos is reloaded when another thread did
+			if (__atomic_compare_exchange_n(&head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos) {
+			return false; // Not written yet since the last lap
+		} else {
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+
+	s->level = level;
+	s->len = len;
+	memcpy(s->line, line, len);
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * Write every line queued so far, then a count of the lines dropped
+ * since the last time. Returns the number of lines written.
+ */
+static uint32_t drain(void)
+{
+	uint32_t lines = 0;
+
+	for (;; tail++, lines++) {
+		log_slot *s = &slots[tail & (LOG_SLOTS - 1)];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+
+		log_batch *b = &batches[level_fd(s->level) == STDERR_FILENO];
+		if (b->len + s->len > LOG_BATCH_BYTES)
+			flush_batch(b);
+		memcpy(b->data + b->len, s->line, s->len);
+		b->len += s->len;
+
+		// Free the slot for the next lap
+		__atomic_store_n(&s->seq, tail + LOG_SLOTS, __ATOMIC_RELEASE);
+	}
+
+	flush_batch(&batches[0]);
+	flush_batch(&batches[1]);
+
+	uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if (lost > 0) {
+		char text[LOG_TEXT_BYTES];
+		char line[LOG_LINE_BYTES];
+		snprintf(text, sizeof(text), "Logger dropped %llu lines",
+			 (unsigned long long)lost);
+		uint32_t len = format_line(line, LEVEL_WARN, text);
+		write_out(level_fd(LEVEL_WARN), line, len);
+	}
+
+	return lines;
+}
+
+/*
+ * Write queued lines until stopped, waiting longer each time there are
+ * none, up to LOG_IDLE_MS
+ */
+static void *write_lines(void *arg)
+{
+	(void)arg;
+	long wait_ms = 1;
+
+	for (;;) {
+		// Lines queued before stopping are still written
+		bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		if (drain() > 0) {
+			wait_ms = 1;
+			continue;
+		}
+		if (stop)
+			break;
+
+		struct timespec ts = {0, wait_ms * 1000000};
+		nanosleep(&ts, NULL);
+		wait_ms = wait_ms * 2 < LOG_IDLE_MS ? wait_ms * 2 : LOG_IDLE_MS;
+	}
+
+	return NULL;
+}
+
+/*
+ * A forked child has no writer until it starts its own
+ */
+static void forget_writer(void) { running = false; }
+
+void log_start(void)
+{
+	if (NULL == slots) {
+		slots = malloc(sizeof(log_slot) * LOG_SLOTS);
+		if (NULL == slots)
+			mem_error();
+	}
+
+	// Lines left by the parent are its writer's to write
+	for (uint64_t i = 0; i < LOG_SLOTS; i++)
+		slots[i].seq = i;
+	head = 0;
+	tail = 0;
+	dropped = 0;
+	stopping = false;
+	batches[0].fd = STDOUT_FILENO;
+	batches[0].len = 0;
+	batches[1].fd = STDERR_FILENO;
+	batches[1].len = 0;
+
+	if (!registered) {
+		atexit(log_stop);
+		pthread_atfork(NULL, NULL, forget_writer);
+		registered = true;
+	}
+
+	// Signals are left to the threads serving clients
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	int err = pthread_create(&writer, NULL, write_lines, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+}
+
+void log_msg(int level, const char *fmt, ...)
+{
+	if (level < min_level)
+		return;
+
+	if (!within_rate()) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	char text[LOG_TEXT_BYTES];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+
+	char line[LOG_LINE_BYTES];
+	uint32_t len = format_line(line, level, text);
+
+	// Without a writer the line is written straight away
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		write_out(level_fd(level), line, len);
+		return;
+	}
+
+	if (!queue_line(level, line, len))
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+}
+
+void log_stop(void)
+{
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+
+	// Lines queued while the writer was stopping
+	drain();
+}
@@ -0,0 +1,57 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to the server's asynchronous logger. Lines are
+ *  queued on a lock-free ring of the process and written by a thread of
+ *  its own, so logging never waits on a slow stdout.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Levels of a line, lines under the level set are skipped
+#define LEVEL_DEBUG 0
+#define LEVEL_INFO 1
+#define LEVEL_WARN 2 // A client sent something wrong
+#define LEVEL_ERROR 3
+#define LEVELS 4
+
+/*
+ * Set what every process logs: lines of the given level and up, as
+ * JSON objects when json is set, at most rate lines a second, 0 for
+ * any number. Info and debug lines go to stdout, the rest to stderr.
+ */
+void log_init(int level, bool json, uint32_t rate);
+
+/*
+ * Return the level with the given name, -1 when there is none
+ */
+int log_level(char *name);
+
+/*
+ * Start this process' ring and the thread writing it. Called once by
+ * every process that logs, lines queued by the process it was forked
+ * from are dropped. What is queued is written before the process exits.
+ */
+void log_start(void);
+
+/*
+ * Queue a line of the given level, formatted like printf without the
+ * newline. Lines that don't fit the ring or go over the rate are
+ * dropped and counted, the count is logged later.
+ */
+void log_msg(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Write everything queued and stop the writing thread. Lines logged
+ * afterwards are written straight away.
+ */
+void log_stop(void);
+
+#endif /* LOGGER_H */
@@ -0,0 +1,304 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: The receiver's live metrics. Counters live in a shared
+ *  mapping made before any process serving clients is forked, so every
+ *  one adds to the same counters, and a process of their own answers
+ *  each connection to a Unix domain socket with them in the Prometheus
+ *  text format.
+ */
+
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "net.h"
+#include "stats.h"
+
+#define REQUEST_WAIT_MS 100 // For an HTTP request before answering without
+#define REQUEST_BYTES 512
+
+// Upper bounds of the latency histogram buckets, from 10us to 10s
+#define BUCKETS 7
+static const uint64_t bucket_ns[BUCKETS] = {
+    10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000};
+static const char *bucket_le[BUCKETS] = {"1e-05", "0.0001", "0.001", "0.01",
+					 "0.1",	  "1",	    "10"};
+
+/*
+ * Counters shared by every process. Stage buckets aren't cumulative,
+ * the last counts what is over every bound.
+ */
+typedef struct {
+	uint64_t counters[METRICS];
+	uint64_t buckets[STAT_STAGES][BUCKETS + 1];
+	uint64_t ns[STAT_STAGES];
+} shared_metrics;
+
+static shared_metrics *shared; // NULL unless the counters are kept
+static pid_t owner;	       // Process that made them
+static pid_t exporter;	       // Process answering on the socket
+static char *socket_path;
+static int64_t active; // Connections this process counted as open
+
+/*
+ * Return the value of a shared counter
+ */
+static uint64_t load(uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write a counter or gauge with its help and type lines
+ */
+static void write_metric(FILE *out, const char *name, const char *type,
+			 const char *help, uint64_t value)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name,
+		type, name, (unsigned long long)value);
+}
+
+/*
+ * Write the latency histogram of each stage of receiving a chunk
+ */
+static void write_histograms(FILE *out)
+{
+	const char *name = "rxer_stage_duration_seconds";
+	fprintf(out,
+		"# HELP %s Time taken by each stage of receiving a chunk\n"
+		"# TYPE %s histogram\n",
+		name, name);
+
+	for (int i = STAT_RECV; i < STAT_STAGES; i++) {
+		const char *stage = stats_stage_name(i);
+		uint64_t count = 0;
+		for (int b = 0; b < BUCKETS; b++) {
+			count += load(&shared->buckets[i][b]);
+			fprintf(out, "%s_bucket{stage=\"%s\",le=\"%s\"} %llu\n",
+				name, stage, bucket_le[b],
+				(unsigned long long)count);
+		}
+
+		count += load(&shared->buckets[i][BUCKETS]);
+		fprintf(out, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", name,
+			stage, (unsigned long long)count);
+		fprintf(out, "%s_sum{stage=\"%s\"} %.9f\n", name, stage,
+			load(&shared->ns[i]) / 1e9);
+		fprintf(out, "%s_count{stage=\"%s\"} %llu\n", name, stage,
+			(unsigned long long)count);
+	}
+}
+
+/*
+ * Write every counter in the Prometheus text format
+ */
+static void write_metrics(FILE *out)
+{
+	uint64_t *c = shared->counters;
+	write_metric(out, "rxer_active_connections", "gauge",
+		     "Client connections open", load(&c[METRIC_ACTIVE]));
+
+	fprintf(out, "# HELP rxer_manifests_total Transfer headers by whether "
+		     "any file was accepted\n"
+		     "# TYPE rxer_manifests_total counter\n");
+	fprintf(out, "rxer_manifests_total{result=\"accepted\"} %llu\n",
+		(unsigned long long)load(&c[METRIC_ACCEPTED]));
+	fprintf(out, "rxer_manifests_total{result=\"rejected\"} %llu\n",
+		(unsigned long long)load(&c[METRIC_REJECTED]));
+
+	write_metric(out, "rxer_received_bytes_total", "counter",
+		     "Bytes of chunk frames received",
+		     load(&c[METRIC_RECEIVED]));
+	write_metric(out, "rxer_files_committed_total", "counter",
+		     "Files stored after passing their integrity check",
+		     load(&c[METRIC_COMMITTED]));
+	write_metric(out, "rxer_integrity_failures_total", "counter",
+		     "Chunks or files failing authentication or their hash",
+		     load(&c[METRIC_INTEGRITY]));
+	write_metric(out, "rxer_duplicate_hits_total", "counter",
+		     "Files of a header already stored by their client",
+		     load(&c[METRIC_DUPLICATES]));
+	write_histograms(out);
+}
+
+/*
+ * Answer a connection to the socket with the counters. Clients sending
+ * an HTTP request within REQUEST_WAIT_MS get an HTTP response, any
+ * other gets just the counters.
+ */
+static void answer(int cfd)
+{
+	char request[REQUEST_BYTES];
+	ssize_t got = 0;
+	struct pollfd pfd = {.fd = cfd, .events = POLLIN};
+	if (poll(&pfd, 1, REQUEST_WAIT_MS) == 1)
+		got = recv(cfd, request, sizeof(request), MSG_DONTWAIT);
+
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *out = open_memstream(&body, &body_len);
+	if (NULL == out)
+		mem_error();
+	write_metrics(out);
+	fclose(out);
+
+	if (got >= 4 && memcmp(request, "GET ", 4) == 0) {
+		char head[128];
+		int len = snprintf(head, sizeof(head),
+				   "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+				   "version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+				   body_len);
+		write_all(cfd, (uint8_t *)head, len);
+	}
+
+	write_all(cfd, (uint8_t *)body, body_len);
+	free(body);
+}
+
+/*
+ * Close the connections this process still counts as open when it
+ * exits, such as a child serving a client that exits part way through
+ */
+static void release_active(void)
+{
+	int64_t open = __atomic_load_n(&active, __ATOMIC_RELAXED);
+	metrics_add(METRIC_ACTIVE, -open);
+}
+
+/*
+ * Answer connections to the listening socket until interrupted
+ */
+static void export_metrics(int sfd)
+{
+	while (!TERMINATED) {
+		int cfd = accept(sfd, NULL, NULL);
+		if (cfd == -1) {
+			if (errno == EINTR)
+				break;
+			perror("accept metrics");
+			continue;
+		}
+
+		answer(cfd);
+		close(cfd);
+	}
+
+	close(sfd);
+}
+
+void metrics_init(char *path)
+{
+	shared = mmap(NULL, sizeof(shared_metrics), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap metrics");
+		exit(EXIT_FAILURE);
+	}
+	owner = getpid();
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Metrics socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd == -1) {
+		perror("socket metrics");
+		exit(EXIT_FAILURE);
+	}
+
+	// Only a socket left by an earlier run is replaced
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "Metrics socket path isn't a socket: %s\n",
+				path);
+			exit(EXIT_FAILURE);
+		}
+		unlink(path);
+	}
+
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(sfd, SOMAXCONN) == -1) {
+		perror("bind metrics");
+		exit(EXIT_FAILURE);
+	}
+
+	exporter = fork();
+	if (exporter == -1) {
+		perror("fork error");
+		exit(EXIT_FAILURE);
+	}
+
+	if (exporter == 0) {
+		export_metrics(sfd);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(sfd);
+	atexit(release_active);
+	socket_path = path;
+	stats_observe(metrics_observe);
+}
+
+bool metrics_enabled(void) { return NULL != shared; }
+
+void metrics_add(int metric, int64_t n)
+{
+	if (NULL == shared)
+		return;
+
+	if (metric == METRIC_ACTIVE)
+		__atomic_fetch_add(&active, n, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shared->counters[metric], (uint64_t)n,
+			   __ATOMIC_RELAXED);
+}
+
+void metrics_observe(int stage, uint64_t bytes, uint64_t ns)
+{
+	if (NULL == shared)
+		return;
+
+	int b = 0;
+	while (b < BUCKETS && ns > bucket_ns[b])
+		b++;
+
+	__atomic_fetch_add(&shared->buckets[stage][b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shared->ns[stage], ns, __ATOMIC_RELAXED);
+	if (stage == STAT_RECV)
+		metrics_add(METRIC_RECEIVED, bytes);
+}
+
+void metrics_stop(void)
+{
+	if (NULL == shared || getpid() != owner)
+		return;
+
+	kill(exporter, SIGINT);
+	unlink(socket_path);
+}
@@ -0,0 +1,60 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to the receiver's live metrics, counted by every
+ *  process serving clients and read in the Prometheus text format from
+ *  a Unix domain socket
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counters kept for the whole receiver
+#define METRIC_ACTIVE 0	     // Connections open right now
+#define METRIC_ACCEPTED 1    // Headers with files to send
+#define METRIC_REJECTED 2    // Headers refused, nothing is received
+#define METRIC_RECEIVED 3    // Bytes of chunk frames received
+#define METRIC_COMMITTED 4   // Files checked and stored
+#define METRIC_INTEGRITY 5   // Chunks or files failing their check
+#define METRIC_DUPLICATES 6  // Files of a header already stored
+#define METRICS 7
+
+/*
+ * Share the counters with every process forked from here on and start
+ * a process answering each connection to a Unix domain socket at the
+ * given path with them. A socket already at the path is replaced, the
+ * receiver exits when anything else is there.
+ */
+void metrics_init(char *path);
+
+/*
+ * Returns true if the counters are kept
+ */
+bool metrics_enabled(void);
+
+/*
+ * Add n, which may be negative, to the given counter. Does nothing
+ * unless the counters are kept. Connections a process leaves open are
+ * taken off METRIC_ACTIVE when it exits.
+ */
+void metrics_add(int metric, int64_t n);
+
+/*
+ * Count the given number of bytes handled by a stage of receiving a
+ * chunk, and the ns it took in the stage's latency histogram. The
+ * signature is a stats_observer's.
+ */
+void metrics_observe(int stage, uint64_t bytes, uint64_t ns);
+
+/*
+ * Stop the process answering on the socket and remove the socket. Does
+ * nothing in processes forked after metrics_init.
+ */
+void metrics_stop(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,539 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Microbenchmarks of the transfer header path and of the raw
+ *  cipher and digest calls every chunk goes through, to catch
+ *  regressions in them between builds
+ */
+
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <gcrypt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "datalist.h"
+#include "digest.h"
+#include "hashindex.h"
+#include "parser.h"
+
+#define DEFAULT_FILES UINT16_MAX // Most files the original header holds
+#define DEFAULT_REPS 15
+#define DEFAULT_WARMUP 3
+#define STORED_EVERY 16	  // One header file in this many is stored already
+#define CRYPTO_BYTES (4 << 20) // Bytes encrypted or hashed per repetition
+
+static const uint32_t chunk_sizes[] = {MIN_CHUNK_SIZE, DEFAULT_CHUNK_SIZE,
+				       1 << 18, 1 << 20, MAX_CHUNK_SIZE};
+
+static const char *suite_names[] = {"cbc", "ctr", "gcm"};
+
+static const struct {
+	const char *name;
+	int algo;
+} md_algos[] = {{"sha1", GCRY_MD_SHA1},
+		{"sha256", GCRY_MD_SHA256},
+		{"blake2b", GCRY_MD_BLAKE2B_256}};
+
+/*
+ * State the benchmarks share: a list of files as a client sends it, its
+ * header, and a client directory holding some of the files
+ */
+typedef struct {
+	uint32_t files;
+	data_head *list;
+	uint8_t *header;
+	char client_dir[PATH_MAX];
+	uint8_t key[KEY_SIZE];
+	uint8_t vector[INIT_VEC_BYTES];
+
+	// Cipher and digest benchmarks only
+	uint8_t suite;
+	int md_algo;
+	uint32_t chunk_size;
+	uint8_t *in;
+	uint8_t *out;
+	uint8_t *sealed; // in's first chunk encrypted, with its tag
+} fixture;
+
+/*
+ * One benchmark, timed over whole repetitions of run. Each repetition
+ * handles items things of bytes bytes in all, for the rates reported.
+ */
+typedef struct {
+	char name[64];
+	void (*run)(fixture *f);
+	uint64_t items;
+	uint64_t bytes;
+} micro;
+
+/*
+ * How every benchmark is run and reported
+ */
+typedef struct {
+	int reps;
+	int warmup;
+	char *filter; // Substring of the names of the benchmarks run
+	bool json;
+	bool first; // Nothing reported yet
+} run_opts;
+
+/*
+ * Summary of the repetitions of one benchmark, in seconds
+ */
+typedef struct {
+	double min;
+	double median;
+	double mean;
+	double stddev;
+	double max;
+} summary;
+
+static __attribute__((noreturn)) void usage(char *bin_path,
+					     int exit_status)
+{
+	char *bin = basename(bin_path);
+
+	fprintf(stderr,
+		"Usage: %s [-n files] [-r reps] [-w warmup] [-f filter] "
+		"[-j] [-h]\n\n"
+		"Times the transfer header path for a header of many files and "
+		"the raw cipher and digest calls at several chunk sizes\n\n"
+		"Options:\n"
+		"-n Files in the header (default %d)\n"
+		"-r Timed repetitions of each benchmark (default %d)\n"
+		"-w Untimed repetitions run first (default %d)\n"
+		"-f Only run benchmarks whose name contains this\n"
+		"-j Report as JSON\n"
+		"-h Help\n\n",
+		bin, DEFAULT_FILES, DEFAULT_REPS, DEFAULT_WARMUP);
+	exit(exit_status);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Fill the buffer from a xorshift64* generator, so the files of the
+ * fixture differ but are the same on every run
+ */
+static void fill_random(uint8_t *buf, size_t len, uint64_t *state)
+{
+	for (size_t i = 0; i < len; i++) {
+		*state ^= *state >> 12;
+		*state ^= *state << 25;
+		*state ^= *state >> 27;
+		buf[i] = (*state * 0x2545F4914F6CDD1DULL) >> 56;
+	}
+}
+
+/*
+ * Build the fixture's list of SHA-256 hashed files, its header and a
+ * client directory with every STORED_EVERY-th file stored and indexed
+ */
+static void fixture_init(fixture *f, uint32_t files)
+{
+	uint64_t state = 0x9E3779B97F4A7C15ULL;
+	fill_random(f->key, KEY_SIZE, &state);
+	fill_random(f->vector, INIT_VEC_BYTES, &state);
+
+	f->files = files;
+	f->list = datalist_init(f->vector);
+	f->list->suite = CIPHER_CTR;
+	f->list->hash_algo = HASH_SHA256;
+
+	char tmp[] = "/tmp/eftmicro.XXXXXX";
+	if (NULL == mkdtemp(tmp)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(f->client_dir, tmp, sizeof(tmp));
+
+	uint8_t **stored =
+	    malloc((files / STORED_EVERY + 1) * sizeof(uint8_t *));
+	if (NULL == stored)
+		mem_error();
+	uint32_t n_stored = 0;
+
+	for (uint32_t i = 0; i < files; i++) {
+		char name[NAME_BYTES] = {0};
+		uint8_t hash[MAX_HASH_BYTES];
+		snprintf(name, sizeof(name), "file%06u.dat", i);
+		fill_random(hash, sizeof(hash), &state);
+		datalist_append(f->list, name, (uint64_t)i * 1024, hash,
+				TRANSFER_Y);
+
+		if (i % STORED_EVERY != 0)
+			continue;
+
+		char *stored_name = hash_name(HASH_SHA256, hash);
+		char path[PATH_MAX];
+		if (snprintf(path, sizeof(path), "%s/%s", f->client_dir,
+			     stored_name) >= (int)sizeof(path)) {
+			fprintf(stderr, "Path too long: %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		int fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd == -1) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		free(stored_name);
+		stored[n_stored++] = f->list->last->hash;
+	}
+
+	hashindex_add(f->client_dir, HASH_SHA256, stored, n_stored);
+	free(stored);
+
+	f->header = datalist_generate_payload(f->list);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+			struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+static void fixture_destroy(fixture *f)
+{
+	nftw(f->client_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	datalist_destroy(f->list);
+	free(f->header);
+}
+
+static void run_generate_payload(fixture *f)
+{
+	free(datalist_generate_payload(f->list));
+}
+
+static void run_header_parse(fixture *f)
+{
+	data_head *list = header_parse(f->header, f->client_dir);
+	if (NULL == list) {
+		fprintf(stderr, "Header rejected\n");
+		exit(EXIT_FAILURE);
+	}
+	datalist_destroy(list);
+}
+
+/*
+ * The lookup check_duplicate makes for every file of a header, with the
+ * index opened once for the header as header_parse does
+ */
+static void run_check_duplicate(fixture *f)
+{
+	hash_index *idx = hashindex_open(f->client_dir);
+	for (data_node *n = f->list->first; n != NULL; n = n->next)
+		hashindex_stored(f->client_dir, idx, HASH_SHA256, n->hash);
+
+	if (NULL != idx)
+		hashindex_close(idx);
+}
+
+static void run_hash_to_hex(fixture *f)
+{
+	for (data_node *n = f->list->first; n != NULL; n = n->next)
+		free(hash_to_hex(n->hash, MAX_HASH_BYTES));
+}
+
+static void run_init_cipher_context(fixture *f)
+{
+	for (uint32_t i = 0; i < f->files; i++)
+		gcry_cipher_close(
+		    init_cipher_context(f->vector, f->key, f->suite));
+}
+
+/*
+ * Encrypt CRYPTO_BYTES as consecutive chunks of one file, positioned
+ * per chunk like the pipelined transfers do
+ */
+static void run_encrypt(fixture *f)
+{
+	gcry_cipher_hd_t hd = init_cipher_context(f->vector, f->key, f->suite);
+
+	for (uint64_t off = 0; off < CRYPTO_BYTES; off += f->chunk_size) {
+		cipher_seek(hd, f->suite, f->vector, 0, off, f->chunk_size);
+		g_error(gcry_cipher_encrypt(hd, f->out, f->chunk_size, f->in,
+					    f->chunk_size));
+		if (f->suite == CIPHER_GCM)
+			g_error(gcry_cipher_gettag(hd, f->out + f->chunk_size,
+						   TAG_BYTES));
+	}
+
+	gcry_cipher_close(hd);
+}
+
+/*
+ * Encrypt the first chunk of in, at the chunk size set, into sealed
+ */
+static void seal_chunk(fixture *f)
+{
+	gcry_cipher_hd_t hd = init_cipher_context(f->vector, f->key, f->suite);
+	cipher_seek(hd, f->suite, f->vector, 0, 0, f->chunk_size);
+	g_error(gcry_cipher_encrypt(hd, f->sealed, f->chunk_size, f->in,
+				    f->chunk_size));
+	if (f->suite == CIPHER_GCM)
+		g_error(gcry_cipher_gettag(hd, f->sealed + f->chunk_size,
+					   TAG_BYTES));
+	gcry_cipher_close(hd);
+}
+
+/*
+ * Decrypt CRYPTO_BYTES as chunks, each the sealed chunk so
+ * authenticated suites check out
+ */
+static void run_decrypt(fixture *f)
+{
+	gcry_cipher_hd_t hd = init_cipher_context(f->vector, f->key, f->suite);
+
+	for (uint64_t off = 0; off < CRYPTO_BYTES; off += f->chunk_size) {
+		if (f->suite == CIPHER_CBC)
+			g_error(gcry_cipher_setiv(hd, f->vector,
+						  INIT_VEC_BYTES));
+		cipher_seek(hd, f->suite, f->vector, 0, 0, f->chunk_size);
+		g_error(gcry_cipher_decrypt(hd, f->out, f->chunk_size,
+					    f->sealed, f->chunk_size));
+		if (f->suite == CIPHER_GCM)
+			g_error(gcry_cipher_checktag(
+			    hd, f->sealed + f->chunk_size, TAG_BYTES));
+	}
+
+	gcry_cipher_close(hd);
+}
+
+static void run_md_write(fixture *f)
+{
+	gcry_md_hd_t md;
+	g_error(gcry_md_open(&md, f->md_algo, 0));
+
+	for (uint64_t off = 0; off < CRYPTO_BYTES; off += f->chunk_size)
+		gcry_md_write(md, f->in, f->chunk_size);
+
+	gcry_md_read(md, f->md_algo);
+	gcry_md_close(md);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Run the benchmark warmup times untimed, then reps times timed
+ */
+static summary measure(micro *m, fixture *f, int warmup, int reps)
+{
+	double *times = malloc(reps * sizeof(double));
+	if (NULL == times)
+		mem_error();
+
+	for (int i = 0; i < warmup; i++)
+		m->run(f);
+
+	for (int i = 0; i < reps; i++) {
+		double start = now();
+		m->run(f);
+		times[i] = now() - start;
+	}
+
+	qsort(times, reps, sizeof(double), compare_doubles);
+
+	summary s = {.min = times[0], .max = times[reps - 1]};
+	s.median = reps % 2 ? times[reps / 2]
+			    : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+	for (int i = 0; i < reps; i++)
+		s.mean += times[i] / reps;
+	for (int i = 0; i < reps; i++)
+		s.stddev += (times[i] - s.mean) * (times[i] - s.mean);
+	s.stddev = reps > 1 ? sqrt(s.stddev / (reps - 1)) : 0;
+
+	free(times);
+	return s;
+}
+
+/*
+ * Print one benchmark's summary, with the per item time and the
+ * throughput of its median repetition
+ */
+static void report(micro *m, summary *s, bool json, bool first)
+{
+	double per_item = s->median / m->items;
+	double mb_per_s = m->bytes / 1e6 / s->median;
+
+	if (json) {
+		printf("%s\n  {\"name\": \"%s\", \"items\": %llu, "
+		       "\"bytes\": %llu, \"min_s\": %.9f, \"median_s\": %.9f, "
+		       "\"mean_s\": %.9f, \"stddev_s\": %.9f, \"max_s\": %.9f, "
+		       "\"ns_per_item\": %.3f, \"mb_per_s\": %.3f}",
+		       first ? "[" : ",", m->name,
+		       (unsigned long long)m->items,
+		       (unsigned long long)m->bytes, s->min, s->median,
+		       s->mean, s->stddev, s->max, per_item * 1e9,
+		       m->bytes > 0 ? mb_per_s : 0);
+		return;
+	}
+
+	if (first)
+		printf("%-32s %10s %10s %10s %10s %12s %10s\n", "benchmark",
+		       "median ms", "mean ms", "stddev ms", "min ms",
+		       "ns/item", "MB/s");
+
+	printf("%-32s %10.3f %10.3f %10.3f %10.3f %12.1f ", m->name,
+	       s->median * 1e3, s->mean * 1e3, s->stddev * 1e3, s->min * 1e3,
+	       per_item * 1e9);
+	if (m->bytes > 0)
+		printf("%10.1f\n", mb_per_s);
+	else
+		printf("%10s\n", "-");
+}
+
+/*
+ * Measure and report the benchmark unless the filter leaves it out
+ */
+static void bench_one(micro *m, fixture *f, run_opts *o)
+{
+	if (NULL != o->filter && NULL == strstr(m->name, o->filter))
+		return;
+
+	summary s = measure(m, f, o->warmup, o->reps);
+	report(m, &s, o->json, o->first);
+	o->first = false;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	uint32_t files = DEFAULT_FILES;
+	run_opts o = {DEFAULT_REPS, DEFAULT_WARMUP, NULL, false, true};
+
+	while ((opt = getopt(argc, argv, "n:r:w:f:jh")) != -1) {
+		switch (opt) {
+		case 'n':
+			files = strtoul(optarg, NULL, 10);
+			if (files == 0 || files > MAX_FILES)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'r':
+			o.reps = atoi(optarg);
+			if (o.reps < 1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'w':
+			o.warmup = atoi(optarg);
+			if (o.warmup < 0)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'f':
+			o.filter = optarg;
+			break;
+		case 'j':
+			o.json = true;
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+		default:
+			usage(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	init_gcrypt();
+
+	fixture f;
+	memset(&f, 0, sizeof(f));
+	fixture_init(&f, files);
+	uint32_t header_len = header_fixed_size(f.header) +
+			      header_files_size(f.header);
+
+	// Header path, one repetition handling every file of the header
+	micro header_micros[] = {
+	    {"datalist_generate_payload", run_generate_payload, files,
+	     header_len},
+	    {"header_parse", run_header_parse, files, header_len},
+	    {"check_duplicate", run_check_duplicate, files, 0},
+	    {"hash_to_hex", run_hash_to_hex, files, 0}};
+	for (size_t i = 0; i < sizeof(header_micros) / sizeof(micro); i++)
+		bench_one(&header_micros[i], &f, &o);
+
+	uint32_t frame_size = MAX_CHUNK_SIZE + TAG_BYTES;
+	f.in = aligned_buffer(frame_size);
+	f.out = aligned_buffer(frame_size);
+	f.sealed = aligned_buffer(frame_size);
+	uint64_t state = 1;
+	fill_random(f.in, frame_size, &state);
+
+	// The rest depend on the suite, digest and chunk size set for them
+	size_t n_sizes = sizeof(chunk_sizes) / sizeof(chunk_sizes[0]);
+	for (uint8_t suite = 0; suite < CIPHER_SUITES; suite++) {
+		f.suite = suite;
+		micro m = {"", run_init_cipher_context, files, 0};
+		snprintf(m.name, sizeof(m.name), "init_cipher_context/%s",
+			 suite_names[suite]);
+		bench_one(&m, &f, &o);
+
+		for (size_t i = 0; i < n_sizes; i++) {
+			f.chunk_size = chunk_sizes[i];
+			uint64_t chunks = CRYPTO_BYTES / f.chunk_size;
+
+			seal_chunk(&f);
+
+			micro enc = {"", run_encrypt, chunks, CRYPTO_BYTES};
+			snprintf(enc.name, sizeof(enc.name),
+				 "gcry_cipher_encrypt/%s/%u",
+				 suite_names[suite], f.chunk_size);
+			bench_one(&enc, &f, &o);
+
+			micro dec = {"", run_decrypt, chunks, CRYPTO_BYTES};
+			snprintf(dec.name, sizeof(dec.name),
+				 "gcry_cipher_decrypt/%s/%u",
+				 suite_names[suite], f.chunk_size);
+			bench_one(&dec, &f, &o);
+		}
+	}
+
+	for (size_t a = 0; a < sizeof(md_algos) / sizeof(md_algos[0]); a++) {
+		f.md_algo = md_algos[a].algo;
+		for (size_t i = 0; i < n_sizes; i++) {
+			f.chunk_size = chunk_sizes[i];
+			micro m = {"", run_md_write, CRYPTO_BYTES / f.chunk_size,
+				   CRYPTO_BYTES};
+			snprintf(m.name, sizeof(m.name), "gcry_md_write/%s/%u",
+				 md_algos[a].name, f.chunk_size);
+			bench_one(&m, &f, &o);
+		}
+	}
+
+	if (o.json)
+		printf(o.first ? "[]\n" : "\n]\n");
+
+	free(f.in);
+	free(f.out);
+	free(f.sealed);
+	fixture_destroy(&f);
+	return EXIT_SUCCESS;
+}
@@ -15,25 +15,34 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netdb.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "net.h"
+#include "uring.h"
 
-#define BACKLOG 10
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // Platforms without it rely on SIGPIPE being ignored
+#endif
 
 int write_all(int dstfd, uint8_t *src, int src_len)
 {
 	int written = 0;
 
 	while (written < src_len) {
-		int n = write(dstfd, src + written, src_len - written);
+		int n = send(dstfd, src + written, src_len - written,
+			     MSG_NOSIGNAL);
 		if (n < 0) {
 			if (errno == EINTR)
 				return -1;
+			if (errno == EPIPE || errno == ECONNRESET)
+				return 0; // Peer dropped the connection
 			perror("write failed");
 			exit(EXIT_FAILURE);
 		}
@@ -54,6 +63,8 @@ int recv_all(int srcfd, uint8_t *dst, int dst_len)
 		if (n == -1) {
 			if (errno == EINTR)
 				return -1;
+			if (errno == ECONNRESET)
+				return 0; // Peer dropped the connection
 			perror("recv failed");
 			exit(EXIT_FAILURE);
 		}
@@ -66,6 +77,102 @@ int recv_all(int srcfd, uint8_t *dst, int dst_len)
 	return total_read;
 }
 
+/*
+ * Finish a batch one buffer at a time from buffer i, of which done bytes
+ * already went through, with write_all or recv_all. Returns like them,
+ * with the total of the batch.
+ */
+static int finish_batch(int fd, struct iovec *bufs, int n, int i, int done,
+			int total, bool sending)
+{
+	for (; i < n; i++, done = 0) {
+		uint8_t *base = bufs[i].iov_base;
+		int len = bufs[i].iov_len - done;
+		int r = sending ? write_all(fd, base + done, len)
+				: recv_all(fd, base + done, len);
+		if (r <= 0)
+			return r;
+		total += bufs[i].iov_len;
+	}
+
+	return total;
+}
+
+int send_batch(uring *u, int dstfd, struct iovec *bufs, int n)
+{
+	if (NULL == u || n == 1)
+		return finish_batch(dstfd, bufs, n, 0, 0, 0, true);
+
+	// Linked sends go out in order, a short one cancels the rest
+	for (int i = 0; i < n; i++)
+		uring_prep_send(u, dstfd, bufs[i].iov_base, bufs[i].iov_len,
+				i < n - 1);
+
+	int32_t res[URING_BATCH];
+	if (uring_run(u, res) == -1)
+		return -1;
+
+	int total = 0;
+	for (int i = 0; i < n; i++) {
+		if (res[i] == (int32_t)bufs[i].iov_len) {
+			total += res[i];
+			continue;
+		}
+
+		if (res[i] == -EINTR)
+			return -1;
+		if (res[i] == -EPIPE || res[i] == -ECONNRESET)
+			return 0; // Peer dropped the connection
+		if (res[i] < 0 && res[i] != -ECANCELED) {
+			errno = -res[i];
+			perror("write failed");
+			exit(EXIT_FAILURE);
+		}
+
+		int done = res[i] > 0 ? res[i] : 0;
+		return finish_batch(dstfd, bufs, n, i, done, total, true);
+	}
+
+	return total;
+}
+
+int recv_batch(uring *u, int srcfd, struct iovec *bufs, int n)
+{
+	if (NULL == u || n == 1)
+		return finish_batch(srcfd, bufs, n, 0, 0, 0, false);
+
+	for (int i = 0; i < n; i++)
+		uring_prep_recv(u, srcfd, bufs[i].iov_base, bufs[i].iov_len,
+				i < n - 1);
+
+	int32_t res[URING_BATCH];
+	if (uring_run(u, res) == -1)
+		return -1;
+
+	int total = 0;
+	for (int i = 0; i < n; i++) {
+		if (res[i] == (int32_t)bufs[i].iov_len) {
+			total += res[i];
+			continue;
+		}
+
+		if (res[i] == -EINTR)
+			return -1;
+		if (res[i] == 0 || res[i] == -ECONNRESET)
+			return 0; // Peer closed or dropped the connection
+		if (res[i] < 0 && res[i] != -ECANCELED) {
+			errno = -res[i];
+			perror("recv failed");
+			exit(EXIT_FAILURE);
+		}
+
+		int done = res[i] > 0 ? res[i] : 0;
+		return finish_batch(srcfd, bufs, n, i, done, total, false);
+	}
+
+	return total;
+}
+
 char *make_ip_port(struct sockaddr_storage *connection, socklen_t size)
 {
 	int err;
@@ -93,6 +200,22 @@ char *make_ip_port(struct sockaddr_storage *connection, socklen_t size)
 	return ip_port;
 }
 
+char *socket_local_ip(int sfd)
+{
+	struct sockaddr_storage local;
+	socklen_t size = sizeof(local);
+	char ip[NI_MAXHOST];
+
+	if (getsockname(sfd, (struct sockaddr *)&local, &size) == -1)
+		return NULL;
+
+	if (getnameinfo((struct sockaddr *)&local, size, ip, sizeof(ip), NULL,
+			0, NI_NUMERICHOST) != 0)
+		return NULL;
+
+	return strdup(ip);
+}
+
 /*
  * Set the socket to re-use the bound address
  */
@@ -106,7 +229,27 @@ static void set_socket_options(int sfd)
 	}
 }
 
-int server_socket(char *port)
+/*
+ * Allow other sockets to bind the same address and port. The kernel
+ * spreads incoming connections across all of them.
+ */
+static void set_reuse_port(int sfd)
+{
+#ifdef SO_REUSEPORT
+	int value = 1;
+	int rv = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(int));
+	if (rv == -1) {
+		perror("setsockopt reuse port error");
+		exit(EXIT_FAILURE);
+	}
+#else
+	(void)sfd;
+	fprintf(stderr, "SO_REUSEPORT is not supported on this platform\n");
+	exit(EXIT_FAILURE);
+#endif
+}
+
+int server_socket(char *port, int backlog, bool reuse_port)
 {
 	int socketfd, rv;
 	struct addrinfo hints, *results, *p;
@@ -132,6 +275,8 @@ int server_socket(char *port)
 		}
 
 		set_socket_options(socketfd);
+		if (reuse_port)
+			set_reuse_port(socketfd);
 
 		rv = bind(socketfd, p->ai_addr, p->ai_addrlen);
 		if (rv == -1) {
@@ -150,7 +295,7 @@ int server_socket(char *port)
 
 	freeaddrinfo(results);
 
-	rv = listen(socketfd, BACKLOG);
+	rv = listen(socketfd, backlog);
 	if (rv == -1) {
 		perror("listen error");
 		exit(EXIT_FAILURE);
@@ -196,7 +341,7 @@ int client_socket(char *svr_ip, char *svr_port, char *loc_ip, char *loc_port)
 
 	set_socket_options(socketfd);
 
-	if (NULL != loc_port) {
+	if (NULL != loc_ip || NULL != loc_port) {
 		rv = bind(socketfd, (struct sockaddr *)&laddr, sizeof(laddr));
 		if (rv == -1) {
 			perror("bind");
@@ -9,6 +9,14 @@
 #ifndef NET_H
 #define NET_H
 
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+#define DEFAULT_BACKLOG SOMAXCONN
+
 /*
  * Write an entire source buffer to the destination socket. Returns
  * 0 when the socket is closed, -1 when interrupted
@@ -17,23 +25,44 @@ int write_all(int dstfd, uint8_t *src, int src_len);
 
 /*
  * Receive dst_len bytes from the source socket into destination
- * buffer. Returns 0 when the socket is closed, -1 when interrupted,
- * dst_len echoed otherwise
+ * buffer. Returns 0 when the socket is closed or reset by the peer, -1
+ * when interrupted, dst_len echoed otherwise
  */
 int recv_all(int srcfd, uint8_t *dst, int dst_len);
 
+/*
+ * Write n buffers, at most URING_BATCH, to the socket back to back,
+ * submitted together through the ring, or one after the other when it
+ * is NULL. Returns like write_all, with the total written.
+ */
+int send_batch(uring *u, int dstfd, struct iovec *bufs, int n);
+
+/*
+ * Fill n buffers, at most URING_BATCH, from the socket in order, through
+ * the ring like send_batch. Returns like recv_all, with the total read.
+ */
+int recv_batch(uring *u, int srcfd, struct iovec *bufs, int n);
+
 /*
  * Open a TCP socket that is connected to the specified
- * destination ip:port. Will bind to the provided local ip:port
- * if not NULL.
+ * destination ip:port. Will bind to the provided local ip and/or
+ * port if not NULL.
  */
 int client_socket(char *svr_ip, char *svr_port, char *loc_ip, char *loc_port);
 
 /*
  * Open a TCP socket that is ready to accept incoming
- * connections on the specified port
+ * connections on the specified port, queueing at most backlog
+ * pending connections. With reuse_port, several sockets may listen
+ * on the same port and share its incoming connections.
+ */
+int server_socket(char *port, int backlog, bool reuse_port);
+
+/*
+ * Return the local ip address the given connected socket is using,
+ * NULL on failure
  */
-int server_socket(char *port);
+char *socket_local_ip(int sfd);
 
 /*
  * Make the ip:port string for use in the file structure
@@ -7,50 +7,26 @@
  *  them into list-related structures
  */
 
-#include <arpa/inet.h>
-#include <dirent.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "common.h"
 #include "datalist.h"
+#include "digest.h"
 #include "filesys.h"
+#include "hashindex.h"
 #include "parser.h"
 
 /*
- * Ensure that the given hash does not exist in the current directory.
- * This function should be called while already in a given clients
- * working directory
+ * Ensure that the given hash does not exist in the given clients
+ * directory, looking it up in the client's index when there is one
  */
-static int check_duplicate(uint8_t *hash)
+static int check_duplicate(char *client_dir, hash_index *idx, uint8_t algo,
+			   uint8_t *hash)
 {
-	DIR *d;
-	struct dirent *directory;
-	char *hex_hash;
-
-	int file_path_size = snprintf(NULL, 0, CUR_DIR);
-
-	char filepath[file_path_size + 1];
-
-	snprintf(filepath, file_path_size + 1, CUR_DIR);
-
-	d = opendir(filepath);
-	if (d) {
-		directory = readdir(d);
-		while (directory != NULL) {
-			if (directory->d_name[0] != '.') {
-				hex_hash = hash_to_hex(hash);
-				if (memcmp(directory->d_name, hex_hash,
-					   HASH_BYTES * 2) == 0) {
-					free(hex_hash);
-					closedir(d);
-					return TRANSFER_N;
-				}
-				free(hex_hash);
-			}
-			directory = readdir(d);
-		}
-		closedir(d);
-	}
+	if (hashindex_stored(client_dir, idx, algo, hash))
+		return TRANSFER_N;
 
 	return TRANSFER_Y;
 }
@@ -59,36 +35,251 @@ static int check_duplicate(uint8_t *hash)
  * Add a list node to the given list, interpreted from the given
  * file data bytes containing the files name, size, and hash
  */
-static void header_add_node(data_head *list, uint8_t *file_data)
+static void header_add_node(data_head *list, uint8_t *file_data,
+			    char *client_dir, hash_index *idx)
 {
 	char *name = (char *)file_data;
+	uint32_t size_len = size_bytes(list->version);
+	uint64_t size = get_be(file_data + NAME_BYTES, size_len);
+
+	uint8_t *hash = file_data + NAME_BYTES + size_len;
+
+	int transfer_flag =
+	    check_duplicate(client_dir, idx, list->hash_algo, hash);
+
+	datalist_append(list, name, size, hash, transfer_flag);
+}
+
+/*
+ * Returns true if the given header uses the extended layout
+ */
+static bool header_is_extended(uint8_t *header)
+{
+	return header[0] == 0 && header[1] == 0;
+}
+
+uint8_t header_version(uint8_t *header)
+{
+	if (!header_is_extended(header))
+		return 1;
+
+	return header[MARKER_BYTES];
+}
+
+/*
+ * Return the hash algorithm of the given header. Headers before
+ * version 3 always use SHA-1.
+ */
+static uint8_t header_hash_algo(uint8_t *header)
+{
+	if (header_version(header) < 3)
+		return HASH_SHA1;
+
+	return header[MARKER_BYTES + VERSION_BYTES + FLAGS_BYTES + CIPHER_BYTES];
+}
+
+uint32_t header_fixed_size(uint8_t *header)
+{
+	uint8_t version = header_version(header);
+	if (version == 1)
+		return HEADER_INIT_SIZE;
+
+	if (version == 2)
+		return HEADER_EXT_SIZE - HASH_ALGO_BYTES;
+
+	if (version == 3)
+		return HEADER_EXT_SIZE;
+
+	if (version == 4)
+		return HEADER_WIDE_SIZE;
+
+	return HEADER_CHUNKED_SIZE;
+}
+
+/*
+ * Return the number of files in the given header
+ */
+static uint32_t header_file_count(uint8_t *header)
+{
+	uint32_t count_len = files_bytes(header_version(header));
+	uint8_t *count = header + header_fixed_size(header) - INIT_VEC_BYTES -
+			 count_len;
+
+	return get_be(count, count_len);
+}
+
+uint32_t header_files_size(uint8_t *header)
+{
+	uint8_t version = header_version(header);
+	uint8_t algo = header_hash_algo(header);
+	uint32_t count = header_file_count(header);
+
+	// Rejected by header_parse before any file is read
+	if (algo >= HASH_ALGOS || count > MAX_FILES)
+		return 0;
+
+	uint32_t files_size =
+	    HEADER_LINE_SIZE(size_bytes(version), hash_bytes(algo)) * count;
 
-	uint32_t raw_enc_size;
-	memcpy(&raw_enc_size, file_data + NAME_BYTES, sizeof(uint32_t));
+	if (header_striped(header))
+		files_size += STRIPE_DESC_SIZE;
 
-	uint8_t *hash = file_data + NAME_BYTES + SIZE_BYTES;
+	return files_size;
+}
+
+bool header_striped(uint8_t *header)
+{
+	return header_is_extended(header) &&
+	       (header[MARKER_BYTES + VERSION_BYTES] & FLAG_STRIPE);
+}
+
+/*
+ * Returns true if the given owner of a stripe can name a key file and
+ * a directory, without leaving the directory they are in
+ */
+static bool owner_valid(char *owner)
+{
+	return owner[0] != '\0' && owner[0] != '.' &&
+	       strchr(owner, '/') == NULL;
+}
+
+char *header_stripe_owner(uint8_t *header)
+{
+	if (!header_striped(header))
+		return NULL;
+
+	uint8_t *desc = header + header_fixed_size(header) +
+			header_files_size(header) - STRIPE_DESC_SIZE;
+
+	char *owner = calloc(OWNER_BYTES + 1, 1);
+	if (NULL == owner)
+		mem_error();
+
+	memcpy(owner, desc, OWNER_BYTES);
+	if (!owner_valid(owner)) {
+		free(owner);
+		return NULL;
+	}
+
+	return owner;
+}
+
+bool header_stripe_authentic(uint8_t *header, uint8_t *key)
+{
+	uint32_t files_size = header_files_size(header);
+	if (files_size < STRIPE_DESC_SIZE)
+		return false;
 
-	int transfer_flag = check_duplicate(hash);
+	uint32_t len =
+	    header_fixed_size(header) + files_size - STRIPE_MAC_BYTES;
+	uint8_t mac[HMAC_BYTES];
+	digest_hmac(key, header, len, mac);
 
-	datalist_append(list, name, ntohl(raw_enc_size), hash, transfer_flag);
+	// Compared in full so the time taken doesn't give the MAC away
+	uint8_t diff = 0;
+	for (int i = 0; i < STRIPE_MAC_BYTES; i++)
+		diff |= mac[i] ^ header[len + i];
+
+	return diff == 0;
+}
+
+/*
+ * Set the stripe of the given list from the stripe descriptor. Returns
+ * false when the descriptor is not valid for the list.
+ */
+static bool header_parse_stripe(data_head *list, uint8_t *desc)
+{
+	memcpy(list->owner, desc, OWNER_BYTES);
+	list->owner[OWNER_BYTES] = '\0';
+	desc += OWNER_BYTES;
+	list->stripe = *desc;
+	desc += STRIPE_IDX_BYTES;
+	list->stripes = *desc;
+	desc += STRIPE_CNT_BYTES;
+	memcpy(list->nonce, desc, STRIPE_NONCE_BYTES);
+
+	if (list->size != 1 || list->stripes == 0 ||
+	    list->stripes > MAX_STRIPES || list->stripe >= list->stripes ||
+	    !owner_valid(list->owner))
+		return false;
+
+	return true;
 }
 
-data_head *header_parse(uint8_t *header)
+data_head *header_parse(uint8_t *header, char *client_dir)
 {
-	int num_files;
+	uint32_t num_files = header_file_count(header);
 	uint8_t *read_loc = header;
+	uint8_t flags = 0;
+	uint8_t suite = CIPHER_CBC;
+	uint8_t version = header_version(header);
+	uint8_t algo = header_hash_algo(header);
+	uint64_t chunk_size = DEFAULT_CHUNK_SIZE;
 
-	uint16_t files_raw;
-	memcpy(&files_raw, read_loc, sizeof(uint16_t));
-	num_files = ntohs(files_raw);
-	read_loc += FILES_BYTES;
+	if (header_is_extended(header)) {
+		if (version < MIN_PROTOCOL_VERSION ||
+		    version > PROTOCOL_VERSION)
+			return NULL;
+
+		read_loc += MARKER_BYTES + VERSION_BYTES;
+		flags = *read_loc;
+		read_loc += FLAGS_BYTES;
+		suite = *read_loc;
+		read_loc += CIPHER_BYTES;
+		if (version >= 3)
+			read_loc += HASH_ALGO_BYTES;
+		if (version >= CHUNKED_PROTOCOL_VERSION) {
+			chunk_size = get_be(read_loc, CHUNK_SIZE_BYTES);
+			read_loc += CHUNK_SIZE_BYTES;
+		}
+
+		if (suite >= CIPHER_SUITES || algo >= HASH_ALGOS ||
+		    !chunk_size_valid(chunk_size))
+			return NULL;
+
+		// Deduplicated files are sent one at a time, whole
+		if ((flags & FLAG_DEDUPE) &&
+		    (flags & (FLAG_PIPELINE | FLAG_STRIPE)))
+			return NULL;
+
+		// Only files sent whole on one connection are resumed
+		if ((flags & FLAG_RESUME) &&
+		    (flags & (FLAG_DEDUPE | FLAG_STRIPE)))
+			return NULL;
+
+		// Packed files are sent back-to-back on one connection
+		if ((flags & FLAG_PACK) &&
+		    (flags & (FLAG_DEDUPE | FLAG_STRIPE) ||
+		     !(flags & FLAG_PIPELINE)))
+			return NULL;
+	}
+
+	if (num_files > MAX_FILES)
+		return NULL;
+	read_loc += files_bytes(version);
 
 	data_head *list = datalist_init(read_loc);
+	list->version = version;
+	list->flags = flags;
+	list->suite = suite;
+	list->hash_algo = algo;
+	list->chunk_size = chunk_size;
 	read_loc += INIT_VEC_BYTES;
 
-	for (int i = 0; i < num_files; i++) {
-		header_add_node(list, read_loc);
-		read_loc += NAME_BYTES + SIZE_BYTES + HASH_BYTES;
+	hash_index *idx = hashindex_open(client_dir);
+	uint32_t line_size =
+	    HEADER_LINE_SIZE(size_bytes(version), hash_bytes(algo));
+	for (uint32_t i = 0; i < num_files; i++) {
+		header_add_node(list, read_loc, client_dir, idx);
+		read_loc += line_size;
+	}
+
+	if (NULL != idx)
+		hashindex_close(idx);
+
+	if ((flags & FLAG_STRIPE) && !header_parse_stripe(list, read_loc)) {
+		datalist_destroy(list);
+		return NULL;
 	}
 
 	return list;
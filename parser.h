@@ -12,10 +12,52 @@
 
 #include "datalist.h"
 
+/*
+ * Return the protocol version of the transfer header that starts with
+ * the given HEADER_INIT_SIZE bytes, 1 for the original layout
+ */
+uint8_t header_version(uint8_t *header);
+
+/*
+ * Return the size of the fixed part of the transfer header that
+ * starts with the given HEADER_INIT_SIZE bytes
+ */
+uint32_t header_fixed_size(uint8_t *header);
+
+/*
+ * Return the number of bytes of file information that follow the
+ * fixed part of the given transfer header
+ */
+uint32_t header_files_size(uint8_t *header);
+
+/*
+ * Returns true if the given transfer header is for a striped transfer
+ */
+bool header_striped(uint8_t *header);
+
+/*
+ * Return a copy of the owner named by the given complete transfer
+ * header when it is for a striped transfer, NULL otherwise. An owner
+ * that could name a file outside the keys directory, or none, is NULL
+ * too.
+ */
+char *header_stripe_owner(uint8_t *header);
+
+/*
+ * Returns true if the stripe descriptor of the given complete striped
+ * transfer header carries the MAC of the header under the given key,
+ * the key of the owner it names
+ */
+bool header_stripe_authentic(uint8_t *header, uint8_t *key);
+
 /*
  * Parse the given transfer header into a list representing
- * the given transfer.
+ * the given transfer. Files already stored in the given client
+ * directory are marked as duplicates, found through the client's
+ * index. Returns NULL when the header
+ * uses an unsupported protocol version, cipher suite or hash
+ * algorithm, or has more than MAX_FILES files.
  */
-data_head *header_parse(uint8_t *header);
+data_head *header_parse(uint8_t *header, char *client_dir);
 
 #endif /* PARSER_H */
@@ -0,0 +1,336 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Partially received files a server keeps, so a transfer cut
+ *  off part way through can resume where it stopped
+ */
+
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "digest.h"
+#include "partial.h"
+
+#define CHECKPOINT_MAGIC "EFTCKP2" // Second layout, with 64 bit sizes
+#define CHECKPOINT_MAGIC_BYTES 8
+#define REHASH_BUF_SIZE (1 << 20)
+#define SWEEP_MARKER ".expired"
+
+/*
+ * Start of a checkpoint, followed by the saved digest state when the
+ * algorithm has one. Checkpoints are only meant for the host that
+ * wrote them, fields are in native byte order.
+ */
+typedef struct {
+	char magic[CHECKPOINT_MAGIC_BYTES];
+	uint64_t size;      // Size of the whole file
+	uint64_t offset;    // Bytes received
+	uint32_t state_len; // 0 when the digest is rebuilt from the data
+} checkpoint_header;
+
+/*
+ * Return the path of the checkpoint of the partial file at the given
+ * path
+ */
+static char *checkpoint_path(char *path)
+{
+	char *ckpt = malloc(PATH_MAX);
+	if (NULL == ckpt)
+		mem_error();
+
+	snprintf(ckpt, PATH_MAX, "%s.ckpt", path);
+	return ckpt;
+}
+
+/*
+ * Read the checkpoint of the partial file at the given path, of the
+ * given size. The saved digest state, if any, is returned through
+ * state. Returns false when there is no usable checkpoint.
+ */
+static bool read_checkpoint(char *path, uint64_t size, checkpoint_header *h,
+			    uint8_t **state)
+{
+	char *ckpt = checkpoint_path(path);
+	FILE *fp = fopen(ckpt, "r");
+	free(ckpt);
+	if (NULL == fp)
+		return false;
+
+	bool ok = fread(h, sizeof(*h), 1, fp) == 1 &&
+		  memcmp(h->magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_BYTES) ==
+		      0 &&
+		  h->size == size && h->offset <= size;
+
+	if (ok && NULL != state) {
+		*state = malloc(h->state_len + 1);
+		if (NULL == *state)
+			mem_error();
+
+		ok = h->state_len == 0 ||
+		     fread(*state, h->state_len, 1, fp) == 1;
+		if (!ok)
+			free(*state);
+	}
+
+	fclose(fp);
+	return ok;
+}
+
+char *partial_name(uint8_t algo, uint8_t *hash, uint64_t size)
+{
+	char *hex = hash_name(algo, hash);
+	size_t len = sizeof("partial--18446744073709551615") + HASH_NAME_BYTES;
+	char *name = malloc(len);
+	if (NULL == name)
+		mem_error();
+
+	snprintf(name, len, "partial-%s-%" PRIu64, hex, size);
+	free(hex);
+	return name;
+}
+
+uint64_t partial_offset(char *path, uint64_t size)
+{
+	struct stat st;
+	checkpoint_header h;
+
+	// The checkpoint is worthless without the data it describes
+	if (stat(path, &st) == -1 || st.st_size != (off_t)size ||
+	    !read_checkpoint(path, size, &h, NULL))
+		return 0;
+
+	return h.offset;
+}
+
+/*
+ * Carry the given digest on from the checkpoint of the partial file at
+ * the given path, open at fd, so it covers the first offset bytes.
+ * Digests without saved state are rebuilt by reading the kept data.
+ * Returns false when the checkpoint doesn't match.
+ */
+static bool partial_resume(char *path, int fd, uint64_t size,
+			   uint64_t offset, digest_ctx *md)
+{
+	checkpoint_header h;
+	uint8_t *state;
+	if (!read_checkpoint(path, size, &h, &state))
+		return false;
+
+	bool ok = h.offset == offset;
+	if (ok && h.state_len > 0) {
+		ok = digest_restore(md, state, h.state_len);
+		free(state);
+		return ok;
+	}
+	free(state);
+
+	uint8_t *buf = malloc(REHASH_BUF_SIZE);
+	if (NULL == buf)
+		mem_error();
+
+	for (uint64_t done = 0; ok && done < offset;) {
+		uint32_t len = REHASH_BUF_SIZE;
+		if (offset - done < len)
+			len = offset - done;
+
+		ok = pread(fd, buf, len, done) == (ssize_t)len;
+		if (ok)
+			digest_write(md, buf, len);
+		done += len;
+	}
+
+	free(buf);
+	return ok;
+}
+
+int partial_open(char *path, uint64_t size, uint64_t offset, digest_ctx *md)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		perror("open partial");
+		return -1;
+	}
+
+	// The lock is only held by connections with the file still linked
+	struct stat st, linked;
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1 ||
+	    stat(path, &linked) == -1 || st.st_ino != linked.st_ino ||
+	    st.st_dev != linked.st_dev) {
+		close(fd);
+		return -1;
+	}
+
+	if (offset == 0) {
+		partial_forget(path);
+		return fd;
+	}
+
+	// What is kept is useless, the next attempt starts over
+	if (st.st_size != (off_t)size ||
+	    !partial_resume(path, fd, size, offset, md)) {
+		unlink(path);
+		partial_forget(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void partial_checkpoint(char *path, uint64_t size, uint64_t offset,
+			digest_ctx *md)
+{
+	checkpoint_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_BYTES);
+	h.size = size;
+	h.offset = offset;
+
+	uint8_t *state = digest_save(md, &h.state_len);
+
+	// Written aside and renamed so a crash leaves the old checkpoint
+	char *ckpt = checkpoint_path(path);
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ckpt);
+
+	bool ok = false;
+	FILE *fp = fopen(tmp, "w");
+	if (NULL != fp) {
+		ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+		if (NULL != state)
+			ok = fwrite(state, h.state_len, 1, fp) == 1 && ok;
+		ok = fclose(fp) == 0 && ok;
+		ok = ok && rename(tmp, ckpt) == 0;
+	}
+
+	if (!ok) {
+		perror("write checkpoint");
+		remove(tmp);
+	}
+
+	free(state);
+	free(ckpt);
+}
+
+void partial_forget(char *path)
+{
+	char *ckpt = checkpoint_path(path);
+	unlink(ckpt);
+	free(ckpt);
+}
+
+/*
+ * Returns true if the name is of a file kept for an unfinished
+ * transfer: a partial file, its checkpoint, or a temp file
+ */
+static bool unfinished_name(char *name)
+{
+	return strncmp(name, "partial-", 8) == 0 ||
+	       strncmp(name, "incoming-", 9) == 0 ||
+	       strncmp(name, ".incoming-", 10) == 0;
+}
+
+/*
+ * Remove the unfinished file at the given path unless another
+ * connection holds its lock. A partial file takes its checkpoint with
+ * it, a checkpoint is only removed on its own once its file is gone.
+ */
+static void expire_file(char *path, char *name)
+{
+	char *ext = strstr(path, ".ckpt");
+	if (NULL != ext) {
+		char data[PATH_MAX];
+		snprintf(data, sizeof(data), "%.*s", (int)(ext - path), path);
+		if (access(data, F_OK) == -1)
+			unlink(path);
+		return;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	// Unlinked under the lock, so a connection can't be resuming it
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		unlink(path);
+		if (strncmp(name, "partial-", 8) == 0) {
+			char tmp[PATH_MAX];
+			snprintf(tmp, sizeof(tmp), "%s.ckpt.tmp", path);
+			unlink(tmp);
+			partial_forget(path);
+		}
+	}
+
+	close(fd);
+}
+
+/*
+ * Returns true and restarts the wait if the given client directory is
+ * due a sweep
+ */
+static bool sweep_due(char *client_dir)
+{
+	char marker[PATH_MAX];
+	snprintf(marker, sizeof(marker), "%s/%s", client_dir, SWEEP_MARKER);
+
+	struct stat st;
+	time_t now = time(NULL);
+	if (stat(marker, &st) == 0 &&
+	    now - st.st_mtime < PARTIAL_SWEEP_INTERVAL)
+		return false;
+
+	int fd = open(marker, O_WRONLY | O_CREAT, 0600);
+	if (fd == -1)
+		return false;
+
+	futimens(fd, NULL);
+	close(fd);
+	return true;
+}
+
+void partial_expire(char *client_dir)
+{
+	if (!sweep_due(client_dir))
+		return;
+
+	DIR *d = opendir(client_dir);
+	if (NULL == d)
+		return;
+
+	time_t now = time(NULL);
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		if (!unfinished_name(entry->d_name))
+			continue;
+
+		char path[PATH_MAX];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", client_dir,
+			 entry->d_name);
+		if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    now - st.st_mtime >= PARTIAL_MAX_AGE)
+			expire_file(path, entry->d_name);
+	}
+
+	closedir(d);
+}
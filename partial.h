@@ -0,0 +1,67 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to the partially received files a server keeps,
+ *  so a transfer cut off part way through can resume where it stopped
+ */
+
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "digest.h"
+
+#define CHECKPOINT_INTERVAL (1 << 26) // Bytes received between checkpoints
+#define PARTIAL_MAX_AGE (7 * 24 * 60 * 60) // Seconds a file is kept unused
+#define PARTIAL_SWEEP_INTERVAL (60 * 60) // Seconds between sweeps of a dir
+
+/*
+ * Return the name a file with the given hash of the given algorithm
+ * and the given size is received under. A file is only resumed by a
+ * transfer with the same hash and size.
+ */
+char *partial_name(uint8_t algo, uint8_t *hash, uint64_t size);
+
+/*
+ * Return the offset a transfer of the partial file at the given path,
+ * of the given size, can resume from. Returns 0 when nothing of the
+ * file is kept.
+ */
+uint64_t partial_offset(char *path, uint64_t size);
+
+/*
+ * Open the partial file at the given path, of the given size, for
+ * receiving from the given offset, and lock it for this connection. The
+ * given fresh digest carries on from the kept data. Returns the
+ * descriptor, or -1 when another connection holds the file or the kept
+ * data doesn't reach the offset, in which case it is removed.
+ */
+int partial_open(char *path, uint64_t size, uint64_t offset, digest_ctx *md);
+
+/*
+ * Record that the first offset bytes of the partial file at the given
+ * path, of the given size, are received, with the digest of them
+ */
+void partial_checkpoint(char *path, uint64_t size, uint64_t offset,
+			digest_ctx *md);
+
+/*
+ * Drop the checkpoint of the partial file at the given path, once the
+ * file itself has been stored or removed
+ */
+void partial_forget(char *path);
+
+/*
+ * Remove the partial files, their checkpoints and the temp files in the
+ * given client directory left unchanged for PARTIAL_MAX_AGE seconds,
+ * skipping files another connection holds. Each directory is swept at
+ * most once every PARTIAL_SWEEP_INTERVAL seconds, tracked by the
+ * modification time of a marker file in it.
+ */
+void partial_expire(char *client_dir);
+
+#endif /* PARTIAL_H */
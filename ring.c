@@ -0,0 +1,151 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Bounded ring of chunk buffers shared by the stages of a
+ *  threaded transfer pipeline
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "ring.h"
+
+ring *ring_init(uint32_t depth, uint32_t slot_size, int stages)
+{
+	ring *r = calloc(1, sizeof(ring));
+	if (NULL == r)
+		mem_error();
+
+	r->slots = calloc(depth, sizeof(ring_slot));
+	if (NULL == r->slots)
+		mem_error();
+
+	// A slot is free for the first stage once every stage is done
+	// with the chunk one lap earlier
+	uint32_t leaves = (slot_size + TREE_LEAF_SIZE - 1) / TREE_LEAF_SIZE;
+	for (uint32_t i = 0; i < depth; i++) {
+		r->slots[i].data = aligned_buffer(slot_size);
+		r->slots[i].leaves = malloc(leaves * MAX_HASH_BYTES);
+		if (NULL == r->slots[i].leaves)
+			mem_error();
+		r->slots[i].seq = i;
+		r->slots[i].done = stages;
+	}
+
+	r->depth = depth;
+	r->slot_size = slot_size;
+	r->stages = stages;
+	r->end = UINT64_MAX;
+	r->closed = false;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->changed, NULL);
+	return r;
+}
+
+/*
+ * Returns true once the slot holds the given chunk and the stage before
+ * the given one is done with it
+ */
+static bool slot_ready(ring *r, ring_slot *s, uint64_t seq, int stage)
+{
+	int ready = stage == 0 ? r->stages : stage;
+	return s->seq == seq && s->done == ready;
+}
+
+/*
+ * Reset a slot the first stage claimed for a new chunk
+ */
+static void slot_claimed(ring_slot *s, int stage)
+{
+	if (stage == 0) {
+		s->done = 0;
+		s->len = 0;
+		s->offset = 0;
+		s->ok = true;
+	}
+}
+
+ring_slot *ring_claim(ring *r, int stage)
+{
+	pthread_mutex_lock(&r->lock);
+
+	uint64_t seq = r->next[stage];
+	if (seq < r->end)
+		r->next[stage]++;
+
+	ring_slot *s = &r->slots[seq % r->depth];
+	while (!r->closed && seq < r->end && !slot_ready(r, s, seq, stage))
+		pthread_cond_wait(&r->changed, &r->lock);
+
+	if (r->closed || seq >= r->end) {
+		pthread_mutex_unlock(&r->lock);
+		return NULL;
+	}
+
+	slot_claimed(s, stage);
+	pthread_mutex_unlock(&r->lock);
+	return s;
+}
+
+ring_slot *ring_try_claim(ring *r, int stage)
+{
+	pthread_mutex_lock(&r->lock);
+
+	uint64_t seq = r->next[stage];
+	ring_slot *s = &r->slots[seq % r->depth];
+	if (r->closed || seq >= r->end || !slot_ready(r, s, seq, stage)) {
+		pthread_mutex_unlock(&r->lock);
+		return NULL;
+	}
+
+	r->next[stage]++;
+	slot_claimed(s, stage);
+	pthread_mutex_unlock(&r->lock);
+	return s;
+}
+
+void ring_release(ring *r, ring_slot *s, int stage)
+{
+	pthread_mutex_lock(&r->lock);
+
+	s->done = stage + 1;
+	if (s->done == r->stages)
+		s->seq += r->depth; // Free for the chunk one lap later
+
+	pthread_cond_broadcast(&r->changed);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void ring_set_end(ring *r, uint64_t end)
+{
+	pthread_mutex_lock(&r->lock);
+	r->end = end;
+	pthread_cond_broadcast(&r->changed);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void ring_close(ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->closed = true;
+	pthread_cond_broadcast(&r->changed);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void ring_destroy(ring *r)
+{
+	for (uint32_t i = 0; i < r->depth; i++) {
+		free(r->slots[i].data);
+		free(r->slots[i].leaves);
+	}
+
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->changed);
+	free(r->slots);
+	free(r);
+}
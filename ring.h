@@ -0,0 +1,100 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to a bounded ring of chunk buffers shared by the
+ *  stages of a threaded transfer pipeline
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "digest.h"
+
+#define RING_MAX_STAGES 4
+
+/*
+ * One chunk travelling through the pipeline. Every stage handles each
+ * chunk in sequence order, a stage only starts on a chunk once the
+ * stage before it is done with the chunk.
+ */
+typedef struct {
+	uint8_t *data;
+	uint32_t len;    // Bytes of the chunk that are file contents
+	uint64_t offset; // Offset of the chunk in the file
+	uint32_t frame_len; // Bytes of the frame, shorter when compressed
+	uint64_t seq;    // Position of the chunk in the stream
+	uint8_t iv[AES_BLOCKSIZE]; // Chaining block for CBC
+	uint8_t *leaves; // Tree hash leaves of the chunk's contents
+	bool ok;	 // Set false by a stage to fail the chunk
+	int done;	// Stages finished with the chunk
+} ring_slot;
+
+/*
+ * A ring of depth slots passed through a fixed number of stages. More
+ * than one thread may run a stage, the stages after it still see the
+ * chunks in order. The depth bounds how far the first stage can run
+ * ahead of the last.
+ */
+typedef struct {
+	ring_slot *slots;
+	uint32_t depth;
+	uint32_t slot_size;
+	int stages;
+	uint64_t next[RING_MAX_STAGES]; // Next chunk each stage claims
+	uint64_t end;			// Chunks in the stream
+	bool closed;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} ring;
+
+/*
+ * Create a ring of depth slots of slot_size bytes each, page aligned,
+ * passed through the given number of stages. Each slot has room for the
+ * leaves of slot_size bytes of contents.
+ */
+ring *ring_init(uint32_t depth, uint32_t slot_size, int stages);
+
+/*
+ * Wait for the next chunk the given stage should handle. The first stage
+ * gets an empty slot. Returns NULL once the stream has ended or the ring
+ * is closed.
+ */
+ring_slot *ring_claim(ring *r, int stage);
+
+/*
+ * Like ring_claim, but returns NULL instead of waiting when the next
+ * chunk isn't ready for the stage yet. Used to gather chunks already
+ * waiting into one batch.
+ */
+ring_slot *ring_try_claim(ring *r, int stage);
+
+/*
+ * Hand a slot claimed by the given stage on to the next stage, or back to
+ * the first stage after the last one
+ */
+void ring_release(ring *r, ring_slot *s, int stage);
+
+/*
+ * Set the number of chunks in the stream, stages claiming past it get
+ * NULL
+ */
+void ring_set_end(ring *r, uint64_t end);
+
+/*
+ * Abort the pipeline, every waiting and future claim returns NULL
+ */
+void ring_close(ring *r);
+
+/*
+ * Free the ring and its slots, no stage may still be using it
+ */
+void ring_destroy(ring *r);
+
+#endif /* RING_H */
@@ -6,24 +6,63 @@
  *  Purpose: Server (rxer) entry point.
  */
 
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#endif
+
 #include "common.h"
+#include "compress.h"
 #include "datalist.h"
+#include "dedupe.h"
+#include "digest.h"
 #include "filesys.h"
+#include "hashindex.h"
+#include "logger.h"
+#include "metrics.h"
 #include "net.h"
 #include "parser.h"
+#include "partial.h"
+#include "ring.h"
+#include "stats.h"
+#include "uring.h"
+
+#define MAX_EVENTS 64
+#define MAX_SPARE_HANDLES 64 // Idle gcrypt handles kept per process
+#define MAX_CACHED_KEYS 256
+
+// Stages of the threaded receive pipeline
+#define STAGE_RECV 0
+#define STAGE_DECRYPT 1
+#define STAGE_WRITE 2
+#define RX_STAGES 3
+#define RX_SLOTS_PER_THREAD 4
+#define PIPELINE_MIN_CHUNKS 16 // Smaller files are received serially
+#define MAX_DECRYPT_THREADS 16
+#define DEFAULT_DECRYPT_THREADS 4
 
 /*
  * Transfer context while receiving file(s) from
@@ -32,12 +71,187 @@
 typedef struct {
 	gcry_cipher_hd_t hd;
 	data_head *list;
-	uint16_t cur;    // Index of current file
-	char *client_id; // ip:port
+	uint32_t cur;     // Index of current file
+	char *client_id;  // ip:port
+	char *client_dir; // received/ip:port
 	uint8_t *key;
 	int burn;
+
+	// File currently being received
+	out_file *out;
+	digest_ctx *md;
+	recipe *recipe;	     // Chunks of a deduplicated file
+	char *chunk_dir;     // received/ip:port/chunks
+	uint64_t size;	     // Bytes sent, only missing chunks when deduplicated
+	uint64_t total_read; // Offset into the file
+	uint64_t range_end;  // Offset the client stops sending at
+	char *tmp_name;
+	int partial_fd; // Holds the lock on a resumable temp file, else -1
+	uint8_t chain[AES_BLOCKSIZE]; // Last ciphertext block received for CBC
+	bool rejected; // Rest of the transfer refused, the connection is dropped
+	uint8_t *frame; // Frame being received, sized for the transfer's chunks
+	uint8_t *plain; // Contents of a compressed chunk once inflated
+
+	// Stream of a packed transfer, split back into its files
+	uint64_t pack_read; // Offset into the stream
+	uint64_t pack_size; // Bytes of every accepted file together
+	uint8_t *outbox;    // Responses for files finished but not sent yet
+	uint32_t outbox_len;
+	uint32_t outbox_cap;
+
+	transfer_stats *st; // NULL unless stages are timed or metrics kept
 } transfer_ctx;
 
+/*
+ * A client key kept in memory by a long lived process, valid while
+ * the key file is unchanged
+ */
+typedef struct {
+	char *client_id;
+	uint8_t key[KEY_SIZE];
+	ino_t ino;
+	time_t mtime;
+	time_t ctime;
+} cached_key;
+
+// Long lived processes reuse gcrypt handles and keys across connections
+static gcry_cipher_hd_t spare_ciphers[CIPHER_SUITES][MAX_SPARE_HANDLES];
+static int n_spare_ciphers[CIPHER_SUITES];
+static digest_ctx *spare_mds[HASH_ALGOS][MAX_SPARE_HANDLES];
+static int n_spare_mds[HASH_ALGOS];
+static cached_key key_cache[MAX_CACHED_KEYS];
+static int n_cached_keys;
+static bool long_lived; // Serving more than one connection per process
+static int decrypt_threads = -1; // Per connection, 0 receives serially
+static bool batched;		 // Pipelined receives go through io_uring
+static bool timed;		 // Stages of each connection are timed
+
+/*
+ * A thread running one stage of the receive pipeline for a file
+ */
+typedef struct {
+	transfer_ctx *t;
+	ring *r;
+	gcry_cipher_hd_t hd; // Decryption stages only
+	int cfd;	     // Write stage only, sends packed files' responses
+	bool leaves;	     // Tree hash leaves are hashed by the decrypt stage
+	pthread_t thread;
+} rx_worker;
+
+/*
+ * Return a cipher context of the given suite for the given
+ * initialization vector and key, re-keying an idle one when available
+ */
+static gcry_cipher_hd_t acquire_cipher(uint8_t *vector, uint8_t *key,
+				       uint8_t suite)
+{
+	if (n_spare_ciphers[suite] == 0)
+		return init_cipher_context(vector, key, suite);
+
+	gcry_cipher_hd_t hd = spare_ciphers[suite][--n_spare_ciphers[suite]];
+	gcry_error_t err = gcry_cipher_setkey(hd, key, KEY_SIZE);
+	g_error(err);
+
+	if (suite == CIPHER_CBC) {
+		err = gcry_cipher_setiv(hd, vector, INIT_VEC_BYTES);
+		g_error(err);
+	}
+
+	cipher_seek(hd, suite, vector, 0, 0, DEFAULT_CHUNK_SIZE);
+	return hd;
+}
+
+/*
+ * Give a cipher context of the given suite back for re-use by a later
+ * connection
+ */
+static void release_cipher(gcry_cipher_hd_t hd, uint8_t suite)
+{
+	if (!long_lived || n_spare_ciphers[suite] == MAX_SPARE_HANDLES) {
+		gcry_cipher_close(hd);
+		return;
+	}
+
+	spare_ciphers[suite][n_spare_ciphers[suite]++] = hd;
+}
+
+/*
+ * Return an empty digest of the given algorithm, re-using an idle one
+ * when available
+ */
+static digest_ctx *acquire_md(uint8_t algo)
+{
+	if (n_spare_mds[algo] > 0)
+		return spare_mds[algo][--n_spare_mds[algo]];
+
+	return digest_open(algo);
+}
+
+/*
+ * Give a digest back for re-use by a later file
+ */
+static void release_md(digest_ctx *md)
+{
+	if (!long_lived || n_spare_mds[md->algo] == MAX_SPARE_HANDLES) {
+		digest_close(md);
+		return;
+	}
+
+	digest_reset(md);
+	spare_mds[md->algo][n_spare_mds[md->algo]++] = md;
+}
+
+/*
+ * Read the key for the given client. Long lived processes keep keys
+ * in memory and only re-read them when the key file changes.
+ */
+static uint8_t *client_key(char *client_id)
+{
+	char *key_location = concat_paths(KEYS_DIR, client_id);
+	struct stat st;
+	int idx = -1;
+
+	for (int i = 0; i < n_cached_keys && long_lived; i++) {
+		if (strcmp(key_cache[i].client_id, client_id) == 0) {
+			idx = i;
+			break;
+		}
+	}
+
+	// The key was burnt or replaced since it was cached
+	if (idx != -1 && (stat(key_location, &st) == -1 ||
+			  st.st_ino != key_cache[idx].ino ||
+			  st.st_mtime != key_cache[idx].mtime ||
+			  st.st_ctime != key_cache[idx].ctime)) {
+		free(key_cache[idx].client_id);
+		key_cache[idx] = key_cache[--n_cached_keys];
+		idx = -1;
+	}
+
+	uint8_t *key = NULL;
+	if (idx != -1) {
+		key = malloc(KEY_SIZE);
+		if (NULL == key)
+			mem_error();
+		memcpy(key, key_cache[idx].key, KEY_SIZE);
+	} else {
+		key = read_key(key_location);
+	}
+
+	if (key != NULL && idx == -1 && long_lived &&
+	    n_cached_keys < MAX_CACHED_KEYS && stat(key_location, &st) != -1) {
+		cached_key *k = &key_cache[n_cached_keys++];
+		k->client_id = strdup(client_id);
+		memcpy(k->key, key, KEY_SIZE);
+		k->ino = st.st_ino;
+		k->mtime = st.st_mtime;
+		k->ctime = st.st_ctime;
+	}
+
+	free(key_location);
+	return key;
+}
+
 /*
  * Create a new transfer context for the client ip:port
  */
@@ -48,22 +262,109 @@ static transfer_ctx *new_transfer_ctx(char *client_id)
 		mem_error();
 
 	t->client_id = client_id;
+	t->client_dir = NULL;
 	t->cur = 0;
 	t->list = NULL;
 	t->hd = NULL;
 	t->key = NULL;
 	t->burn = NO_BURN;
+	t->out = NULL;
+	t->md = NULL;
+	t->recipe = NULL;
+	t->chunk_dir = NULL;
+	t->size = 0;
+	t->total_read = 0;
+	t->range_end = 0;
+	t->tmp_name = NULL;
+	t->partial_fd = -1;
+	t->rejected = false;
+	t->frame = NULL;
+	t->plain = NULL;
+	t->pack_read = 0;
+	t->pack_size = 0;
+	t->outbox = NULL;
+	t->outbox_len = 0;
+	t->outbox_cap = 0;
+	t->st = NULL;
+	metrics_add(METRIC_ACTIVE, 1);
 	return t;
 }
 
 /*
- * Release resources for a transfer context
+ * Returns true if the client sends one range of a file on this
+ * connection
+ */
+static bool striped(transfer_ctx *t)
+{
+	return (t->list->flags & FLAG_STRIPE) != 0;
+}
+
+/*
+ * Release resources for a transfer context. A partially received
+ * file is removed, unless other connections are also writing it or
+ * it is kept to be resumed.
+ */
+static uint8_t receive_abort(transfer_ctx *t);
+
+/*
+ * Log the stage timing table of a connection a line at a time, so the
+ * report is queued like any other line rather than written in place
  */
+static void log_stats(transfer_stats *st, char *title)
+{
+	char *report = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&report, &len);
+	if (NULL == out)
+		mem_error();
+	stats_report(st, out, title);
+	fclose(out);
+
+	for (char *line = report; *line != '\0';) {
+		char *end = strchr(line, '\n');
+		if (NULL == end)
+			end = line + strlen(line);
+		log_msg(LEVEL_INFO, "%.*s", (int)(end - line), line);
+		line = *end == '\0' ? end : end + 1;
+	}
+
+	free(report);
+}
+
 static void destroy_transfer_ctx(transfer_ctx *t)
 {
+	if (NULL != t->out)
+		receive_abort(t);
+
+	if (NULL != t->md)
+		release_md(t->md);
+
+	if (NULL != t->recipe)
+		recipe_destroy(t->recipe);
+
+	if (NULL != t->hd)
+		release_cipher(t->hd, t->list->suite);
+
+	if (NULL != t->st) {
+		if (timed)
+			log_stats(t->st, t->client_id);
+		stats_destroy(t->st);
+	}
+
+	if (NULL != t->list)
+		datalist_destroy(t->list);
+
+	free(t->tmp_name);
+	free(t->key);
+	free(t->chunk_dir);
+	free(t->outbox);
+	free(t->frame);
+	free(t->plain);
+	free(t->client_dir);
 	free(t->client_id);
 	free(t);
 	t = NULL;
+	metrics_add(METRIC_ACTIVE, -1);
 }
 
 /*
@@ -74,14 +375,61 @@ static void usage(char *bin_path, int exit_status)
 	char *bin = basename(bin_path);
 
 	fprintf(stderr,
-		"Usage: %s [-p port][-h]\n\n"
+		"Usage: %s [-p port][-e][-w workers][-q backlog][-t threads]"
+		"[-U][-T][-M socket][-l level][-J][-R rate][-h]\n\n"
 		"Options:\n"
 		"-p Port for clients to connect to (default %s)\n"
+		"-e Serve all clients from a single event loop instead of a "
+		"process per client\n"
+		"-w Number of long lived worker processes, each pinned to a "
+		"core with its own listening socket (default is a process per "
+		"client)\n"
+		"-q Maximum pending connections per listening socket (default "
+		"%d)\n"
+		"-t Decryption threads per connection, 0 to decrypt serially "
+		"(default one per core, up to %d, serial on a single core). "
+		"Not used by the event loop\n"
+		"-U Batch the receives of pipelined files through io_uring, "
+		"where the kernel supports it\n"
+		"-T Time the recv, decrypt, hash, write and rename stages of "
+		"each connection, reporting them per file and for the "
+		"connection when it ends\n"
+		"-M Serve live metrics of every connection in the Prometheus "
+		"text format on a Unix domain socket at the given path\n"
+		"-l Log lines of the given level and up, one of debug, info, "
+		"warn or error (default info)\n"
+		"-J Log each line as a JSON object\n"
+		"-R Log at most the given number of lines a second per "
+		"process, dropping the rest (default no limit)\n"
 		"-h Help\n\n",
-		bin, DEFAULT_SERVER_PORT);
+		bin, DEFAULT_SERVER_PORT, DEFAULT_BACKLOG,
+		DEFAULT_DECRYPT_THREADS);
 	exit(exit_status);
 }
 
+/*
+ * Returns true if the given initial header is a request to burn the
+ * clients key. The key is removed when it is.
+ */
+static bool header_is_burn(uint8_t *initial_read, transfer_ctx *t)
+{
+	static const uint8_t burn[HEADER_INIT_SIZE] = {0}; // Burn detection
+
+	if (memcmp(initial_read, burn, HEADER_INIT_SIZE) != 0)
+		return false;
+
+	// Remove the clients key when they send an empty header
+	char *key_path = concat_paths(KEYS_DIR, t->client_id);
+	log_msg(LEVEL_INFO, "Burn initiated...client key eliminated");
+	int r = remove(key_path);
+	if (r == -1)
+		log_msg(LEVEL_ERROR, "remove burn: %s", strerror(errno));
+
+	free(key_path);
+	t->burn = BURN;
+	return true;
+}
+
 /*
  * Read the initial transfer header from the given socket
  * using the given transfer context
@@ -89,53 +437,92 @@ static void usage(char *bin_path, int exit_status)
 static uint8_t *read_initial_header(int socketfd, transfer_ctx *t)
 {
 	uint32_t header_size = HEADER_INIT_SIZE;
-	uint64_t files_info = HEADER_LINE_SIZE;
+	uint32_t files_info = 0;
 	uint8_t *buf = NULL;
 
-	static const uint8_t burn[HEADER_INIT_SIZE] = {0}; // Burn detection
-	uint8_t initial_read[header_size];
-	memset(initial_read, 0, header_size);
+	uint8_t initial_read[HEADER_INIT_SIZE];
+	memset(initial_read, 0, HEADER_INIT_SIZE);
 
-	recv_all(socketfd, initial_read, header_size);
+	recv_all(socketfd, initial_read, HEADER_INIT_SIZE);
 
-	// Remove the clients key when they send an empty header
-	if (memcmp(initial_read, burn, HEADER_INIT_SIZE) == 0) {
-		char *key_path = concat_paths(CWD_KEYS, t->client_id);
-		fprintf(stdout, "Burn initiated...client key eliminated\n");
-		int r = remove(key_path);
-		if (r == -1)
-			perror("remove burn");
-
-		free(key_path);
-		t->burn = BURN;
+	if (header_is_burn(initial_read, t))
 		return NULL;
-	}
 
-	uint16_t raw_file_cnt;
-	memcpy(&raw_file_cnt, initial_read, sizeof(uint16_t));
-	files_info = files_info * ntohs(raw_file_cnt) + header_size;
+	// Extended headers carry a few more fixed fields
+	header_size = header_fixed_size(initial_read);
+	uint8_t fixed[header_size];
+	memcpy(fixed, initial_read, HEADER_INIT_SIZE);
+	recv_all(socketfd, fixed + HEADER_INIT_SIZE,
+		 header_size - HEADER_INIT_SIZE);
+
+	files_info = header_files_size(fixed);
 
 	buf = calloc(header_size + files_info, 1);
 	if (buf == NULL)
 		mem_error();
 
-	memcpy(buf, initial_read, header_size);
-	recv_all(socketfd, buf + header_size, files_info - header_size);
+	memcpy(buf, fixed, header_size);
+	recv_all(socketfd, buf + header_size, files_info);
 
 	return buf;
 }
 
+/*
+ * Parse a complete transfer header and prepare to receive the first
+ * requested file. Returns false when the client has nothing to send.
+ */
+static bool accept_header(uint8_t *header, transfer_ctx *t)
+{
+	t->list = header_parse(header, t->client_dir);
+	if (NULL == t->list) {
+		log_msg(LEVEL_WARN, "Client %s, unsupported protocol version",
+			t->client_id);
+		metrics_add(METRIC_REJECTED, 1);
+		return false;
+	}
+
+	for (data_node *n = t->list->first; n != NULL; n = n->next)
+		if (n->transfer == TRANSFER_N)
+			metrics_add(METRIC_DUPLICATES, 1);
+
+	// Stages are timed for the latency histograms too
+	if (timed || metrics_enabled()) {
+		t->st = stats_init(t->list->size);
+		uint32_t i = 1;
+		for (data_node *n = t->list->first; n != NULL; n = n->next)
+			stats_name(t->st, i++, n->name);
+	}
+
+	t->cur = datalist_get_next_active(t->list, t->cur);
+	if (t->cur > t->list->size) {
+		log_msg(LEVEL_INFO,
+			"Client %s, all files exist. Transfer request denied",
+			t->client_id);
+		metrics_add(METRIC_REJECTED, 1);
+		return false; // All files are duplicates off the bat
+	}
+
+	log_msg(LEVEL_INFO, "%s's transfer request accepted", t->client_id);
+	metrics_add(METRIC_ACCEPTED, 1);
+	t->hd = acquire_cipher(t->list->vector, t->key, t->list->suite);
+	memcpy(t->chain, t->list->vector, AES_BLOCKSIZE);
+	return true;
+}
+
 /*
  * Save the actual file and the meta file. The actual file uses the hash as the
  * name, and contains actual file contents received. The meta file is a dotfile
- * of the hash and contains information about the file.
+ * of the hash and contains information about the file. The file is added to
+ * the client's index once stored. Returns false, leaving the temp file,
+ * when the file can't be stored.
  */
-static void save_files(char *tmp_name, data_node *n, char *client_id)
+static bool save_files(char *tmp_name, data_node *n, transfer_ctx *t)
 {
-	char *hex = hash_to_hex(n->hash);
+	uint64_t start = stats_start(t->st);
+	char *hex = hash_name(t->list->hash_algo, n->hash);
 
 	// Write the meta file
-	int hex_size = 2 * HASH_BYTES;
+	int hex_size = strlen(hex);
 	char *meta = malloc(hex_size + 2);
 	if (NULL == meta)
 		mem_error();
@@ -144,39 +531,50 @@ static void save_files(char *tmp_name, data_node *n, char *client_id)
 	memcpy(meta + 1, hex, hex_size);
 	meta[hex_size + 1] = '\0';
 
-	FILE *fp = fopen(meta, "w");
-	if (NULL == fp) {
-		perror("fopen meta");
-		exit(EXIT_FAILURE);
+	char *meta_path = concat_paths(t->client_dir, meta);
+	char *hex_path = concat_paths(t->client_dir, hex);
+	FILE *fp = fopen(meta_path, "w");
+	bool ok = NULL != fp;
+	if (!ok) {
+		log_msg(LEVEL_ERROR, "fopen meta: %s", strerror(errno));
+		goto out;
 	}
 
 	// Original filename and client ip:port written to meta file
 	fprintf(fp, "%.*s\n", NAME_BYTES, n->name);
-	fprintf(fp, "%s\n", client_id);
+	fprintf(fp, "%s\n", t->client_id);
 	fclose(fp);
 
 	// Rename the temp file to its hash - we keep it
-	int r = rename(tmp_name, hex);
-	if (r == -1) {
-		perror("rename");
-		exit(EXIT_FAILURE);
+	ok = rename(tmp_name, hex_path) == 0;
+	if (!ok) {
+		log_msg(LEVEL_ERROR, "rename: %s", strerror(errno));
+		unlink(meta_path);
+		goto out;
 	}
 
+	hashindex_add(t->client_dir, t->list->hash_algo, &n->hash, 1);
+	stats_add(t->st, t->cur, STAT_RENAME, 0, start);
+	metrics_add(METRIC_COMMITTED, 1);
+
+out:
+	free(hex_path);
+	free(meta_path);
 	free(meta);
 	free(hex);
+	return ok;
 }
 
 /*
- * Returns true if the given expected hash matches the actual.
- * If the hash is not the same, remove the given temp file.
+ * Returns true if the given expected hash of len bytes matches the
+ * actual. If the hash is not the same, remove the given temp file.
  */
-static bool hash_matches(uint8_t *actual, uint8_t *expected, char *tmp)
+static bool hash_matches(uint8_t *actual, uint8_t *expected, uint32_t len,
+			 char *tmp)
 {
-	if (memcmp(actual, expected, HASH_BYTES) != 0) {
-		if (unlink(tmp) == -1) {
-			perror("unlink");
-			exit(EXIT_FAILURE);
-		}
+	if (memcmp(actual, expected, len) != 0) {
+		if (unlink(tmp) == -1)
+			log_msg(LEVEL_ERROR, "unlink: %s", strerror(errno));
 
 		return false;
 	}
@@ -185,193 +583,1446 @@ static bool hash_matches(uint8_t *actual, uint8_t *expected, char *tmp)
 }
 
 /*
- * Receive a file at the current index of the transfer context.
- * Incoming chunks of data for the file are hashed as they come in.
- * Incoming data is written to a temp file until the contents are
- * validated against the expected hash. Returns the transfer status
- * for the given file.
+ * Return the file at the current index of the transfer context. Returns
+ * NULL and refuses the rest of the transfer when there is none, only
+ * the first use for a file needs to check.
  */
-static uint8_t receive_file(int cfd, transfer_ctx *t)
+static data_node *current_file(transfer_ctx *t)
 {
 	data_node *node = datalist_get_index(t->list, t->cur);
 	if (NULL == node) {
-		fprintf(stderr, "no file to save at idx %d\n", t->cur);
-		exit(EXIT_FAILURE);
+		log_msg(LEVEL_ERROR, "no file to save at idx %d", t->cur);
+		t->rejected = true;
 	}
 
-	// Read into a temp file because the hash isn't validated
-	char tmp_name[] = "incoming-XXXXXX";
-	int fd = mkstemp(tmp_name);
-	if (fd == -1) {
-		perror("mkstemp");
-		exit(EXIT_FAILURE);
+	return node;
+}
+
+/*
+ * Returns true if the stored file at the given path has the expected
+ * hash of the given algorithm. The file is truncated to the given size
+ * first, dropping data left behind by an earlier attempt.
+ */
+static bool stored_hash_matches(char *path, uint64_t size, uint8_t *expected,
+				uint8_t algo)
+{
+	if (truncate(path, size) == -1) {
+		log_msg(LEVEL_ERROR, "truncate: %s", strerror(errno));
+		return false;
 	}
 
-	FILE *fp = fdopen(fd, "w");
-	if (fp == NULL) {
-		perror("fopen");
-		exit(EXIT_FAILURE);
+	FILE *fp = fopen(path, "r");
+	if (NULL == fp) {
+		log_msg(LEVEL_ERROR, "fopen stored: %s", strerror(errno));
+		return false;
 	}
 
-	uint8_t rx_buf[CHUNK_SIZE];
-	uint32_t total_read = 0;
-	uint32_t bytes_left = node->size;
-	uint32_t fwrite_size = CHUNK_SIZE;
+	uint8_t *buf = aligned_buffer(TREE_LEAF_SIZE);
+	digest_ctx *md = acquire_md(algo);
+	size_t len;
+	while ((len = fread(buf, 1, TREE_LEAF_SIZE, fp)) > 0)
+		digest_write(md, buf, len);
+	fclose(fp);
+	free(buf);
 
-	gcry_md_hd_t hash_hd;
-	gcry_error_t err = gcry_md_open(&hash_hd, HASH_ALGO, 0);
-	g_error(err);
+	bool matches =
+	    memcmp(digest_final(md), expected, hash_bytes(algo)) == 0;
+	release_md(md);
+	return matches;
+}
 
-	fprintf(stdout, "Receiving %s's file: %s...\n", t->client_id,
-		node->name);
+/*
+ * Refuse the current file before any of it is received, when there is
+ * no room to store it. Nothing more of the transfer is accepted.
+ */
+static void reject_unstorable(transfer_ctx *t)
+{
+	log_msg(LEVEL_WARN, "%s's file, %s doesn't fit on disk: %s",
+		t->client_id, current_file(t)->name, strerror(errno));
+	t->rejected = true;
+}
 
-	while (total_read < node->size) {
-		recv_all(cfd, rx_buf, CHUNK_SIZE);
+/*
+ * Return the path of the temp file shared by every stripe of this
+ * attempt at the current file, or of the dotfile tracking their
+ * progress. Both are named by the file's hash and the attempt's nonce,
+ * so an attempt never picks up what an aborted one left behind.
+ */
+static char *stripe_path(transfer_ctx *t, bool progress)
+{
+	char nonce[2 * STRIPE_NONCE_BYTES + 1];
+	for (int i = 0; i < STRIPE_NONCE_BYTES; i++)
+		snprintf(nonce + 2 * i, 3, "%02x", t->list->nonce[i]);
+
+	char *hex = hash_name(t->list->hash_algo, current_file(t)->hash);
+	char name[sizeof(".incoming--.stripes") + HASH_NAME_BYTES +
+		  sizeof(nonce)];
+	if (progress)
+		snprintf(name, sizeof(name), ".incoming-%s-%s.stripes", hex,
+			 nonce);
+	else
+		snprintf(name, sizeof(name), "incoming-%s-%s", hex, nonce);
+	free(hex);
 
-		err = gcry_cipher_decrypt(t->hd, rx_buf, CHUNK_SIZE, NULL, 0);
-		g_error(err);
+	return concat_paths(t->client_dir, name);
+}
 
-		total_read += CHUNK_SIZE;
+/*
+ * Open the temp file shared by every stripe of the current file and
+ * start receiving at the start of this connection's range
+ */
+static void receive_stripe_begin(transfer_ctx *t)
+{
+	data_node *node = current_file(t);
+	uint64_t offset, len;
+	datalist_stripe_range(t->list, &offset, &len);
 
-		// Last chunk is handled here
-		if (bytes_left < CHUNK_SIZE)
-			fwrite_size = bytes_left;
+	t->tmp_name = stripe_path(t, false);
+	int fd = open(t->tmp_name, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		log_msg(LEVEL_ERROR, "open stripe: %s", strerror(errno));
+		t->rejected = true;
+		return;
+	}
 
-		gcry_md_write(hash_hd, rx_buf, fwrite_size);
-		fwrite(rx_buf, 1, fwrite_size, fp);
-		bytes_left -= CHUNK_SIZE;
+	t->size = node->size;
+	t->out = out_open(fd, t->size);
+	t->total_read = offset;
+	t->range_end = offset + len;
+	if (NULL == t->out) {
+		reject_unstorable(t);
+		return;
 	}
 
-	fprintf(stdout, "Integrity checking %s's file: %s...\n", t->client_id,
-		node->name);
+	log_msg(LEVEL_INFO, "Receiving %s's file: %s (stripe %d of %d)...",
+		t->client_id, node->name, t->list->stripe + 1,
+		t->list->stripes);
+}
 
-	//  Validate the received contents
-	uint8_t *actual_hash = gcry_md_read(hash_hd, HASH_ALGO);
-	bool matches = hash_matches(actual_hash, node->hash, tmp_name);
-	gcry_md_close(hash_hd);
+/*
+ * Record that this connection's range of the current file has been
+ * written. The stripes done so far are tracked in a dotfile next to the
+ * temp file, one byte per stripe, under a lock shared with the other
+ * connections. Whichever connection completes the last range validates
+ * and stores the whole file. Returns the transfer status of the range,
+ * or of the whole file for the last range.
+ */
+static uint8_t receive_stripe_end(transfer_ctx *t)
+{
+	data_node *node = current_file(t);
+	uint8_t stripes = t->list->stripes;
+	uint8_t done[MAX_STRIPES];
+
+	out_close(t->out);
+	t->out = NULL;
+
+	char *progress = stripe_path(t, true);
+
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+
+	int fd = open(progress, O_RDWR | O_CREAT, 0600);
+	if (fd == -1 || fcntl(fd, F_SETLKW, &lock) == -1) {
+		log_msg(LEVEL_ERROR, "lock stripe progress: %s",
+			strerror(errno));
+		if (fd != -1)
+			close(fd);
+		free(progress);
+		t->rejected = true;
+		return receive_abort(t);
+	}
 
-	if (!matches) {
-		fprintf(stderr,
-			"%s's file, %s failed integrity check\nConnection "
-			"terminated\n",
+	// Only a bad client gives one attempt different stripe counts
+	memset(done, 0, sizeof(done));
+	if (pread(fd, done, MAX_STRIPES, 0) != stripes) {
+		memset(done, 0, sizeof(done));
+		ftruncate(fd, 0);
+	}
+
+	done[t->list->stripe] = 1;
+	pwrite(fd, done, stripes, 0);
+
+	bool last = true;
+	for (int i = 0; i < stripes; i++)
+		last = last && done[i];
+
+	uint8_t status = TRANSFER_Y;
+	if (last) {
+		log_msg(LEVEL_INFO, "Integrity checking %s's file: %s...",
 			t->client_id, node->name);
-		return TRANSFER_N;
+
+		unlink(progress);
+		uint64_t start = stats_start(t->st);
+		bool matches = stored_hash_matches(
+		    t->tmp_name, node->size, node->hash, t->list->hash_algo);
+		stats_add(t->st, t->cur, STAT_HASH, node->size, start);
+		if (matches && !save_files(t->tmp_name, node, t)) {
+			unlink(t->tmp_name);
+			t->rejected = true;
+			status = TRANSFER_N;
+		} else if (matches) {
+			log_msg(LEVEL_INFO,
+				"%s's file %s successfully transfered",
+				t->client_id, node->name);
+		} else {
+			unlink(t->tmp_name);
+			log_msg(LEVEL_WARN,
+				"%s's file, %s failed integrity check",
+				t->client_id, node->name);
+			metrics_add(METRIC_INTEGRITY, 1);
+			status = TRANSFER_N;
+		}
 	}
 
-	fprintf(stdout, "%s's file %s integrity check passed\n", t->client_id,
-		node->name);
-	fclose(fp);
+	close(fd); // Releases the lock
+	free(progress);
+	free(t->tmp_name);
+	t->tmp_name = NULL;
+	return status;
+}
 
-	// Temp file renamed to actual name and create the meta file
-	save_files(tmp_name, node, t->client_id);
-	fprintf(stdout, "%s's file %s successfully transfered\n", t->client_id,
-		node->name);
+/*
+ * Returns true if the client compresses chunks, every frame then starts
+ * with a prefix giving its length
+ */
+static bool compressed(transfer_ctx *t)
+{
+	return (t->list->flags & FLAG_COMPRESS) != 0;
+}
 
-	return TRANSFER_Y;
+/*
+ * Returns true if the client sends every file as one stream of chunks,
+ * split back into files here
+ */
+static bool packed(transfer_ctx *t)
+{
+	return (t->list->flags & FLAG_PACK) != 0;
 }
 
+static void pack_deliver(transfer_ctx *t, uint8_t *plain, uint32_t len);
+
 /*
- * Read either the initial transfer header or a file to disk
- * depending on the given context.
+ * Queue a response for a file of a packed transfer
  */
-static void read_from_client(int socketfd, transfer_ctx *t)
+static void outbox_add(transfer_ctx *t, uint8_t *response, uint32_t len)
 {
-	uint8_t response[RETURN_SIZE];
-	memset(response, 0, RETURN_SIZE);
-	uint8_t status = 0;
+	if (t->outbox_len + len > t->outbox_cap) {
+		t->outbox_cap = 2 * (t->outbox_len + len);
+		t->outbox = realloc(t->outbox, t->outbox_cap);
+		if (NULL == t->outbox)
+			mem_error();
+	}
 
-	if (t->list == NULL) {
-		fprintf(stdout, "Validating %s's transfer request...\n",
-			t->client_id);
-		uint8_t *header = read_initial_header(socketfd, t);
+	memcpy(t->outbox + t->outbox_len, response, len);
+	t->outbox_len += len;
+}
 
-		// Client wants to burn their key
-		if (header == NULL) {
-			t->list = datalist_init(NULL);
-			t->cur = t->list->size + 1;
-			return;
-		}
+/*
+ * Send the queued responses for files of a packed transfer
+ */
+static void flush_outbox(int cfd, transfer_ctx *t)
+{
+	if (t->outbox_len > 0)
+		write_all(cfd, t->outbox, t->outbox_len);
+	t->outbox_len = 0;
+}
 
-		t->list = header_parse(header);
-		free(header);
+/*
+ * Returns true if the client only sends the chunks of each file that
+ * the server is missing
+ */
+static bool deduped(transfer_ctx *t)
+{
+	return (t->list->flags & FLAG_DEDUPE) != 0;
+}
 
-		t->cur = datalist_get_next_active(t->list, t->cur);
-		if (t->cur > t->list->size) {
-			fprintf(stdout,
-				"Client %s, all files exist. Transfer request "
-				"denied\n",
-				t->client_id);
-			return; // All files are duplicates off the bat
-		}
+/*
+ * Returns true if a recipe with the given number of chunks can describe
+ * the current file. The transfer is refused otherwise.
+ */
+static bool recipe_count_valid(transfer_ctx *t, uint32_t count)
+{
+	data_node *node = current_file(t);
+	if (NULL == node)
+		return false;
 
-		fprintf(stdout, "%s's transfer request accepted\n",
-			t->client_id);
-		t->hd = init_cipher_context(t->list->vector, t->key);
-	} else {
-		status = receive_file(socketfd, t);
-		t->cur = datalist_get_next_active(t->list, t->cur);
+	// The entries of the largest recipes wouldn't fit one buffer
+	if (count <= recipe_max_count(node->size) &&
+	    count <= UINT32_MAX / RECIPE_ENTRY_SIZE)
+		return true;
+
+	log_msg(LEVEL_WARN, "%s's file, %s has an invalid recipe", t->client_id,
+		node->name);
+	t->rejected = true;
+	return false;
+}
+
+/*
+ * Parse the recipe of the current file and find the chunks missing from
+ * the client's chunk store, only those are sent. Returns false and
+ * refuses the transfer when the chunks don't cover the file.
+ */
+static bool accept_recipe(transfer_ctx *t, uint8_t *entries, uint32_t count)
+{
+	data_node *node = current_file(t);
+
+	t->recipe = recipe_parse(entries, count, node->size);
+	if (NULL == t->recipe) {
+		log_msg(LEVEL_WARN, "%s's file, %s has an invalid recipe",
+			t->client_id, node->name);
+		t->rejected = true;
+		return false;
 	}
 
-	uint16_t client_sends = htons(t->cur);
-	memcpy(response, &client_sends, sizeof(uint16_t));
-	response[RETURN_SIZE - 1] = status;
+	if (NULL == t->chunk_dir) {
+		t->chunk_dir = concat_paths(t->client_dir, CHUNKS_DIR);
+		ensure_dir(t->chunk_dir);
+	}
 
-	write_all(socketfd, response, RETURN_SIZE);
+	chunkstore_find_missing(t->chunk_dir, t->recipe);
+	return true;
 }
 
 /*
- * Handle an incoming client connection. We will ensure they have a
- * directory for files, and a valid key before receiving any files
+ * Returns true if the client resumes files the server has part of
  */
-static void handle_conn(int cfd, transfer_ctx *t)
+static bool resumable(transfer_ctx *t)
 {
-	uint8_t failure[RETURN_SIZE];
+	return (t->list->flags & FLAG_RESUME) != 0;
+}
 
-	// Ensure the client has a valid key on the server
-	char *key_location = concat_paths(KEYS_DIR, t->client_id);
+/*
+ * Open the temp file the current file is kept in between attempts,
+ * carrying the digest on from the data already there. Returns the
+ * descriptor, or -1 when the file is being received by another
+ * connection or what is kept doesn't match the resume offset.
+ */
+static int open_partial(transfer_ctx *t)
+{
+	data_node *node = current_file(t);
+	char *name = partial_name(t->list->hash_algo, node->hash, node->size);
+	char *path = concat_paths(t->client_dir, name);
+	free(name);
 
-	t->key = read_key(key_location);
-	if (t->key == NULL) {
-		memset(failure, 0, RETURN_SIZE);
-		write_all(cfd, failure, RETURN_SIZE);
-		free(key_location);
+	int fd = partial_open(path, node->size, node->resume, t->md);
+	if (fd == -1) {
+		free(path);
+		return -1;
+	}
+
+	// A second descriptor keeps the lock until the file is stored
+	t->tmp_name = path;
+	t->partial_fd = dup(fd);
+	return fd;
+}
+
+/*
+ * Prepare to receive the file at the current index of the transfer
+ * context. Incoming data is written to a temp file in the clients
+ * directory until the contents are validated against the expected hash.
+ */
+static void receive_begin(transfer_ctx *t)
+{
+	data_node *node = current_file(t);
+	if (NULL == node)
+		return;
+
+	if (striped(t)) {
+		receive_stripe_begin(t);
 		return;
 	}
 
-	// Ensure the client has a directory for their files
-	char *client_path = concat_paths(RECV_DIR, t->client_id);
-	ensure_dir(client_path);
+	// Only the missing chunks of a deduplicated file are sent, they are
+	// hashed once the file is assembled
+	if (NULL == t->recipe)
+		t->md = acquire_md(t->list->hash_algo);
 
-	// Work from the clients directory to make fs work easier
-	int err = chdir(client_path);
-	if (err == -1) {
-		perror("chdir to client hashes");
-		exit(EXIT_FAILURE);
+	t->size = NULL != t->recipe ? t->recipe->missing_len : node->size;
+	t->total_read = resumable(t) ? node->resume : 0;
+	t->range_end = t->size;
+
+	int fd = resumable(t) ? open_partial(t) : -1;
+	if (fd == -1 && t->total_read > 0) {
+		// The client sends from the offset, what came before is gone
+		log_msg(LEVEL_WARN, "%s's file, %s can no longer be resumed",
+			t->client_id, node->name);
+		t->rejected = true;
+		return;
 	}
 
-	while (t->list == NULL || t->cur <= t->list->size)
-		read_from_client(cfd, t);
+	if (fd == -1) {
+		// Read into a temp file because the hash isn't validated
+		t->tmp_name = concat_paths(t->client_dir, "incoming-XXXXXX");
+		fd = mkstemp(t->tmp_name);
+		if (fd == -1) {
+			log_msg(LEVEL_ERROR, "mkstemp: %s", strerror(errno));
+			free(t->tmp_name);
+			t->tmp_name = NULL;
+			t->rejected = true;
+			return;
+		}
+	}
 
-	gcry_cipher_close(t->hd);
-	datalist_destroy(t->list);
-	free(client_path);
-	free(key_location);
-	free(t->key);
+	t->out = out_open(fd, t->size);
+	if (NULL == t->out) {
+		reject_unstorable(t);
+		return;
+	}
 
-	if (t->burn == NO_BURN)
-		fprintf(stdout, "%s's transfer complete\n", t->client_id);
+	if (t->total_read == 0)
+		log_msg(LEVEL_INFO, "Receiving %s's file: %s...", t->client_id,
+			node->name);
+	else
+		log_msg(LEVEL_INFO,
+			"Resuming %s's file: %s at %" PRIu64 " bytes...",
+			t->client_id, node->name, t->total_read);
 }
 
 /*
- * Continually accept incoming connections until interrupted
+ * Returns true while chunks of the current file are still expected
  */
-static void accept_connection(int socketfd)
+static bool receive_pending(transfer_ctx *t)
 {
-	pid_t pid;
-	char *ip_port;
+	return t->total_read < t->range_end && !t->rejected;
+}
 
-	while (!TERMINATED) {
-		// Structs for storing the sender's address and port
+/*
+ * Refuse the rest of the current file after the chunk at the current
+ * offset failed authentication
+ */
+static void reject_chunk(transfer_ctx *t)
+{
+	log_msg(LEVEL_WARN, "%s's file, %s has a corrupt chunk at %" PRIu64,
+		t->client_id, current_file(t)->name, t->total_read);
+	t->rejected = true;
+	metrics_add(METRIC_INTEGRITY, 1);
+}
+
+/*
+ * Record how much of a resumable file has been received every
+ * CHECKPOINT_INTERVAL bytes, so a server that is killed can resume it
+ */
+static void checkpoint_progress(transfer_ctx *t)
+{
+	if (t->partial_fd != -1 && t->total_read < t->size &&
+	    t->total_read % CHECKPOINT_INTERVAL == 0)
+		partial_checkpoint(t->tmp_name, t->size, t->total_read, t->md);
+}
+
+/*
+ * Return the number of bytes of contents in the next chunk of the
+ * current file, or of the stream of a packed transfer. Only the last
+ * chunk is short.
+ */
+static uint32_t chunk_contents(transfer_ctx *t)
+{
+	uint32_t chunk_size = t->list->chunk_size;
+	uint64_t bytes_left = t->size - t->total_read;
+	if (packed(t))
+		bytes_left = t->pack_size - t->pack_read;
+
+	return bytes_left < chunk_size ? bytes_left : chunk_size;
+}
+
+/*
+ * Return the file index the next chunk is encrypted under, 0 for the
+ * stream of a packed transfer which no file uses
+ */
+static uint32_t chunk_idx(transfer_ctx *t)
+{
+	return packed(t) ? 0 : t->cur;
+}
+
+/*
+ * Return the offset the next chunk is encrypted at, in the current
+ * file or the stream of a packed transfer
+ */
+static uint64_t chunk_offset(transfer_ctx *t)
+{
+	return packed(t) ? t->pack_read : t->total_read;
+}
+
+/*
+ * Hash and write the next decrypted chunk of the current file. Tree
+ * hashes may pass the chunk's leaves when they were already hashed,
+ * NULL hashes the contents here.
+ */
+static void receive_plain(transfer_ctx *t, uint8_t *plain, uint8_t *leaves)
+{
+	uint32_t fwrite_size = chunk_contents(t);
+
+	// Stripes are hashed once every range has arrived
+	uint64_t start = stats_start(t->st);
+	if (NULL != t->md && NULL != leaves)
+		digest_add_leaves(t->md, leaves, fwrite_size);
+	else if (NULL != t->md)
+		digest_write(t->md, plain, fwrite_size);
+	if (NULL != t->md)
+		stats_add(t->st, t->cur, STAT_HASH, fwrite_size, start);
+
+	start = stats_start(t->st);
+	out_write(t->out, t->total_read, plain, fwrite_size);
+	stats_add(t->st, t->cur, STAT_WRITE, fwrite_size, start);
+	t->total_read += t->list->chunk_size;
+	checkpoint_progress(t);
+}
+
+/*
+ * Decrypt a whole chunk straight into the mapped output file, saving a
+ * copy. Returns false when the chunk has to go through a buffer: it is
+ * the last, partial chunk, must be authenticated before it is stored, or
+ * the file isn't mapped.
+ */
+static bool receive_direct(transfer_ctx *t, uint8_t *rx_buf)
+{
+	uint8_t suite = t->list->suite;
+	uint32_t chunk_size = t->list->chunk_size;
+	if (suite == CIPHER_GCM || packed(t) ||
+	    t->size - t->total_read < chunk_size)
+		return false;
+
+	uint8_t *dst = out_window(t->out, t->total_read, chunk_size);
+	if (NULL == dst)
+		return false;
+
+	uint64_t start = stats_start(t->st);
+	cipher_seek(t->hd, suite, t->list->vector, t->cur, t->total_read,
+		    chunk_size);
+	gcry_error_t err =
+	    gcry_cipher_decrypt(t->hd, dst, chunk_size, rx_buf, chunk_size);
+	g_error(err);
+	stats_add(t->st, t->cur, STAT_DECRYPT, chunk_size, start);
+
+	if (NULL != t->md) {
+		start = stats_start(t->st);
+		digest_write(t->md, dst, chunk_size);
+		stats_add(t->st, t->cur, STAT_HASH, chunk_size, start);
+	}
+
+	t->total_read += chunk_size;
+	checkpoint_progress(t);
+	return true;
+}
+
+/*
+ * Decrypt, decompress, hash and write one encrypted chunk frame of the
+ * current file, or of the stream of a packed transfer. Returns false
+ * when the chunk fails authentication or doesn't decompress, nothing
+ * more of the file is accepted then.
+ */
+static bool receive_chunk(transfer_ctx *t, uint8_t *rx_buf)
+{
+	uint8_t suite = t->list->suite;
+	uint32_t chunk_size = t->list->chunk_size;
+	uint8_t *data = rx_buf;
+	uint32_t prefix = 0;
+
+	if (compressed(t)) {
+		prefix = frame_prefix(rx_buf);
+		data += FRAME_PREFIX_BYTES;
+	}
+
+	uint32_t len = frame_cipher_size(prefix, chunk_size);
+	if (suite == CIPHER_CBC)
+		memcpy(t->chain, data + len - AES_BLOCKSIZE, AES_BLOCKSIZE);
+
+	if (prefix == 0 && receive_direct(t, data))
+		return true;
+
+	uint64_t start = stats_start(t->st);
+	cipher_seek(t->hd, suite, t->list->vector, chunk_idx(t),
+		    chunk_offset(t), chunk_size);
+	if (compressed(t))
+		frame_authenticate(t->hd, suite, rx_buf);
+
+	if (!decrypt_chunk(t->hd, suite, data, len)) {
+		reject_chunk(t);
+		return false;
+	}
+
+	if (prefix != 0 && NULL == t->plain)
+		t->plain = aligned_buffer(chunk_size);
+
+	uint32_t contents = chunk_contents(t);
+	if (prefix != 0 && !inflate_chunk(data, prefix & ~FRAME_COMPRESSED,
+					  t->plain, contents)) {
+		reject_chunk(t);
+		return false;
+	}
+	stats_add(t->st, chunk_idx(t), STAT_DECRYPT, len, start);
+
+	if (prefix != 0)
+		data = t->plain;
+
+	if (packed(t))
+		pack_deliver(t, data, contents);
+	else
+		receive_plain(t, data, NULL);
+	return true;
+}
+
+/*
+ * Move the decrypted contents of a compressed transfer's chunk frame to
+ * the start of the frame, inflating them through the given scratch
+ * buffer when compressed. Returns false when they don't decompress to
+ * the chunk's len bytes.
+ */
+static bool unframe_chunk(uint8_t *frame, uint32_t len, uint8_t *scratch)
+{
+	uint32_t prefix = frame_prefix(frame);
+	uint8_t *data = frame + FRAME_PREFIX_BYTES;
+
+	if (prefix == 0) {
+		memmove(frame, data, len);
+		return true;
+	}
+
+	if (!inflate_chunk(data, prefix & ~FRAME_COMPRESSED, scratch, len))
+		return false;
+
+	memcpy(frame, scratch, len);
+	return true;
+}
+
+/*
+ * Return the connection's buffer for a whole chunk frame, prefix and
+ * tag included
+ */
+static uint8_t *frame_buffer(transfer_ctx *t)
+{
+	if (NULL == t->frame)
+		t->frame = aligned_buffer(
+		    FRAME_PREFIX_BYTES +
+		    chunk_frame_size(t->list->suite, t->list->chunk_size));
+
+	return t->frame;
+}
+
+/*
+ * Read the next chunk frame of the current file into the given buffer.
+ * Frames of a compressed transfer are as long as their prefix says.
+ * Returns false when the client hung up or sent a frame no client
+ * would.
+ */
+static bool recv_frame(int cfd, transfer_ctx *t, uint8_t *buf)
+{
+	uint8_t suite = t->list->suite;
+	uint32_t chunk_size = t->list->chunk_size;
+	uint32_t len = chunk_frame_size(suite, chunk_size);
+	uint64_t start = stats_start(t->st);
+	bool got;
+
+	if (!compressed(t)) {
+		got = recv_all(cfd, buf, len) > 0;
+	} else if (recv_all(cfd, buf, FRAME_PREFIX_BYTES) <= 0) {
+		got = false;
+	} else {
+		len = frame_payload_size(suite, frame_prefix(buf), chunk_size);
+		got = len > 0 &&
+		      recv_all(cfd, buf + FRAME_PREFIX_BYTES, len) > 0;
+		len += FRAME_PREFIX_BYTES;
+	}
+
+	if (got)
+		stats_add(t->st, chunk_idx(t), STAT_RECV, len, start);
+	return got;
+}
+
+/*
+ * Decrypt received chunks in whatever order they are claimed. Each
+ * chunk carries what its decryption depends on: the previous chunk's
+ * last ciphertext block for CBC, its offset otherwise. Leaves of a tree
+ * hash are hashed here too, so they are spread over the threads.
+ */
+static void *decrypt_stage(void *arg)
+{
+	rx_worker *w = arg;
+	transfer_ctx *t = w->t;
+	uint8_t suite = t->list->suite;
+	uint32_t chunk_size = t->list->chunk_size;
+	uint32_t head = compressed(t) ? FRAME_PREFIX_BYTES : 0;
+	ring_slot *s;
+
+	uint8_t *z_buf = NULL;
+	if (head > 0)
+		z_buf = aligned_buffer(chunk_size);
+
+	while ((s = ring_claim(w->r, STAGE_DECRYPT)) != NULL) {
+		uint64_t start = stats_start(t->st);
+		if (suite == CIPHER_CBC) {
+			gcry_error_t err =
+			    gcry_cipher_setiv(w->hd, s->iv, AES_BLOCKSIZE);
+			g_error(err);
+		} else {
+			cipher_seek(w->hd, suite, t->list->vector,
+				    chunk_idx(t), s->offset, chunk_size);
+		}
+
+		uint32_t prefix = 0;
+		if (head > 0) {
+			prefix = frame_prefix(s->data);
+			frame_authenticate(w->hd, suite, s->data);
+		}
+
+		s->ok = decrypt_chunk(w->hd, suite, s->data + head,
+				      frame_cipher_size(prefix, chunk_size));
+		if (s->ok && head > 0)
+			s->ok = unframe_chunk(s->data, s->len, z_buf);
+		stats_add(t->st, chunk_idx(t), STAT_DECRYPT, s->len, start);
+
+		if (s->ok && w->leaves) {
+			start = stats_start(t->st);
+			tree_leaves(s->data, s->len, s->leaves);
+			stats_add(t->st, chunk_idx(t), STAT_HASH, s->len,
+				  start);
+		}
+		ring_release(w->r, s, STAGE_DECRYPT);
+	}
+
+	free(z_buf);
+	return NULL;
+}
+
+/*
+ * Hash and write decrypted chunks in order, stopping the pipeline at
+ * the first chunk that failed authentication. The responses for files
+ * of a packed stream are sent as each one is finished.
+ */
+static void *write_stage(void *arg)
+{
+	rx_worker *w = arg;
+	transfer_ctx *t = w->t;
+	ring_slot *s;
+
+	while ((s = ring_claim(w->r, STAGE_WRITE)) != NULL) {
+		if (!s->ok) {
+			reject_chunk(t);
+			ring_close(w->r);
+			break;
+		}
+
+		if (packed(t)) {
+			pack_deliver(t, s->data, s->len);
+			flush_outbox(w->cfd, t);
+		} else {
+			receive_plain(t, s->data, w->leaves ? s->leaves : NULL);
+		}
+		ring_release(w->r, s, STAGE_WRITE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Receive the rest of the current file, or of a packed stream, through
+ * a pipeline: this thread reads frames off the socket into a ring of
+ * buffers, decryption threads work on them in parallel and a writer
+ * hashes and stores them in order. Returns false, having received
+ * nothing, when the threads can't be started.
+ */
+static bool receive_pipelined(int cfd, transfer_ctx *t)
+{
+	uint8_t suite = t->list->suite;
+	uint32_t chunk_size = t->list->chunk_size;
+	uint32_t head = compressed(t) ? FRAME_PREFIX_BYTES : 0;
+	uint32_t frame_size = head + chunk_frame_size(suite, chunk_size);
+	uint64_t offset = t->total_read;
+	uint64_t size = t->size;
+	uint64_t end = t->range_end;
+	if (packed(t)) {
+		offset = t->pack_read;
+		size = end = t->pack_size;
+	}
+
+	uint64_t chunks = (end - offset + chunk_size - 1) / chunk_size;
+	bool lost = false;
+
+	// Leaves are only hashed with the chunks when the chunks line up
+	// with them, never in a packed stream
+	bool leaves = !packed(t) && NULL != t->md &&
+		      t->md->algo == HASH_TREE &&
+		      chunk_size % TREE_LEAF_SIZE == 0 &&
+		      offset % TREE_LEAF_SIZE == 0;
+
+	ring *r = ring_init(RX_SLOTS_PER_THREAD * decrypt_threads, frame_size,
+			    RX_STAGES);
+	ring_set_end(r, chunks);
+
+	// Only frames of a known size can be received ahead in a batch
+	uring *u = NULL;
+	if (batched && head == 0 && (u = uring_init()) != NULL)
+		uring_register_files(u, &cfd, 1);
+
+	// Handles are taken from the process's pool before any thread runs
+	rx_worker writer = {
+	    .t = t, .r = r, .hd = NULL, .cfd = cfd, .leaves = leaves};
+	rx_worker decrypters[MAX_DECRYPT_THREADS];
+	int started;
+	bool running = true;
+	for (started = 0; started < decrypt_threads; started++) {
+		rx_worker *d = &decrypters[started];
+		d->t = t;
+		d->r = r;
+		d->leaves = leaves;
+		d->hd = acquire_cipher(t->list->vector, t->key, suite);
+		if (pthread_create(&d->thread, NULL, decrypt_stage, d) != 0) {
+			release_cipher(d->hd, suite);
+			running = false;
+			break;
+		}
+	}
+	running = running &&
+		  pthread_create(&writer.thread, NULL, write_stage, &writer) == 0;
+
+	// The threads that did start stop once the ring is closed
+	if (!running) {
+		log_msg(LEVEL_ERROR, "pthread_create: receiving %s's file serially",
+			t->client_id);
+		ring_close(r);
+		for (int i = 0; i < started; i++) {
+			pthread_join(decrypters[i].thread, NULL);
+			release_cipher(decrypters[i].hd, suite);
+		}
+		ring_destroy(r);
+		if (NULL != u)
+			uring_destroy(u);
+		return false;
+	}
+
+	ring_slot *batch[URING_BATCH];
+	struct iovec frames[URING_BATCH];
+	ring_slot *s;
+	while ((s = ring_claim(r, STAGE_RECV)) != NULL) {
+		// Free slots are filled with one submission
+		int n = 0;
+		while (NULL != s) {
+			frames[n].iov_base = s->data;
+			frames[n].iov_len = frame_size;
+			batch[n++] = s;
+
+			s = NULL;
+			if (NULL != u && n < URING_BATCH)
+				s = ring_try_claim(r, STAGE_RECV);
+		}
+
+		bool got = NULL == u && recv_frame(cfd, t, batch[0]->data);
+		if (NULL != u) {
+			uint64_t start = stats_start(t->st);
+			int bytes = recv_batch(u, cfd, frames, n);
+			got = bytes > 0;
+			if (got)
+				stats_add(t->st, chunk_idx(t), STAT_RECV,
+					  bytes, start);
+		}
+		if (!got) {
+			lost = true;
+			ring_close(r);
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			s = batch[i];
+			s->offset = offset;
+			s->len = chunk_size;
+			if (size - offset < chunk_size)
+				s->len = size - offset;
+			offset += chunk_size;
+
+			uint32_t prefix = head > 0 ? frame_prefix(s->data) : 0;
+			uint8_t *last = s->data + head +
+					frame_cipher_size(prefix, chunk_size);
+			memcpy(s->iv, t->chain, AES_BLOCKSIZE);
+			memcpy(t->chain, last - AES_BLOCKSIZE, AES_BLOCKSIZE);
+			ring_release(r, s, STAGE_RECV);
+		}
+	}
+
+	if (NULL != u)
+		uring_destroy(u);
+	pthread_join(writer.thread, NULL);
+	for (int i = 0; i < decrypt_threads; i++) {
+		pthread_join(decrypters[i].thread, NULL);
+		release_cipher(decrypters[i].hd, suite);
+	}
+	ring_destroy(r);
+
+	// The connection's own context carries on the chain for later files
+	if (suite == CIPHER_CBC) {
+		gcry_error_t err =
+		    gcry_cipher_setiv(t->hd, t->chain, AES_BLOCKSIZE);
+		g_error(err);
+	}
+
+	if (lost)
+		t->rejected = true;
+	return true;
+}
+
+/*
+ * Drop what was received of a file with a rejected chunk, or that the
+ * client stopped sending. A resumable file is kept with a checkpoint of
+ * the chunks received before it. A rejected stripe leaves the shared
+ * temp file incomplete, so the file is never stored. Returns the
+ * transfer status for the file.
+ */
+static uint8_t receive_abort(transfer_ctx *t)
+{
+	if (NULL != t->out) {
+		out_close(t->out);
+		t->out = NULL;
+	}
+
+	if (t->partial_fd != -1) {
+		partial_checkpoint(t->tmp_name, t->size, t->total_read, t->md);
+		close(t->partial_fd); // Releases the lock
+		t->partial_fd = -1;
+	} else if (!striped(t) && NULL != t->tmp_name) {
+		unlink(t->tmp_name);
+	}
+
+	if (NULL != t->md) {
+		release_md(t->md);
+		t->md = NULL;
+	}
+
+	if (NULL != t->recipe) {
+		recipe_destroy(t->recipe);
+		t->recipe = NULL;
+	}
+
+	free(t->tmp_name);
+	t->tmp_name = NULL;
+	return TRANSFER_N;
+}
+
+/*
+ * Add the chunks received for a deduplicated file to the chunk store
+ * and assemble the file from the store into a new temp file, hashing
+ * it on the way. Returns false when a chunk is corrupt or missing, or
+ * refuses the transfer when there is no temp file to assemble it in.
+ */
+static bool assemble_file(transfer_ctx *t)
+{
+	int stream = open(t->tmp_name, O_RDONLY);
+	bool ok = stream != -1 &&
+		  chunkstore_store(t->chunk_dir, t->recipe, stream);
+	if (stream != -1)
+		close(stream);
+	unlink(t->tmp_name);
+	free(t->tmp_name);
+
+	t->tmp_name = concat_paths(t->client_dir, "incoming-XXXXXX");
+	int fd = mkstemp(t->tmp_name);
+	if (fd == -1) {
+		log_msg(LEVEL_ERROR, "mkstemp: %s", strerror(errno));
+		free(t->tmp_name);
+		t->tmp_name = NULL;
+		t->rejected = true;
+		return false;
+	}
+
+	t->md = acquire_md(t->list->hash_algo);
+	ok = ok && chunkstore_assemble(t->chunk_dir, t->recipe, fd, t->md);
+	close(fd);
+
+	recipe_destroy(t->recipe);
+	t->recipe = NULL;
+	return ok;
+}
+
+/*
+ * Validate the file received since receive_begin against its expected
+ * hash and store it. Returns the transfer status for the file.
+ */
+static uint8_t receive_end(transfer_ctx *t)
+{
+	if (t->rejected)
+		return receive_abort(t);
+
+	data_node *node = current_file(t);
+
+	if (striped(t))
+		return receive_stripe_end(t);
+
+	log_msg(LEVEL_INFO, "Integrity checking %s's file: %s...", t->client_id,
+		node->name);
+
+	out_close(t->out);
+	t->out = NULL;
+
+	if (NULL != t->recipe && !assemble_file(t)) {
+		if (t->rejected)
+			return receive_abort(t);
+
+		log_msg(LEVEL_WARN, "%s's file, %s has a corrupt chunk",
+			t->client_id, node->name);
+		metrics_add(METRIC_INTEGRITY, 1);
+		return receive_abort(t);
+	}
+
+	//  Validate the received contents
+	uint8_t *actual_hash = digest_final(t->md);
+	bool matches = hash_matches(actual_hash, node->hash,
+				    hash_bytes(t->list->hash_algo), t->tmp_name);
+	release_md(t->md);
+	t->md = NULL;
+
+	uint8_t status = TRANSFER_N;
+	if (!matches) {
+		log_msg(LEVEL_WARN,
+			"%s's file, %s failed integrity check, connection "
+			"terminated",
+			t->client_id, node->name);
+		metrics_add(METRIC_INTEGRITY, 1);
+	} else {
+		log_msg(LEVEL_INFO, "%s's file %s integrity check passed",
+			t->client_id, node->name);
+
+		// Temp file renamed to actual name and create the meta file
+		if (save_files(t->tmp_name, node, t)) {
+			log_msg(LEVEL_INFO,
+				"%s's file %s successfully transfered",
+				t->client_id, node->name);
+			status = TRANSFER_Y;
+		} else {
+			unlink(t->tmp_name);
+			t->rejected = true;
+		}
+	}
+
+	// The kept file is gone either way, renamed or removed
+	if (t->partial_fd != -1) {
+		partial_forget(t->tmp_name);
+		close(t->partial_fd); // Releases the lock
+		t->partial_fd = -1;
+	}
+
+	free(t->tmp_name);
+	t->tmp_name = NULL;
+	return status;
+}
+
+/*
+ * Read the recipe of the current file and answer with the bitmap of
+ * the chunks the client has to send. Returns false when the recipe is
+ * invalid or the client hung up.
+ */
+static bool receive_recipe(int cfd, transfer_ctx *t)
+{
+	uint8_t count_buf[RECIPE_COUNT_BYTES];
+	if (recv_all(cfd, count_buf, RECIPE_COUNT_BYTES) <= 0) {
+		t->rejected = true;
+		return false;
+	}
+
+	uint32_t count = recipe_count(count_buf);
+	if (!recipe_count_valid(t, count))
+		return false;
+
+	uint8_t *entries = malloc(count * RECIPE_ENTRY_SIZE + 1);
+	if (NULL == entries)
+		mem_error();
+
+	bool ok = count == 0 ||
+		  recv_all(cfd, entries, count * RECIPE_ENTRY_SIZE) > 0;
+	if (!ok)
+		t->rejected = true;
+
+	ok = ok && accept_recipe(t, entries, count);
+	free(entries);
+
+	if (ok)
+		write_all(cfd, t->recipe->missing,
+			  recipe_bitmap_size(t->recipe));
+	return ok;
+}
+
+/*
+ * Receive a file at the current index of the transfer context.
+ * Incoming chunks of data for the file are hashed as they come in.
+ * Returns the transfer status for the given file.
+ */
+static uint8_t receive_file(int cfd, transfer_ctx *t)
+{
+	uint8_t *rx_buf = frame_buffer(t);
+
+	if (deduped(t) && !receive_recipe(cfd, t))
+		return receive_end(t);
+
+	receive_begin(t);
+
+	uint64_t chunks = (t->range_end - t->total_read) / t->list->chunk_size;
+	if (!t->rejected && decrypt_threads > 0 &&
+	    chunks >= PIPELINE_MIN_CHUNKS && receive_pipelined(cfd, t))
+		return receive_end(t);
+
+	while (receive_pending(t)) {
+		if (!recv_frame(cfd, t, rx_buf)) {
+			t->rejected = true; // Client hung up
+			break;
+		}
+
+		if (!receive_chunk(t, rx_buf))
+			break;
+	}
+
+	return receive_end(t);
+}
+
+/*
+ * Fill the given response with a file index and transfer status, in the
+ * header's protocol version. The index is the next file requested from
+ * the client, or the file the status belongs to when pipelining.
+ */
+static void make_response(transfer_ctx *t, uint32_t idx, uint8_t status,
+			  uint8_t *response)
+{
+	uint8_t version = t->list->version;
+	put_be(response, idx, files_bytes(version));
+	response[response_size(version) - 1] = status;
+}
+
+/*
+ * Returns true if the client sends files back-to-back
+ */
+static bool pipelined(transfer_ctx *t)
+{
+	return (t->list->flags & FLAG_PIPELINE) != 0;
+}
+
+/*
+ * Validate and store the current file of a packed transfer, queue its
+ * response and start on the next accepted file
+ */
+static void pack_next(transfer_ctx *t)
+{
+	uint8_t response[MAX_RETURN_SIZE];
+	uint32_t received = t->cur;
+
+	uint8_t status = receive_end(t);
+	t->cur = datalist_get_next_active(t->list, t->cur);
+
+	make_response(t, received, status, response);
+	outbox_add(t, response, response_size(t->list->version));
+
+	if (t->cur <= t->list->size && !t->rejected)
+		receive_begin(t);
+}
+
+/*
+ * Hand len bytes of a packed transfer's stream to the files they
+ * belong to, in order. Every file the bytes complete is finished, empty
+ * files included.
+ */
+static void pack_deliver(transfer_ctx *t, uint8_t *plain, uint32_t len)
+{
+	t->pack_read += len;
+
+	while (t->cur <= t->list->size && !t->rejected) {
+		uint32_t n = len;
+		if (t->size - t->total_read < n)
+			n = t->size - t->total_read;
+
+		if (n > 0) {
+			uint64_t start = stats_start(t->st);
+			digest_write(t->md, plain, n);
+			stats_add(t->st, t->cur, STAT_HASH, n, start);
+
+			start = stats_start(t->st);
+			out_write(t->out, t->total_read, plain, n);
+			stats_add(t->st, t->cur, STAT_WRITE, n, start);
+			t->total_read += n;
+			plain += n;
+			len -= n;
+		}
+
+		if (receive_pending(t))
+			break;
+		pack_next(t);
+	}
+}
+
+/*
+ * Start receiving the stream of a packed transfer: the contents of
+ * every accepted file from its resume offset, back-to-back. Files with
+ * nothing to send are finished straight away.
+ */
+static void pack_begin(transfer_ctx *t)
+{
+	t->pack_read = 0;
+	t->pack_size = 0;
+	for (data_node *n = t->list->first; n != NULL; n = n->next) {
+		if (n->transfer != TRANSFER_N)
+			t->pack_size += n->size - n->resume;
+	}
+
+	receive_begin(t);
+	pack_deliver(t, NULL, 0);
+}
+
+/*
+ * Returns true while chunks of a packed stream are still expected
+ */
+static bool pack_pending(transfer_ctx *t)
+{
+	return t->pack_read < t->pack_size && !t->rejected;
+}
+
+/*
+ * Receive every accepted file of a packed transfer, sending the
+ * response for each file as soon as it is finished. The file being
+ * received when the stream breaks off fails.
+ */
+static void receive_packed(int cfd, transfer_ctx *t)
+{
+	uint8_t *rx_buf = frame_buffer(t);
+	uint32_t chunk_size = t->list->chunk_size;
+
+	pack_begin(t);
+	flush_outbox(cfd, t);
+
+	uint64_t chunks = (t->pack_size + chunk_size - 1) / chunk_size;
+	if (t->rejected || decrypt_threads == 0 ||
+	    chunks < PIPELINE_MIN_CHUNKS || !receive_pipelined(cfd, t)) {
+		while (pack_pending(t)) {
+			if (!recv_frame(cfd, t, rx_buf)) {
+				t->rejected = true; // Client hung up
+				break;
+			}
+
+			bool ok = receive_chunk(t, rx_buf);
+			flush_outbox(cfd, t);
+			if (!ok)
+				break;
+		}
+	}
+
+	if (t->rejected && t->cur <= t->list->size)
+		pack_next(t);
+	flush_outbox(cfd, t);
+}
+
+/*
+ * Return a bitmap of the files the server will receive, the first
+ * file being the most significant bit of the first byte. The size
+ * of the bitmap is stored in len.
+ */
+static uint8_t *accepted_set(transfer_ctx *t, uint32_t *len)
+{
+	*len = (t->list->size + 7) / 8;
+	uint8_t *set = calloc(*len, 1);
+	if (NULL == set)
+		mem_error();
+
+	uint32_t i = 0;
+	for (data_node *n = t->list->first; n != NULL; n = n->next, i++) {
+		if (n->transfer != TRANSFER_N)
+			set[i / 8] |= 0x80 >> (i % 8);
+	}
+
+	return set;
+}
+
+/*
+ * Return the offset the client resumes each file from, as wide as the
+ * header's file sizes and in order, for the files kept from an earlier
+ * attempt. The offsets are also recorded in the list. The size of the
+ * table is stored in len.
+ */
+static uint8_t *resume_offsets(transfer_ctx *t, uint32_t *len)
+{
+	uint32_t width = size_bytes(t->list->version);
+	*len = t->list->size * width;
+	uint8_t *offsets = malloc(*len + 1);
+	if (NULL == offsets)
+		mem_error();
+
+	uint32_t i = 0;
+	for (data_node *n = t->list->first; n != NULL; n = n->next, i++) {
+		if (n->transfer != TRANSFER_N) {
+			char *name =
+			    partial_name(t->list->hash_algo, n->hash, n->size);
+			char *path = concat_paths(t->client_dir, name);
+			n->resume = partial_offset(path, n->size);
+			free(path);
+			free(name);
+		}
+
+		put_be(offsets + i * width, n->resume, width);
+	}
+
+	return offsets;
+}
+
+/*
+ * Receive the current file and move on to the next requested file.
+ * The response for the client is stored in the given buffer.
+ */
+static void receive_next(int cfd, transfer_ctx *t, uint8_t *response)
+{
+	uint32_t received = t->cur;
+	uint8_t status = receive_file(cfd, t);
+	t->cur = datalist_get_next_active(t->list, t->cur);
+
+	make_response(t, pipelined(t) ? received : t->cur, status, response);
+}
+
+/*
+ * Ensure the client has a valid key and a directory for files before
+ * receiving anything. The client is the owner named by a striped
+ * transfer header, or the connection's ip:port otherwise. Returns
+ * false when the client has no key, or a stripe isn't authenticated by
+ * the owner's key.
+ */
+static bool prepare_conn(uint8_t *header, transfer_ctx *t)
+{
+	// The owner names the key file, nothing is opened for a bad one
+	char *owner = header_stripe_owner(header);
+	if (NULL == owner && header_striped(header)) {
+		log_msg(LEVEL_WARN, "Stripe from %s names an invalid owner",
+			t->client_id);
+		metrics_add(METRIC_REJECTED, 1);
+		return false;
+	}
+
+	if (NULL != owner) {
+		free(t->client_id);
+		t->client_id = owner;
+	}
+
+	// Ensure the client has a valid key on the server
+	t->key = client_key(t->client_id);
+	if (t->key == NULL) {
+		metrics_add(METRIC_REJECTED, 1);
+		return false;
+	}
+
+	// Only the owner can send a stripe under its key and directory
+	if (NULL != owner && !header_stripe_authentic(header, t->key)) {
+		log_msg(LEVEL_WARN,
+			"Stripe for %s not authenticated by its key",
+			t->client_id);
+		metrics_add(METRIC_REJECTED, 1);
+		return false;
+	}
+
+	// Ensure the client has a directory for their files
+	t->client_dir = concat_paths(RECV_DIR, t->client_id);
+	ensure_dir(t->client_dir);
+
+	// Files of transfers never finished don't pile up
+	partial_expire(t->client_dir);
+	return true;
+}
+
+/*
+ * Handle an incoming client connection. We will ensure they have a
+ * directory for files, and a valid key before receiving any files
+ */
+static void handle_conn(int cfd, transfer_ctx *t)
+{
+	uint8_t response[MAX_RETURN_SIZE];
+	memset(response, 0, MAX_RETURN_SIZE);
+
+	log_msg(LEVEL_INFO, "Validating %s's transfer request...",
+		t->client_id);
+
+	// Client wants to burn their key when there is no header
+	uint8_t *header = read_initial_header(cfd, t);
+	if (header == NULL)
+		return;
+
+	// Clients without a key get an all zero response of their version
+	if (!prepare_conn(header, t)) {
+		write_all(cfd, response, response_size(header_version(header)));
+		free(header);
+		return;
+	}
+
+	bool accepted = accept_header(header, t);
+	free(header);
+
+	if (accepted) {
+		make_response(t, t->cur, 0, response);
+		write_all(cfd, response, response_size(t->list->version));
+	} else if (NULL == t->list) {
+		return; // Bad header
+	}
+
+	// Let a pipelining client know every file it should send
+	if (accepted && pipelined(t)) {
+		uint32_t set_len;
+		uint8_t *set = accepted_set(t, &set_len);
+		write_all(cfd, set, set_len);
+		free(set);
+	}
+
+	if (accepted && resumable(t)) {
+		uint32_t offsets_len;
+		uint8_t *offsets = resume_offsets(t, &offsets_len);
+		write_all(cfd, offsets, offsets_len);
+		free(offsets);
+	}
+
+	if (accepted && packed(t))
+		receive_packed(cfd, t);
+
+	// A rejected chunk ends the connection after its file's response
+	while (t->cur <= t->list->size && !t->rejected) {
+		receive_next(cfd, t, response);
+		write_all(cfd, response, response_size(t->list->version));
+	}
+
+	log_msg(LEVEL_INFO, "%s's transfer complete", t->client_id);
+}
+
+/*
+ * Continually accept incoming connections and serve them one at a
+ * time from this process until interrupted
+ */
+static void serve_connections(int socketfd)
+{
+	while (!TERMINATED) {
+		struct sockaddr_storage recv_addr;
+		memset(&recv_addr, 0, sizeof(recv_addr));
+		socklen_t recv_size = sizeof(recv_addr);
+
+		int recvfd =
+		    accept(socketfd, (struct sockaddr *)&recv_addr, &recv_size);
+		if (recvfd == -1) {
+			if (errno == EINTR)
+				break;
+
+			if (errno != EWOULDBLOCK)
+				log_msg(LEVEL_ERROR, "accept: %s",
+					strerror(errno));
+			continue;
+		}
+
+		char *ip_port = make_ip_port(&recv_addr, recv_size);
+		transfer_ctx *t = new_transfer_ctx(ip_port);
+
+		handle_conn(recvfd, t);
+
+		destroy_transfer_ctx(t);
+		close(recvfd);
+	}
+
+	close(socketfd);
+}
+
+/*
+ * Continually accept incoming connections until interrupted
+ */
+static void accept_connection(int socketfd)
+{
+	pid_t pid;
+	char *ip_port;
+
+	while (!TERMINATED) {
+		// Structs for storing the sender's address and port
 		struct sockaddr_storage recv_addr;
 		memset(&recv_addr, 0, sizeof(recv_addr));
 		socklen_t recv_size = sizeof(recv_addr);
@@ -384,13 +2035,14 @@ static void accept_connection(int socketfd)
 				break;
 
 			if (errno != EWOULDBLOCK)
-				perror("accept");
+				log_msg(LEVEL_ERROR, "accept: %s",
+					strerror(errno));
 			continue;
 		}
 
 		// Duplicate process and check for failure
 		if ((pid = fork()) == -1) {
-			perror("fork error");
+			log_msg(LEVEL_ERROR, "fork error: %s", strerror(errno));
 			close(socketfd);
 			close(recvfd);
 			exit(EXIT_FAILURE);
@@ -398,6 +2050,7 @@ static void accept_connection(int socketfd)
 
 		if (pid == 0) {
 			// Child process
+			log_start();
 			close(socketfd);
 			ip_port = make_ip_port(&recv_addr, recv_size);
 			transfer_ctx *t = new_transfer_ctx(ip_port);
@@ -417,17 +2070,667 @@ static void accept_connection(int socketfd)
 	close(socketfd);
 }
 
+#ifdef __linux__
+
+/*
+ * What an event driven connection is waiting to read next
+ */
+typedef enum {
+	CONN_HEADER_INIT,  // Start of the header, up to the number of files
+	CONN_HEADER_FIXED, // Rest of the fixed fields of an extended header
+	CONN_HEADER_FILES, // Name, size and hash of every file
+	CONN_RECIPE_COUNT, // Chunk count of a deduplicated file's recipe
+	CONN_RECIPE,	   // Length and digest of every chunk of the file
+	CONN_FILE,	 // Chunks of the current file
+	CONN_CLOSING,      // Flushing the last response
+} conn_state;
+
+/*
+ * A client connection driven by the event loop. Incoming bytes are
+ * buffered until the amount needed by the current state has arrived,
+ * and responses are buffered until the socket can take them.
+ */
+typedef struct {
+	int fd;
+	conn_state state;
+	transfer_ctx *t;
+
+	uint8_t *in;
+	uint32_t in_cap;
+	uint32_t in_have;
+	uint32_t in_need;
+
+	uint8_t *out;
+	uint32_t out_cap;
+	uint32_t out_have;
+	uint32_t out_sent;
+	bool polling_out; // Registered for EPOLLOUT
+} ev_conn;
+
+static void ev_file_done(ev_conn *c);
+
+/*
+ * Release all resources for an event driven connection
+ */
+static void ev_close(int epfd, ev_conn *c)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+
+	if (c->state == CONN_CLOSING && c->t->list != NULL)
+		log_msg(LEVEL_INFO, "%s's transfer complete", c->t->client_id);
+
+	destroy_transfer_ctx(c->t);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+/*
+ * Queue bytes to be written to the client
+ */
+static void ev_queue(ev_conn *c, uint8_t *data, uint32_t len)
+{
+	// Drop what has already been written before growing
+	if (c->out_sent == c->out_have)
+		c->out_have = c->out_sent = 0;
+
+	if (c->out_have + len > c->out_cap) {
+		c->out_cap = 2 * (c->out_have + len);
+		c->out = realloc(c->out, c->out_cap);
+		if (NULL == c->out)
+			mem_error();
+	}
+
+	memcpy(c->out + c->out_have, data, len);
+	c->out_have += len;
+}
+
+/*
+ * Start waiting for the given number of bytes in the given state
+ */
+static void ev_expect(ev_conn *c, conn_state state, uint32_t need)
+{
+	c->state = state;
+	c->in_have = 0;
+	c->in_need = need;
+
+	// The buffer is kept between files, it only grows for headers
+	if (need <= c->in_cap)
+		return;
+
+	free(c->in);
+	c->in = malloc(need);
+	if (NULL == c->in)
+		mem_error();
+	c->in_cap = need;
+}
+
+/*
+ * Wait for more bytes in the current state, keeping what has been
+ * read so far
+ */
+static void ev_grow(ev_conn *c, uint32_t need)
+{
+	c->in_need = need;
+	if (need <= c->in_cap)
+		return;
+
+	c->in = realloc(c->in, need);
+	if (NULL == c->in)
+		mem_error();
+	c->in_cap = need;
+}
+
+/*
+ * Write as much of the pending response as the socket will take.
+ * Returns false when the connection should be dropped.
+ */
+static bool ev_flush(int epfd, ev_conn *c)
+{
+	while (c->out_sent < c->out_have) {
+		ssize_t n = send(c->fd, c->out + c->out_sent,
+				 c->out_have - c->out_sent, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		c->out_sent += n;
+	}
+
+	// Only wait for the socket to become writable while blocked on it
+	bool pending = c->out_sent < c->out_have;
+	if (pending != c->polling_out) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.data.ptr = c;
+		ev.events = pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->polling_out = pending;
+	}
+
+	return c->state != CONN_CLOSING || c->out_sent < c->out_have;
+}
+
+/*
+ * Start receiving the chunks of the current file
+ */
+static void ev_begin_file(ev_conn *c)
+{
+	// Compressed frames are read prefix first
+	uint32_t need =
+	    chunk_frame_size(c->t->list->suite, c->t->list->chunk_size);
+	if (compressed(c->t))
+		need = FRAME_PREFIX_BYTES;
+
+	ev_expect(c, CONN_FILE, need);
+	receive_begin(c->t);
+
+	// Empty files have no chunks to wait for
+	if (!receive_pending(c->t))
+		ev_file_done(c);
+}
+
+/*
+ * Queue the responses for the files of a packed stream finished so
+ * far, and close once the whole stream has been received
+ */
+static void ev_pack_progress(ev_conn *c)
+{
+	transfer_ctx *t = c->t;
+
+	ev_queue(c, t->outbox, t->outbox_len);
+	t->outbox_len = 0;
+
+	if (!pack_pending(t))
+		ev_expect(c, CONN_CLOSING, 0);
+}
+
+/*
+ * Start receiving the current file, or close once every file
+ * has been received. A deduplicated file starts with its recipe, and
+ * every file of a packed transfer comes in a single stream.
+ */
+static void ev_next_file(ev_conn *c)
+{
+	if (c->t->cur > c->t->list->size || c->t->rejected) {
+		ev_expect(c, CONN_CLOSING, 0);
+	} else if (packed(c->t)) {
+		uint32_t need =
+		    chunk_frame_size(c->t->list->suite, c->t->list->chunk_size);
+		if (compressed(c->t))
+			need = FRAME_PREFIX_BYTES;
+
+		ev_expect(c, CONN_FILE, need);
+		pack_begin(c->t);
+		ev_pack_progress(c);
+	} else if (deduped(c->t)) {
+		ev_expect(c, CONN_RECIPE_COUNT, RECIPE_COUNT_BYTES);
+	} else {
+		ev_begin_file(c);
+	}
+}
+
+/*
+ * Queue the response for the file that was just received and move
+ * on to the next one
+ */
+static void ev_file_done(ev_conn *c)
+{
+	transfer_ctx *t = c->t;
+	uint8_t response[MAX_RETURN_SIZE];
+	uint32_t received = t->cur;
+
+	uint8_t status = receive_end(t);
+	t->cur = datalist_get_next_active(t->list, t->cur);
+
+	make_response(t, pipelined(t) ? received : t->cur, status, response);
+	ev_queue(c, response, response_size(t->list->version));
+	ev_next_file(c);
+}
+
+/*
+ * Act on a completely buffered read for the connection's current
+ * state. Returns false when the connection should be closed.
+ */
+static bool ev_process(ev_conn *c)
+{
+	transfer_ctx *t = c->t;
+
+	switch (c->state) {
+	case CONN_HEADER_INIT: {
+		log_msg(LEVEL_INFO, "Validating %s's transfer request...",
+			t->client_id);
+
+		if (header_is_burn(c->in, t))
+			return false;
+
+		// Header read so far is kept at the start of the buffer
+		uint32_t fixed = header_fixed_size(c->in);
+		if (fixed > c->in_need) {
+			c->state = CONN_HEADER_FIXED;
+			ev_grow(c, fixed);
+		} else {
+			c->state = CONN_HEADER_FILES;
+			ev_grow(c, fixed + header_files_size(c->in));
+		}
+		break;
+	}
+	case CONN_HEADER_FIXED:
+		c->state = CONN_HEADER_FILES;
+		ev_grow(c, c->in_need + header_files_size(c->in));
+		break;
+	case CONN_HEADER_FILES: {
+		uint8_t response[MAX_RETURN_SIZE];
+		if (!prepare_conn(c->in, t)) {
+			memset(response, 0, MAX_RETURN_SIZE);
+			ev_queue(c, response, response_size(header_version(c->in)));
+			ev_expect(c, CONN_CLOSING, 0);
+			break;
+		}
+
+		if (!accept_header(c->in, t))
+			return false;
+
+		make_response(t, t->cur, 0, response);
+		ev_queue(c, response, response_size(t->list->version));
+
+		if (pipelined(t)) {
+			uint32_t set_len;
+			uint8_t *set = accepted_set(t, &set_len);
+			ev_queue(c, set, set_len);
+			free(set);
+		}
+
+		if (resumable(t)) {
+			uint32_t offsets_len;
+			uint8_t *offsets = resume_offsets(t, &offsets_len);
+			ev_queue(c, offsets, offsets_len);
+			free(offsets);
+		}
+
+		ev_next_file(c);
+		break;
+	}
+	case CONN_RECIPE_COUNT: {
+		uint32_t count = recipe_count(c->in);
+		if (!recipe_count_valid(t, count)) {
+			ev_file_done(c);
+			break;
+		}
+
+		ev_expect(c, CONN_RECIPE, count * RECIPE_ENTRY_SIZE);
+		break;
+	}
+	case CONN_RECIPE:
+		if (!accept_recipe(t, c->in, c->in_need / RECIPE_ENTRY_SIZE)) {
+			ev_file_done(c);
+			break;
+		}
+
+		ev_queue(c, t->recipe->missing, recipe_bitmap_size(t->recipe));
+		ev_begin_file(c);
+		break;
+	case CONN_FILE:
+		if (compressed(t) && c->in_need == FRAME_PREFIX_BYTES) {
+			uint32_t len =
+			    frame_payload_size(t->list->suite,
+					       frame_prefix(c->in),
+					       t->list->chunk_size);
+			if (len == 0) {
+				t->rejected = true;
+				ev_file_done(c);
+			} else {
+				ev_grow(c, FRAME_PREFIX_BYTES + len);
+			}
+			break;
+		}
+
+		c->in_have = 0;
+		if (compressed(t))
+			c->in_need = FRAME_PREFIX_BYTES;
+		if (!receive_chunk(t, c->in))
+			ev_file_done(c);
+		else if (packed(t))
+			ev_pack_progress(c);
+		else if (!receive_pending(t))
+			ev_file_done(c);
+		break;
+	case CONN_CLOSING:
+		break;
+	}
+
+	return true;
+}
+
+/*
+ * Read whatever the socket has for the connection, processing each
+ * complete unit as it arrives. Returns false when the connection
+ * should be closed.
+ */
+static bool ev_read(ev_conn *c)
+{
+	while (c->state != CONN_CLOSING) {
+		uint64_t start = stats_start(c->t->st);
+		ssize_t n = recv(c->fd, c->in + c->in_have,
+				 c->in_need - c->in_have, 0);
+		if (n > 0 && NULL != c->t->st)
+			stats_add(c->t->st, chunk_idx(c->t), STAT_RECV, n,
+				  start);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			if (errno == EINTR)
+				continue;
+			if (errno != ECONNRESET) // Client dropped it
+				log_msg(LEVEL_ERROR, "recv failed: %s",
+					strerror(errno));
+			return false;
+		}
+		if (n == 0)
+			return false; // Client hung up
+
+		c->in_have += n;
+		while (c->state != CONN_CLOSING && c->in_have == c->in_need) {
+			if (!ev_process(c))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Accept every pending connection on the listening socket and
+ * register it with the event loop
+ */
+static void ev_accept(int epfd, int socketfd)
+{
+	while (!TERMINATED) {
+		struct sockaddr_storage recv_addr;
+		memset(&recv_addr, 0, sizeof(recv_addr));
+		socklen_t recv_size = sizeof(recv_addr);
+
+		int recvfd =
+		    accept(socketfd, (struct sockaddr *)&recv_addr, &recv_size);
+		if (recvfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR)
+				log_msg(LEVEL_ERROR, "accept: %s",
+					strerror(errno));
+			return;
+		}
+
+		char *ip_port = make_ip_port(&recv_addr, recv_size);
+		transfer_ctx *t = new_transfer_ctx(ip_port);
+
+		fcntl(recvfd, F_SETFL, fcntl(recvfd, F_GETFL) | O_NONBLOCK);
+
+		ev_conn *c = calloc(1, sizeof(ev_conn));
+		if (NULL == c)
+			mem_error();
+		c->fd = recvfd;
+		c->t = t;
+		ev_expect(c, CONN_HEADER_INIT, HEADER_INIT_SIZE);
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, recvfd, &ev) == -1) {
+			log_msg(LEVEL_ERROR, "epoll_ctl: %s", strerror(errno));
+			destroy_transfer_ctx(t);
+			close(recvfd);
+			free(c->in);
+			free(c);
+		}
+	}
+}
+
+/*
+ * Serve every client from a single process. Each connection is a
+ * state machine advanced as its socket becomes readable or writable,
+ * so no process is created per client.
+ */
+static void event_loop(int socketfd)
+{
+	int epfd = epoll_create1(0);
+	if (epfd == -1) {
+		log_msg(LEVEL_ERROR, "epoll_create1: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
+
+	// The listening socket is tagged with a NULL connection
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, socketfd, &ev) == -1) {
+		log_msg(LEVEL_ERROR, "epoll_ctl: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+
+	while (!TERMINATED) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log_msg(LEVEL_ERROR, "epoll_wait: %s", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			ev_conn *c = events[i].data.ptr;
+			if (NULL == c) {
+				ev_accept(epfd, socketfd);
+				continue;
+			}
+
+			bool keep = true;
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
+				keep = (events[i].events & EPOLLIN) != 0;
+			if (keep && (events[i].events & EPOLLIN))
+				keep = ev_read(c);
+			if (keep)
+				keep = ev_flush(epfd, c);
+			if (!keep)
+				ev_close(epfd, c);
+		}
+	}
+
+	close(epfd);
+	close(socketfd);
+}
+
+#else
+
+static void event_loop(int socketfd)
+{
+	log_msg(LEVEL_ERROR, "event loop mode is only supported on Linux");
+	close(socketfd);
+	exit(EXIT_FAILURE);
+}
+
+#endif /* __linux__ */
+
+/*
+ * Pin the calling process to a single core, chosen round robin by
+ * worker number
+ */
+static void pin_worker(int worker)
+{
+#ifdef __linux__
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(worker % cores, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		log_msg(LEVEL_ERROR, "sched_setaffinity: %s",
+			strerror(errno));
+#else
+	(void)worker;
+#endif
+}
+
+/*
+ * Fork the long lived worker process of the given number, pinned to a
+ * core with its own listening socket on the port. Returns its pid.
+ */
+static pid_t start_worker(int worker, pid_t *pids, char *port, int backlog,
+			  bool evented)
+{
+	pid_t pid = fork();
+	if (pid == -1) {
+		log_msg(LEVEL_ERROR, "fork error: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		// Nothing a worker forks is waited for
+		signal(SIGCHLD, SIG_IGN);
+		log_start();
+		free(pids);
+		pin_worker(worker);
+		long_lived = true;
+
+		int sfd = server_socket(port, backlog, true);
+		if (evented)
+			event_loop(sfd);
+		else
+			serve_connections(sfd);
+
+		free(port);
+		exit(EXIT_SUCCESS);
+	}
+
+	return pid;
+}
+
+/*
+ * Start the given number of long lived worker processes and replace
+ * any that dies, until interrupted, then stop every worker
+ */
+static void run_workers(int workers, char *port, int backlog, bool evented)
+{
+	pid_t *pids = calloc(workers, sizeof(pid_t));
+	time_t *started = calloc(workers, sizeof(time_t));
+	if (NULL == pids || NULL == started)
+		mem_error();
+
+	// Workers are waited for rather than reaped automatically
+	signal(SIGCHLD, SIG_DFL);
+
+	for (int i = 0; i < workers; i++) {
+		pids[i] = start_worker(i, pids, port, backlog, evented);
+		started[i] = time(NULL);
+	}
+
+	log_msg(LEVEL_INFO, "Started %d workers", workers);
+
+	while (!TERMINATED) {
+		int status;
+		pid_t pid = wait(&status);
+		if (pid == -1) {
+			if (errno != EINTR)
+				pause(); // No children left to wait for
+			continue;
+		}
+
+		for (int i = 0; i < workers && !TERMINATED; i++) {
+			if (pids[i] != pid)
+				continue;
+
+			log_msg(LEVEL_ERROR, "Worker %d died, restarting it",
+				i);
+
+			// A worker that can't stay up isn't restarted in a loop
+			if (time(NULL) - started[i] < 1)
+				sleep(1);
+			pids[i] = start_worker(i, pids, port, backlog, evented);
+			started[i] = time(NULL);
+		}
+	}
+
+	for (int i = 0; i < workers; i++)
+		kill(pids[i], SIGINT);
+
+	// Wait returns once every worker is gone
+	while (wait(NULL) != -1 || errno == EINTR)
+		;
+
+	free(started);
+	free(pids);
+}
+
 int main(int argc, char *argv[])
 {
 	int opt = 0;
+	int workers = 0;
+	int backlog = DEFAULT_BACKLOG;
+	bool evented = false;
 	char *port = NULL;
+	char *metrics_path = NULL;
+	int log_min = LEVEL_INFO;
+	bool log_json = false;
+	long log_rate = 0;
 	init_sig_handler();
 
-	while ((opt = getopt(argc, argv, "p:h")) != -1) {
+	while ((opt = getopt(argc, argv, "p:ew:q:t:UTM:l:JR:h")) != -1) {
 		switch (opt) {
 		case 'p':
 			port = strdup(optarg);
 			break;
+		case 'e':
+			evented = true;
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'q':
+			backlog = atoi(optarg);
+			if (backlog < 1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 't':
+			decrypt_threads = atoi(optarg);
+			if (decrypt_threads < 0 ||
+			    decrypt_threads > MAX_DECRYPT_THREADS)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'U':
+			batched = true;
+			break;
+		case 'T':
+			timed = true;
+			break;
+		case 'M':
+			metrics_path = optarg;
+			break;
+		case 'l':
+			log_min = log_level(optarg);
+			if (log_min == -1)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'J':
+			log_json = true;
+			break;
+		case 'R':
+			log_rate = atol(optarg);
+			if (log_rate < 1 || log_rate > UINT32_MAX)
+				usage(argv[0], EXIT_FAILURE);
+			break;
 		case 'h':
 			usage(argv[0], EXIT_SUCCESS);
 		case ':':
@@ -442,13 +2745,42 @@ int main(int argc, char *argv[])
 	if (NULL == port)
 		port = strdup(DEFAULT_SERVER_PORT);
 
-	int sfd = server_socket(port);
+	log_init(log_min, log_json, log_rate);
+	log_start();
+
+	// A single core gains nothing from handing chunks between threads
+	if (decrypt_threads == -1) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		decrypt_threads = cores < DEFAULT_DECRYPT_THREADS
+				      ? (int)cores
+				      : DEFAULT_DECRYPT_THREADS;
+		if (decrypt_threads < 2)
+			decrypt_threads = 0;
+	}
 
 	ensure_dir(KEYS_DIR);
 	ensure_dir(RECV_DIR);
 
-	accept_connection(sfd);
+	// Counters are shared with every process forked from here on
+	if (NULL != metrics_path)
+		metrics_init(metrics_path);
+
+	if (workers > 0) {
+		run_workers(workers, port, backlog, evented);
+		metrics_stop();
+		free(port);
+		return EXIT_SUCCESS;
+	}
+
+	int sfd = server_socket(port, backlog, false);
+	long_lived = evented;
+
+	if (evented)
+		event_loop(sfd);
+	else
+		accept_connection(sfd);
 
+	metrics_stop();
 	free(port);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,147 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Per stage timing of a transfer, kept per file and reported
+ *  per file and per session when asked for
+ */
+
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "stats.h"
+
+static const char *stage_names[STAT_STAGES] = {
+    "read", "randomize", "compress", "encrypt", "send",
+    "recv", "decrypt",   "hash",     "write",   "rename"};
+
+static stats_observer observer; // Sees the stages of every transfer
+
+transfer_stats *stats_init(uint32_t files)
+{
+	transfer_stats *st = malloc(sizeof(transfer_stats));
+	if (NULL == st)
+		mem_error();
+
+	st->files = files;
+	st->stages = calloc((size_t)(files + 1) * STAT_STAGES,
+			    sizeof(stage_stat));
+	st->names = calloc(files + 1, sizeof(char *));
+	if (NULL == st->stages || NULL == st->names)
+		mem_error();
+
+	return st;
+}
+
+void stats_name(transfer_stats *st, uint32_t file, char *name)
+{
+	if (NULL != st && file <= st->files)
+		st->names[file] = name;
+}
+
+uint64_t stats_start(transfer_stats *st)
+{
+	if (NULL == st)
+		return 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_add(transfer_stats *st, uint32_t file, int stage, uint64_t bytes,
+	       uint64_t start)
+{
+	if (NULL == st || file > st->files)
+		return;
+
+	uint64_t ns = stats_start(st) - start;
+	stage_stat *s = &st->stages[(size_t)file * STAT_STAGES + stage];
+	__atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->ns, ns, __ATOMIC_RELAXED);
+
+	if (NULL != observer)
+		observer(stage, bytes, ns);
+}
+
+void stats_observe(stats_observer fn) { observer = fn; }
+
+const char *stats_stage_name(int stage) { return stage_names[stage]; }
+
+/*
+ * Write a line for each stage with calls in the given counters, the
+ * first under the given label
+ */
+static void report_stages(FILE *out, const char *label, stage_stat *stages)
+{
+	for (int i = 0; i < STAT_STAGES; i++) {
+		stage_stat *s = &stages[i];
+		if (s->calls == 0)
+			continue;
+
+		double ms = s->ns / 1e6;
+		fprintf(out, "%-32.32s %-10s %10llu %14llu %12.3f", label,
+			stage_names[i], (unsigned long long)s->calls,
+			(unsigned long long)s->bytes, ms);
+		if (s->bytes > 0 && s->ns > 0)
+			fprintf(out, " %10.1f\n", s->bytes * 1e3 / s->ns);
+		else
+			fprintf(out, " %10s\n", "-");
+		label = "";
+	}
+}
+
+void stats_report(transfer_stats *st, FILE *out, char *title)
+{
+	stage_stat session[STAT_STAGES];
+	memset(session, 0, sizeof(session));
+
+	// Lines of reports from other threads aren't mixed in
+	flockfile(out);
+	fprintf(out, "Stage timing for %s:\n", title);
+	fprintf(out, "%-32s %-10s %10s %14s %12s %10s\n", "file", "stage",
+		"calls", "bytes", "ms", "MB/s");
+
+	for (uint32_t f = 0; f <= st->files; f++) {
+		stage_stat *stages = &st->stages[(size_t)f * STAT_STAGES];
+		for (int i = 0; i < STAT_STAGES; i++) {
+			session[i].calls += stages[i].calls;
+			session[i].bytes += stages[i].bytes;
+			session[i].ns += stages[i].ns;
+		}
+
+		char label[PATH_MAX];
+		if (NULL != st->names[f])
+			snprintf(label, sizeof(label), "%s", st->names[f]);
+		else if (f == 0)
+			snprintf(label, sizeof(label), "(stream)");
+		else
+			snprintf(label, sizeof(label), "#%u", f);
+		report_stages(out, basename(label), stages);
+	}
+
+	report_stages(out, "(session)", session);
+	fflush(out);
+	funlockfile(out);
+}
+
+void stats_destroy(transfer_stats *st)
+{
+	free(st->stages);
+	free(st->names);
+	free(st);
+}
@@ -0,0 +1,105 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to per stage timing of a transfer, kept per file
+ *  and reported per file and per session when asked for
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Stages of sending a chunk
+#define STAT_READ 0      // Reading the file
+#define STAT_RANDOMIZE 1 // Padding the last chunk with random bytes
+#define STAT_COMPRESS 2  // Deflating the chunk
+#define STAT_ENCRYPT 3
+#define STAT_SEND 4
+
+// Stages of receiving a chunk
+#define STAT_RECV 5
+#define STAT_DECRYPT 6 // Inflating a compressed chunk included
+#define STAT_HASH 7
+#define STAT_WRITE 8
+#define STAT_RENAME 9 // Storing the checked file under its hash
+#define STAT_STAGES 10
+
+/*
+ * Counters of one stage of one file
+ */
+typedef struct {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t ns;
+} stage_stat;
+
+/*
+ * Counters of every stage of each file of a transfer, by the file's
+ * index in the transfer. Index 0 holds what belongs to no one file,
+ * like the stream of a packed transfer. Counters are added to
+ * atomically, from any thread.
+ */
+typedef struct {
+	uint32_t files;
+	stage_stat *stages; // STAT_STAGES per index
+	char **names;	    // Names to report each index by, may be NULL
+} transfer_stats;
+
+/*
+ * Function handed every stage counted by stats_add, of any transfer,
+ * with the bytes it handled and the ns it took
+ */
+typedef void (*stats_observer)(int stage, uint64_t bytes, uint64_t ns);
+
+/*
+ * Return counters for a transfer of the given number of files
+ */
+transfer_stats *stats_init(uint32_t files);
+
+/*
+ * Name the file at the given index in the report. The name isn't
+ * copied, it must outlive the counters.
+ */
+void stats_name(transfer_stats *st, uint32_t file, char *name);
+
+/*
+ * Return the time a stage starts at, for stats_add. Returns 0 without
+ * reading the clock when st is NULL, timing being disabled.
+ */
+uint64_t stats_start(transfer_stats *st);
+
+/*
+ * Count a call of the stage for the file at the given index, that
+ * handled the given number of bytes since the start given by
+ * stats_start. Does nothing when st is NULL.
+ */
+void stats_add(transfer_stats *st, uint32_t file, int stage, uint64_t bytes,
+	       uint64_t start);
+
+/*
+ * Hand every stage counted from now on to the given function as well,
+ * NULL to stop
+ */
+void stats_observe(stats_observer fn);
+
+/*
+ * Return the name the given stage is reported by
+ */
+const char *stats_stage_name(int stage);
+
+/*
+ * Write the calls, bytes and time of each stage of every file with any,
+ * then of the whole session, under the given title
+ */
+void stats_report(transfer_stats *st, FILE *out, char *title);
+
+/*
+ * Free the counters
+ */
+void stats_destroy(transfer_stats *st);
+
+#endif /* STATS_H */
@@ -0,0 +1,174 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Choice of the chunk size files are sent in, fixed or tuned
+ *  to the link
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "common.h"
+#include "tune.h"
+
+chunk_tuner *tuner_init(uint32_t fixed, char *path, char *server)
+{
+	chunk_tuner *ct = calloc(1, sizeof(chunk_tuner));
+	if (NULL == ct)
+		mem_error();
+
+	pthread_mutex_init(&ct->lock, NULL);
+	ct->fixed = fixed;
+	ct->path = strdup(path);
+	ct->server = strdup(server);
+	if (NULL == ct->path || NULL == ct->server)
+		mem_error();
+
+	// A fixed size needs no measurements
+	FILE *fp = fixed == 0 ? fopen(path, "r") : NULL;
+	if (NULL == fp)
+		return ct;
+
+	// Each line holds the measurements for one server
+	char line[TUNE_LINE_BYTES], name[TUNE_LINE_BYTES];
+	double rate;
+	unsigned int sndbuf;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%255s %lf %u", name, &rate, &sndbuf) == 3 &&
+		    strcmp(name, server) == 0 && rate > 0) {
+			ct->rate = rate;
+			ct->sndbuf = sndbuf;
+		}
+	}
+
+	fclose(fp);
+	return ct;
+}
+
+/*
+ * Return the largest power of two no larger than the given value, 1 for
+ * values below it
+ */
+static uint64_t floor_pow2(uint64_t value)
+{
+	uint64_t p = 1;
+	while (p <= value / 2)
+		p *= 2;
+
+	return p;
+}
+
+uint32_t tuner_chunk_size(chunk_tuner *ct, uint64_t bytes, uint32_t files)
+{
+	if (ct->fixed != 0)
+		return ct->fixed;
+
+	pthread_mutex_lock(&ct->lock);
+	double rate = ct->rate;
+	uint32_t sndbuf = ct->sndbuf;
+	pthread_mutex_unlock(&ct->lock);
+
+	if (rate == 0)
+		return DEFAULT_CHUNK_SIZE;
+
+	uint64_t size = rate * TUNE_FRAME_NS / 1000000000;
+
+	// A chunk larger than half the send buffer can't be written while
+	// the one before it drains
+	if (sndbuf > 0 && size > sndbuf / 2)
+		size = sndbuf / 2;
+
+	// Every file's last chunk is padded, so small files keep chunks
+	// small
+	if (files > 0 && size > 2 * (bytes / files))
+		size = 2 * (bytes / files);
+
+	size = floor_pow2(size);
+	if (size < MIN_CHUNK_SIZE)
+		size = MIN_CHUNK_SIZE;
+	if (size > MAX_CHUNK_SIZE)
+		size = MAX_CHUNK_SIZE;
+
+	return size;
+}
+
+void tuner_record(chunk_tuner *ct, int sfd, uint64_t bytes, uint64_t ns)
+{
+	if (ct->fixed != 0 || bytes < TUNE_MIN_BYTES || ns == 0)
+		return;
+
+	// The kernel grows the send buffer with the link, so it is read
+	// once the connection has been busy
+	int sndbuf = 0;
+	socklen_t len = sizeof(sndbuf);
+	if (getsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1)
+		sndbuf = 0;
+
+	double measured = (double)bytes * 1000000000 / ns;
+
+	pthread_mutex_lock(&ct->lock);
+	ct->rate = ct->rate == 0 ? measured : (3 * ct->rate + measured) / 4;
+	if ((uint32_t)sndbuf > ct->sndbuf)
+		ct->sndbuf = sndbuf;
+	ct->dirty = true;
+	pthread_mutex_unlock(&ct->lock);
+}
+
+uint64_t tuner_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void tuner_save(chunk_tuner *ct)
+{
+	if (!ct->dirty)
+		return;
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ct->path);
+
+	FILE *out = fopen(tmp, "w");
+	if (NULL == out) {
+		perror("chunk tuning");
+		return;
+	}
+
+	// Lines of the other servers are copied over as they are
+	char line[TUNE_LINE_BYTES], name[TUNE_LINE_BYTES];
+	FILE *in = fopen(ct->path, "r");
+	while (NULL != in && fgets(line, sizeof(line), in) != NULL) {
+		if (sscanf(line, "%255s", name) == 1 &&
+		    strcmp(name, ct->server) != 0)
+			fputs(line, out);
+	}
+	if (NULL != in)
+		fclose(in);
+
+	fprintf(out, "%s %.0f %u\n", ct->server, ct->rate, ct->sndbuf);
+	if (fclose(out) != 0 || rename(tmp, ct->path) == -1) {
+		perror("chunk tuning");
+		remove(tmp);
+		return;
+	}
+
+	ct->dirty = false;
+}
+
+void tuner_destroy(chunk_tuner *ct)
+{
+	pthread_mutex_destroy(&ct->lock);
+	free(ct->path);
+	free(ct->server);
+	free(ct);
+}
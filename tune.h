@@ -0,0 +1,80 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to the choice of the chunk size files are sent in.
+ *  The size is either fixed, or tuned to the link: it grows with the
+ *  throughput earlier connections to the server reached, as far as the
+ *  socket's send buffer allows, and is remembered between runs.
+ */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define DEFAULT_TUNE_PATH ".chunktune"
+#define TUNE_FRAME_NS 2000000	// Time a tuned chunk should take on the link
+#define TUNE_MIN_BYTES (1 << 24) // Least a connection sends to be measured
+#define TUNE_LINE_BYTES 256	 // Longest line of measurements, server included
+
+/*
+ * Chunk size of a client's connections, and what the tuned size is
+ * based on. Every connection of the client shares it.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t fixed; // Chunk size given by the user, 0 when tuned
+	char *path;	// Where measurements are kept between runs
+	char *server;   // ip:port of the server they are for
+	double rate;    // Smoothed bytes per second a connection sent
+	uint32_t sndbuf; // Largest send buffer a connection grew to
+	bool dirty;
+} chunk_tuner;
+
+/*
+ * Create a tuner that always picks the given chunk size, or tunes it
+ * when the size is 0, starting from what was measured for the given
+ * server by earlier runs. Measurements are kept at the given path.
+ */
+chunk_tuner *tuner_init(uint32_t fixed, char *path, char *server);
+
+/*
+ * Return the chunk size for a connection sending the given number of
+ * bytes, spread over the given number of files each padded to a whole
+ * chunk. Tuned sizes start at DEFAULT_CHUNK_SIZE, then aim for a chunk
+ * per TUNE_FRAME_NS of measured throughput, at most half the send
+ * buffer and no larger than the files need.
+ */
+uint32_t tuner_chunk_size(chunk_tuner *ct, uint64_t bytes, uint32_t files);
+
+/*
+ * Record that the connection on the given socket sent the given number
+ * of bytes in the given time. Connections sending under TUNE_MIN_BYTES
+ * are too short to tell the link's speed and are ignored.
+ */
+void tuner_record(chunk_tuner *ct, int sfd, uint64_t bytes, uint64_t ns);
+
+/*
+ * Return a monotonic clock reading in nanoseconds, to time connections
+ * with
+ */
+uint64_t tuner_clock(void);
+
+/*
+ * Write the measurements back to the tuner's path if they changed,
+ * keeping those of other servers. The file is replaced atomically.
+ */
+void tuner_save(chunk_tuner *ct);
+
+/*
+ * Free the tuner
+ */
+void tuner_destroy(chunk_tuner *ct);
+
+#endif /* TUNE_H */
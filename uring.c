@@ -0,0 +1,396 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Batched I/O through Linux's io_uring, driven with raw system
+ *  calls so no library is needed
+ */
+
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE // Enable macros for OS X
+#else
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define URING_CANCEL UINT64_MAX // user_data of the cancellation request
+
+// Operations the rings use, io_uring_setup alone doesn't promise them
+static const uint8_t needed_ops[] = {IORING_OP_READ_FIXED, IORING_OP_READ,
+				     IORING_OP_SEND, IORING_OP_RECV,
+				     IORING_OP_ASYNC_CANCEL};
+
+/*
+ * Returns true if the ring's kernel supports every operation used
+ */
+static bool uring_probe(int fd)
+{
+	size_t len = sizeof(struct io_uring_probe) +
+		     256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	if (NULL == probe)
+		mem_error();
+
+	bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			  probe, 256) == 0;
+	for (size_t i = 0; ok && i < sizeof(needed_ops); i++) {
+		uint8_t op = needed_ops[i];
+		ok = op <= probe->last_op &&
+		     (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return ok;
+}
+
+/*
+ * Map the ring's queues from the kernel. Returns false if any of them
+ * can't be.
+ */
+static bool uring_map(uring *u, struct io_uring_params *p)
+{
+	u->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	u->cq_map_len =
+	    p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	bool single = p->features & IORING_FEAT_SINGLE_MMAP;
+	if (single && u->cq_map_len > u->sq_map_len)
+		u->sq_map_len = u->cq_map_len;
+
+	u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED)
+		return false;
+
+	u->cq_map = u->sq_map;
+	if (!single)
+		u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       u->fd, IORING_OFF_SQES);
+	if (u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED)
+		return false;
+
+	uint8_t *sq = u->sq_map, *cq = u->cq_map;
+	u->sq_head = (unsigned *)(sq + p->sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p->sq_off.array);
+	u->cq_head = (unsigned *)(cq + p->cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	u->cqes = cq + p->cq_off.cqes;
+	return true;
+}
+
+uring *uring_init(void)
+{
+	uring *u = calloc(1, sizeof(uring));
+	if (NULL == u)
+		mem_error();
+
+	u->sq_map = u->cq_map = u->sqes = MAP_FAILED;
+	for (int i = 0; i < URING_FILES; i++)
+		u->files[i] = -1;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->fd == -1) {
+		free(u);
+		return NULL;
+	}
+
+	u->entries = p.sq_entries;
+	if (!uring_probe(u->fd) || !uring_map(u, &p)) {
+		uring_destroy(u);
+		return NULL;
+	}
+
+	return u;
+}
+
+bool uring_register_buffers(uring *u, struct iovec *bufs, uint32_t n)
+{
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+		    bufs, n) == -1)
+		return false;
+
+	u->bufs = malloc(n * sizeof(struct iovec));
+	if (NULL == u->bufs)
+		mem_error();
+
+	memcpy(u->bufs, bufs, n * sizeof(struct iovec));
+	u->n_bufs = n;
+	return true;
+}
+
+bool uring_register_files(uring *u, int *fds, uint32_t n)
+{
+	if (n > URING_FILES ||
+	    syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, fds,
+		    n) == -1)
+		return false;
+
+	memcpy(u->files, fds, n * sizeof(int));
+	u->n_files = n;
+	return true;
+}
+
+/*
+ * Return the next free submission queue entry, cleared. It is only
+ * seen by the kernel once queued.
+ */
+static struct io_uring_sqe *uring_sqe(uring *u)
+{
+	unsigned tail = *u->sq_tail;
+	struct io_uring_sqe *sqe =
+	    (struct io_uring_sqe *)u->sqes + (tail & *u->sq_mask);
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * Hand the entry returned last by uring_sqe to the kernel, numbered
+ * with the given user data. Registered descriptors are used in place of
+ * the ones they stand for.
+ */
+static void uring_queue(uring *u, struct io_uring_sqe *sqe, uint64_t data)
+{
+	for (uint32_t i = 0; i < u->n_files; i++) {
+		if (u->files[i] == sqe->fd) {
+			sqe->fd = i;
+			sqe->flags |= IOSQE_FIXED_FILE;
+			break;
+		}
+	}
+
+	unsigned tail = *u->sq_tail;
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	sqe->user_data = data;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_read(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     uint64_t offset)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+
+	for (uint32_t i = 0; i < u->n_bufs; i++) {
+		uint8_t *base = u->bufs[i].iov_base;
+		if (buf >= base && buf + len <= base + u->bufs[i].iov_len) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->buf_index = i;
+			break;
+		}
+	}
+
+	uring_queue(u, sqe, u->queued++);
+}
+
+void uring_prep_send(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     bool link)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+
+	uring_queue(u, sqe, u->queued++);
+}
+
+void uring_prep_recv(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     bool link)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_WAITALL;
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+
+	uring_queue(u, sqe, u->queued++);
+}
+
+/*
+ * Store the results of completed operations, returning how many of the
+ * queued operations they were
+ */
+static uint32_t uring_reap(uring *u, int32_t *res, uint32_t n)
+{
+	uint32_t reaped = 0;
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe =
+		    (struct io_uring_cqe *)u->cqes + (head & *u->cq_mask);
+		if (cqe->user_data < n) {
+			res[cqe->user_data] = cqe->res;
+			reaped++;
+		}
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return reaped;
+}
+
+/*
+ * Queue the cancellation of each of the first n operations, by the
+ * user data it was queued with, which works on every kernel the ring
+ * does. Operations already completed just aren't found.
+ */
+static void uring_cancel(uring *u, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = i;
+		uring_queue(u, sqe, URING_CANCEL);
+	}
+}
+
+int uring_run(uring *u, int32_t *res)
+{
+	uint32_t n = u->queued;
+	uint32_t done = 0;
+	bool interrupted = false;
+	u->queued = 0;
+
+	while (done < n) {
+		unsigned pending = *u->sq_tail -
+				   __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter, u->fd, pending, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+			if (errno != EINTR) {
+				perror("io_uring_enter");
+				exit(EXIT_FAILURE);
+			}
+
+			// The buffers must outlive whatever is still in
+			// flight, so it is cancelled and waited for
+			if (!interrupted)
+				uring_cancel(u, n);
+			interrupted = true;
+		}
+
+		done += uring_reap(u, res, n);
+	}
+
+	return interrupted ? -1 : 0;
+}
+
+void uring_destroy(uring *u)
+{
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_map != MAP_FAILED && u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_map_len);
+	if (u->sq_map != MAP_FAILED)
+		munmap(u->sq_map, u->sq_map_len);
+
+	close(u->fd);
+	free(u->bufs);
+	free(u);
+}
+
+#else
+
+uring *uring_init(void)
+{
+	return NULL;
+}
+
+bool uring_register_buffers(uring *u, struct iovec *bufs, uint32_t n)
+{
+	(void)u;
+	(void)bufs;
+	(void)n;
+	return false;
+}
+
+bool uring_register_files(uring *u, int *fds, uint32_t n)
+{
+	(void)u;
+	(void)fds;
+	(void)n;
+	return false;
+}
+
+void uring_prep_read(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     uint64_t offset)
+{
+	(void)u;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offset;
+}
+
+void uring_prep_send(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     bool link)
+{
+	(void)u;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)link;
+}
+
+void uring_prep_recv(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     bool link)
+{
+	(void)u;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)link;
+}
+
+int uring_run(uring *u, int32_t *res)
+{
+	(void)u;
+	(void)res;
+	return 0;
+}
+
+void uring_destroy(uring *u)
+{
+	free(u);
+}
+
+#endif /* __linux__ */
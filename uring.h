@@ -0,0 +1,111 @@
+/*
+ *  Group 3
+ *  Assignment #3 - Secure File Transfer
+ *  CMPT361 F17
+ *
+ *  Purpose: Interface to batched I/O through Linux's io_uring, driven
+ *  with raw system calls. Where io_uring is unavailable no ring can be
+ *  created and callers keep to the plain system calls.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 64 // Submission queue entries of a ring
+#define URING_BATCH 32   // Most operations submitted at once, half the
+			 // entries to leave room for cancelling them
+#define URING_FILES 2    // Most file descriptors registered with a ring
+
+/*
+ * A submission and completion queue pair shared with the kernel. Only
+ * one thread may use a ring at a time.
+ */
+typedef struct {
+	int fd;
+	uint32_t entries;
+
+	// Submission queue, mapped from the kernel
+	void *sq_map;
+	size_t sq_map_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	void *sqes; // struct io_uring_sqe[entries]
+	size_t sqes_len;
+
+	// Completion queue, sharing sq_map when the kernel allows it
+	void *cq_map;
+	size_t cq_map_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *cqes; // struct io_uring_cqe[]
+
+	uint32_t queued; // Operations prepared since the last submission
+	int files[URING_FILES]; // Registered descriptors, -1 when unused
+	uint32_t n_files;
+	struct iovec *bufs; // Registered buffers, by index
+	uint32_t n_bufs;
+} uring;
+
+/*
+ * Create a ring, or return NULL when the kernel or platform has no
+ * io_uring or refuses it to the process
+ */
+uring *uring_init(void);
+
+/*
+ * Register buffers the ring reads into without mapping them on every
+ * operation. Returns false, leaving the buffers unregistered, when the
+ * kernel refuses them.
+ */
+bool uring_register_buffers(uring *u, struct iovec *bufs, uint32_t n);
+
+/*
+ * Register up to URING_FILES descriptors, which operations on them then
+ * use without looking them up. Returns false, leaving the descriptors
+ * unregistered, when the kernel refuses them.
+ */
+bool uring_register_files(uring *u, int *fds, uint32_t n);
+
+/*
+ * Queue a read of len bytes of the file at offset into buf. A buffer
+ * that was registered is read into as one.
+ */
+void uring_prep_read(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     uint64_t offset);
+
+/*
+ * Queue a send of len bytes of buf on the socket, that only completes
+ * once all of them are sent. Linked operations only start once the one
+ * before them completed in full, and are cancelled otherwise.
+ */
+void uring_prep_send(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     bool link);
+
+/*
+ * Queue a receive of len bytes from the socket into buf, completing
+ * once all of them arrived. Linked like uring_prep_send.
+ */
+void uring_prep_recv(uring *u, int fd, uint8_t *buf, uint32_t len,
+		     bool link);
+
+/*
+ * Submit the queued operations and wait for all of them, storing each
+ * one's result in res, in the order they were queued: the byte count,
+ * or a negated errno. Returns -1 when interrupted by a signal, once
+ * the operations still in flight were cancelled, 0 otherwise.
+ */
+int uring_run(uring *u, int32_t *res);
+
+/*
+ * Free the ring and unregister its buffers and files
+ */
+void uring_destroy(uring *u);
+
+#endif /* URING_H */